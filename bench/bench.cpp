@@ -0,0 +1,366 @@
+// Microbenchmarks of the core stock operations on synthetic data.
+// Built twice by CMake, once per backend (STOCK_FLAT_BACKEND), so the same
+// benchmark names compare the AVL tree and the flat arrays directly.
+#include "../main.cpp"
+
+#include <benchmark/benchmark.h>
+
+namespace {
+
+const uint32_t DATASET_SEED = 42;
+
+// Function to make the n-th synthetic ticker: six letters, unique for n < 26^6
+string syntheticTicker(uint32_t n) {
+    // 1000003 is coprime to 26^6, so the codes are a permutation and neighbours scatter
+    uint64_t code = uint64_t(n) * 1000003 % 308915776;
+    string ticker(6, 'A');
+    for (int i = 5; i >= 0; --i, code /= 26) ticker[size_t(i)] = char('A' + code % 26);
+    return ticker;
+}
+
+// Function to make synthetic quotes with last prices uniform in [1, 1000)
+StockData syntheticStock(uint32_t n, mt19937& random) {
+    uniform_real_distribution<float> price(1.0f, 1000.0f);
+    uniform_real_distribution<float> change(-0.05f, 0.05f);
+    StockData stock;
+    stock.ticker = syntheticTicker(n);
+    stock.open = price(random);
+    stock.lastPrice = stock.open * (1.0f + change(random));
+    stock.dayHigh = max(stock.open, stock.lastPrice) * 1.01f;
+    stock.dayLow = min(stock.open, stock.lastPrice) * 0.99f;
+    stock.chartTodayPath = "https://charts.example.com/" + stock.ticker + "/today";
+    stock.chart30DaysPath = "https://charts.example.com/" + stock.ticker + "/30";
+    stock.chart365DaysPath = "https://charts.example.com/" + stock.ticker + "/365";
+    return stock;
+}
+
+// Function to get n synthetic stocks in random ticker order; datasets are
+// built once per size and shared by the benchmarks
+const vector<StockData>& dataset(size_t n) {
+    static unordered_map<size_t, vector<StockData>> cache;
+    auto it = cache.find(n);
+    if (it != cache.end()) return it->second;
+
+    mt19937 random(DATASET_SEED);
+    vector<StockData>& stocks = cache[n];
+    stocks.reserve(n);
+    for (size_t i = 0; i < n; ++i) stocks.push_back(syntheticStock(uint32_t(i), random));
+    return stocks;
+}
+
+// Function to write dataset(n) in the livestock CSV layout once and return its path
+const string& datasetFile(size_t n) {
+    static unordered_map<size_t, string> cache;
+    auto it = cache.find(n);
+    if (it != cache.end()) return it->second;
+
+    string path = (filesystem::temp_directory_path() / ("stock_bench_" + to_string(n) + ".csv")).string();
+    ofstream out(path, ios::trunc);
+    out << "c0,ticker,c2,open,high,low,last";
+    for (int c = 7; c < 25; ++c) out << ",c" << c;
+    out << '\n';
+    for (const auto& stock : dataset(n)) {
+        out << "x," << stock.ticker << ",x," << stock.open << ',' << stock.dayHigh << ',' << stock.dayLow << ','
+            << stock.lastPrice;
+        for (int c = 7; c < 20; ++c) out << ",x";
+        out << ',' << stock.chart365DaysPath << ",x,x," << stock.chart30DaysPath << ',' << stock.chartTodayPath << '\n';
+    }
+    return cache[n] = path;
+}
+
+// Sizes from 1k to 1M symbols
+void symbolCounts(benchmark::internal::Benchmark* bench) {
+    for (long n : {1L << 10, 1L << 13, 1L << 16, 1L << 19, 1L << 20}) bench->Arg(n);
+}
+
+// Sizes for building or emptying a tree one stock at a time. Every insert or
+// delete shifts the flat backend's arrays, so it stops at 64k symbols.
+void oneByOneCounts(benchmark::internal::Benchmark* bench) {
+#ifdef STOCK_FLAT_BACKEND
+    for (long n : {1L << 10, 1L << 13, 1L << 16}) bench->Arg(n);
+#else
+    symbolCounts(bench);
+#endif
+}
+
+// Inserting every stock, in random ticker order, into an empty tree
+void BM_Insert(benchmark::State& state) {
+    const vector<StockData>& stocks = dataset(size_t(state.range(0)));
+    StockTree tree;
+    for (auto _ : state) {
+        state.PauseTiming();
+        tree.clear();
+        state.ResumeTiming();
+        for (const auto& stock : stocks) tree.insert(stock);
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(stocks.size()));
+}
+BENCHMARK(BM_Insert)->Apply(oneByOneCounts)->Unit(benchmark::kMillisecond);
+
+// Deleting every stock of a full tree, in random ticker order
+void BM_DeleteStock(benchmark::State& state) {
+    const vector<StockData>& stocks = dataset(size_t(state.range(0)));
+    StockTree tree;
+    for (auto _ : state) {
+        state.PauseTiming();
+        tree.bulkLoad(stocks);
+        state.ResumeTiming();
+        for (const auto& stock : stocks) tree.deleteStock(stock.ticker);
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(stocks.size()));
+}
+BENCHMARK(BM_DeleteStock)->Apply(oneByOneCounts)->Unit(benchmark::kMillisecond);
+
+// Replacing the prices of random stocks; every price field moves
+void BM_Update(benchmark::State& state) {
+    const vector<StockData>& stocks = dataset(size_t(state.range(0)));
+    StockTree tree;
+    tree.bulkLoad(stocks);
+
+    mt19937 random(DATASET_SEED + 1);
+    uniform_int_distribution<size_t> pick(0, stocks.size() - 1);
+    vector<StockData> updates;
+    for (int i = 0; i < 4096; ++i) updates.push_back(syntheticStock(uint32_t(pick(random)), random));
+
+    size_t next = 0;
+    for (auto _ : state) {
+        tree.update(updates[next]);
+        next = (next + 1) % updates.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Update)->Apply(symbolCounts);
+
+// Looking up random tickers and formatting the row, as the menu does
+void BM_FetchByName(benchmark::State& state) {
+    const vector<StockData>& stocks = dataset(size_t(state.range(0)));
+    StockTree tree;
+    tree.bulkLoad(stocks);
+    StockWriter writer(OutputFormat::Table);
+
+    mt19937 random(DATASET_SEED + 2);
+    uniform_int_distribution<size_t> pick(0, stocks.size() - 1);
+    vector<string> tickers;
+    for (int i = 0; i < 4096; ++i) tickers.push_back(stocks[pick(random)].ticker);
+
+    size_t next = 0;
+    for (auto _ : state) {
+        fetchByName(tree, tickers[next], writer);
+        writer.consume(writer.buffered().size());
+        next = (next + 1) % tickers.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FetchByName)->Apply(symbolCounts);
+
+// Listing the first 10 stocks under random two-letter ticker prefixes
+void BM_PrefixSearch(benchmark::State& state) {
+    const vector<StockData>& stocks = dataset(size_t(state.range(0)));
+    StockTree tree;
+    tree.bulkLoad(stocks);
+
+    mt19937 random(DATASET_SEED + 5);
+    uniform_int_distribution<size_t> pick(0, stocks.size() - 1);
+    vector<string> prefixes;
+    for (int i = 0; i < 4096; ++i) prefixes.push_back(stocks[pick(random)].ticker.substr(0, 2));
+
+    size_t next = 0, found = 0;
+    for (auto _ : state) {
+        tree.forEachWithPrefix(prefixes[next], 10, [&found](const StockData& stock) { found += stock.ticker.size(); });
+        next = (next + 1) % prefixes.size();
+    }
+    benchmark::DoNotOptimize(found);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PrefixSearch)->Apply(symbolCounts);
+
+// Looking up batches of range(1) random tickers at once
+void BM_GetMany(benchmark::State& state) {
+    const vector<StockData>& stocks = dataset(size_t(state.range(0)));
+    StockTree tree;
+    tree.bulkLoad(stocks);
+
+    mt19937 random(DATASET_SEED + 6);
+    uniform_int_distribution<size_t> pick(0, stocks.size() - 1);
+    vector<string> tickers;
+    for (long i = 0; i < state.range(1); ++i) tickers.push_back(stocks[pick(random)].ticker);
+
+    vector<const StockData*> found;
+    for (auto _ : state) {
+        tree.getMany(tickers, found);
+        benchmark::DoNotOptimize(found.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_GetMany)->ArgsProduct({{1 << 10, 1 << 16, 1 << 20}, {16, 1024}});
+
+// Last-price range queries returning about range(1) stocks each
+void BM_RangeQuery(benchmark::State& state) {
+    const vector<StockData>& stocks = dataset(size_t(state.range(0)));
+    StockTree tree;
+    tree.bulkLoad(stocks);
+
+    float width = 999.0f * float(state.range(1)) / float(stocks.size());
+    mt19937 random(DATASET_SEED + 3);
+    uniform_real_distribution<float> low(1.0f, 1000.0f - width);
+    size_t found = 0;
+    for (auto _ : state) {
+        float minPrice = low(random);
+        tree.forEachInRange(PriceField::LastPrice, minPrice, minPrice + width,
+                            [&found](const StockData& stock) { found += stock.ticker.size(); });
+    }
+    benchmark::DoNotOptimize(found);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RangeQuery)->ArgsProduct({{1 << 10, 1 << 13, 1 << 16, 1 << 19, 1 << 20}, {10, 1000}});
+
+// Multi-column screens: range(1) 0 scans every stock, 1 adds a last-price
+// range holding about 1% of them, which the price index answers
+void BM_Screen(benchmark::State& state) {
+    const vector<StockData>& stocks = dataset(size_t(state.range(0)));
+    StockTree tree;
+    tree.bulkLoad(stocks);
+
+    StockScreen screen;
+    string error;
+    screen.parse(string(state.range(1) ? "last between 500 and 510 and " : "")
+                     + "(high - low) / open > 2.5% and last > open sort change desc top 20",
+                 error);
+    vector<const StockData*> matches;
+    for (auto _ : state) {
+        screen.run(tree, matches);
+        benchmark::DoNotOptimize(matches.data());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Screen)->ArgsProduct({{1 << 16, 1 << 20}, {0, 1}})->Unit(benchmark::kMicrosecond);
+
+// Price-only layouts for comparing price policies; StockData itself is the float layout with chart links
+typedef BasicStockData<FloatPrices, NoChartLinkFields> FloatQuote;
+typedef BasicStockData<DoublePrices, NoChartLinkFields> DoubleQuote;
+typedef BasicStockData<FixedPrices, NoChartLinkFields> FixedQuote;
+
+// Function to get dataset(n) converted to another layout
+template <typename Stock>
+const vector<Stock>& datasetAs(size_t n) {
+    static unordered_map<size_t, vector<Stock>> cache;
+    auto it = cache.find(n);
+    if (it != cache.end()) return it->second;
+
+    vector<Stock>& stocks = cache[n];
+    for (const auto& stock : dataset(n)) stocks.push_back(convertStock<Stock>(stock));
+    return stocks;
+}
+
+// Inserting every stock into an empty AVL tree of the given layout
+template <typename Stock>
+void BM_InsertLayout(benchmark::State& state) {
+    const vector<Stock>& stocks = datasetAs<Stock>(size_t(state.range(0)));
+    BasicAVLTree<Stock> tree;
+    for (auto _ : state) {
+        state.PauseTiming();
+        tree.clear();
+        state.ResumeTiming();
+        for (const auto& stock : stocks) tree.insert(stock);
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(stocks.size()));
+}
+BENCHMARK_TEMPLATE(BM_InsertLayout, StockData)->Arg(1 << 16)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InsertLayout, FloatQuote)->Arg(1 << 16)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_InsertLayout, FixedQuote)->Arg(1 << 16)->Unit(benchmark::kMillisecond);
+
+// Last-price range queries of about range(1) stocks on an AVL tree of the given layout
+template <typename Stock>
+void BM_RangeQueryLayout(benchmark::State& state) {
+    typedef typename Stock::PricePolicy Prices;
+    const vector<Stock>& stocks = datasetAs<Stock>(size_t(state.range(0)));
+    BasicAVLTree<Stock> tree;
+    tree.bulkLoad(stocks);
+
+    double width = 999.0 * double(state.range(1)) / double(stocks.size());
+    mt19937 random(DATASET_SEED + 3);
+    uniform_real_distribution<double> low(1.0, 1000.0 - width);
+    size_t found = 0;
+    for (auto _ : state) {
+        double minPrice = low(random);
+        tree.forEachInRange(PriceField::LastPrice, Prices::fromDouble(minPrice), Prices::fromDouble(minPrice + width),
+                            [&found](const Stock& stock) { found += stock.ticker.size(); });
+    }
+    benchmark::DoNotOptimize(found);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_RangeQueryLayout, StockData)->Args({1 << 20, 1000});
+BENCHMARK_TEMPLATE(BM_RangeQueryLayout, FloatQuote)->Args({1 << 20, 1000});
+BENCHMARK_TEMPLATE(BM_RangeQueryLayout, DoubleQuote)->Args({1 << 20, 1000});
+BENCHMARK_TEMPLATE(BM_RangeQueryLayout, FixedQuote)->Args({1 << 20, 1000});
+
+// Parsing a livestock CSV file of range(0) rows
+void BM_LoadStockData(benchmark::State& state) {
+    const string& path = datasetFile(size_t(state.range(0)));
+    vector<StockData> stockList;
+    for (auto _ : state) {
+        stockList.clear();
+        loadStockData(path, stockList);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * int64_t(filesystem::file_size(path)));
+}
+BENCHMARK(BM_LoadStockData)->Apply(symbolCounts)->Unit(benchmark::kMillisecond);
+
+// Function to write range(0) synthetic ticks over 1000 symbols once and return the file's path
+const string& tickFile(size_t n) {
+    static unordered_map<size_t, string> cache;
+    auto it = cache.find(n);
+    if (it != cache.end()) return it->second;
+
+    string path = (filesystem::temp_directory_path() / ("stock_bench_ticks_" + to_string(n) + ".csv")).string();
+    ofstream out(path, ios::trunc);
+    mt19937 random(DATASET_SEED + 5);
+    uniform_int_distribution<uint32_t> symbol(0, 999);
+    uniform_real_distribution<float> price(1.0f, 1000.0f);
+    int64_t timestamp = 1700000000000;
+    for (size_t i = 0; i < n; ++i) {
+        timestamp += random() % 8;
+        out << syntheticTicker(symbol(random)) << ',' << price(random) << ',' << random() % 500 << ',' << timestamp
+            << '\n';
+    }
+    return cache[n] = path;
+}
+
+// Replaying range(0) ticks through the parse, aggregate and apply stages
+void BM_TickReplay(benchmark::State& state) {
+    const string& path = tickFile(size_t(state.range(0)));
+    atomic<bool> stop(false);
+    for (auto _ : state) {
+        StockTree tree;
+        TickReplay replay(path);
+        replay.run([&tree](TickPublication& publication) { applyTickUpdates(tree, publication.updates); }, stop);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_TickReplay)->Arg(1 << 20)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// Fitting the price trend over range(0) days
+void BM_LinearRegression(benchmark::State& state) {
+    size_t days = size_t(state.range(0));
+    mt19937 random(DATASET_SEED + 4);
+    normal_distribution<double> noise(0.0, 5.0);
+    vector<double> x(days), y(days);
+    for (size_t i = 0; i < days; ++i) {
+        x[i] = double(i);
+        y[i] = 100.0 + 0.05 * double(i) + noise(random);
+    }
+
+    double slope = 0.0, intercept = 0.0;
+    for (auto _ : state) {
+        linearRegression(x, y, slope, intercept);
+        benchmark::DoNotOptimize(slope);
+        benchmark::DoNotOptimize(intercept);
+    }
+    state.SetItemsProcessed(state.iterations() * int64_t(days));
+}
+BENCHMARK(BM_LinearRegression)->Apply(symbolCounts);
+
+}  // namespace
+
+BENCHMARK_MAIN();
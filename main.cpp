@@ -1,484 +1,7125 @@
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <vector>
 #include <string>
 #include <limits>
 #include <cstdlib>
 #include <numeric>
 #include <algorithm>
+#include <initializer_list>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include <cctype>
+#include <thread>
+#include <iterator>
+#include <unordered_map>
+#include <filesystem>
+#include <cmath>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <csignal>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// x86 builds also compile AVX2 analytics kernels, picked at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STOCK_AVX2_KERNELS
+#define STOCK_AVX2 __attribute__((target("avx2,fma")))
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-// Struct to hold stock data, including the chart link
-struct StockData {
-    string ticker;
-    float open;
-    float dayHigh;
-    float dayLow;
-    float lastPrice;
+// Hot-path instrumentation: operation counters and latency histograms on the
+// tree, CSV, regression and output paths, read back by the stats command and
+// --stats-every. Every probe is wrapped in STOCK_STATS_ONLY, so building with
+// STOCK_NO_STATS removes them entirely.
+#ifndef STOCK_NO_STATS
+#define STOCK_STATS_ONLY(...) __VA_ARGS__
+
+// Counter that any thread may add to
+class StatCounter {
+private:
+    atomic<uint64_t> value;
+
+public:
+    StatCounter() : value(0) {}
+
+    void add(uint64_t amount) {
+        value.fetch_add(amount, memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return value.load(memory_order_relaxed);
+    }
+};
+
+// Log-linear histogram of durations in nanoseconds, in the style of
+// HdrHistogram: values below 32 ns get a bucket each and every power of two
+// above is split into 16 buckets, so a percentile is read back within 1/16
+// of the recorded value. Recording is a few relaxed atomic adds.
+class LatencyHistogram {
+private:
+    static const int SUB_BUCKET_BITS = 4;
+    static const size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+    static const size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    atomic<uint64_t> buckets[BUCKET_COUNT];
+    atomic<uint64_t> count;
+    atomic<uint64_t> total;
+    atomic<uint64_t> largest;
+
+    static size_t bucketOf(uint64_t nanos) {
+        if (nanos < SUB_BUCKETS) return size_t(nanos);
+        int top = 63 - __builtin_clzll(nanos);
+        return size_t(top - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + size_t(nanos >> (top - SUB_BUCKET_BITS)) % SUB_BUCKETS;
+    }
+
+    // Largest value that falls into bucket
+    static uint64_t bucketLimit(size_t bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        int shift = int(bucket / SUB_BUCKETS) - 1;
+        uint64_t first = (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+        return first + ((uint64_t(1) << shift) - 1);
+    }
+
+public:
+    LatencyHistogram() : count(0), total(0), largest(0) {
+        for (auto& bucket : buckets) bucket.store(0, memory_order_relaxed);
+    }
+
+    void record(uint64_t nanos) {
+        buckets[bucketOf(nanos)].fetch_add(1, memory_order_relaxed);
+        count.fetch_add(1, memory_order_relaxed);
+        total.fetch_add(nanos, memory_order_relaxed);
+        uint64_t seen = largest.load(memory_order_relaxed);
+        while (nanos > seen && !largest.compare_exchange_weak(seen, nanos, memory_order_relaxed)) {}
+    }
+
+    uint64_t samples() const {
+        return count.load(memory_order_relaxed);
+    }
+
+    uint64_t totalNanos() const {
+        return total.load(memory_order_relaxed);
+    }
+
+    uint64_t maxNanos() const {
+        return largest.load(memory_order_relaxed);
+    }
+
+    double meanNanos() const {
+        uint64_t n = samples();
+        return n ? double(totalNanos()) / double(n) : 0.0;
+    }
+
+    // Value below which a `fraction` of the samples fall; 0 when empty
+    uint64_t percentile(double fraction) const {
+        uint64_t n = samples();
+        if (!n) return 0;
+        uint64_t rank = max<uint64_t>(1, uint64_t(ceil(fraction * double(n)))), seen = 0;
+        for (size_t b = 0; b < BUCKET_COUNT; ++b) {
+            seen += buckets[b].load(memory_order_relaxed);
+            if (seen >= rank) return min(bucketLimit(b), maxNanos());
+        }
+        return maxNanos();
+    }
+};
+
+// Records the time from construction to destruction into a histogram
+class ScopedLatency {
+private:
+    LatencyHistogram& histogram;
+    chrono::steady_clock::time_point started;
+
+public:
+    explicit ScopedLatency(LatencyHistogram& histogram)
+        : histogram(histogram), started(chrono::steady_clock::now()) {}
+
+    ~ScopedLatency() {
+        auto elapsed = chrono::steady_clock::now() - started;
+        histogram.record(uint64_t(chrono::duration_cast<chrono::nanoseconds>(elapsed).count()));
+    }
+};
+
+// Everything the probes record. Rotations are counted per tree and added
+// here by the operation that made them, AVL and price index rotations
+// together. The server applies each write to both of its tree copies, so
+// its writes are counted twice.
+struct StockStats {
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+
+    LatencyHistogram treeInsert;
+    LatencyHistogram treeUpdate;
+    LatencyHistogram treeDelete;
+    LatencyHistogram treeFind;
+    LatencyHistogram treeRange;  // including the caller's visitor
+    LatencyHistogram treePrefix;  // including the caller's visitor
+    LatencyHistogram treeGetMany;
+    LatencyHistogram treeBatch;
+    LatencyHistogram screen;  // including writing the matches
+    StatCounter insertRotations;
+    StatCounter updateRotations;
+    StatCounter deleteRotations;
+    StatCounter batchRotations;
+    StatCounter batchChanges;
+
+    LatencyHistogram csvParse;  // one sample per file
+    StatCounter csvRows;
+    StatCounter csvBytes;
+    StatCounter csvRejected;
+
+    LatencyHistogram regression;
+
+    LatencyHistogram outputWrite;  // one sample per flush or send
+    StatCounter outputBytes;
+
+    LatencyHistogram tickPublish;  // one sample per publication applied to the tree
+    StatCounter ticks;
+    StatCounter ticksRejected;
+    StatCounter tickBars;
+};
+
+StockStats stockStats;
+#else
+#define STOCK_STATS_ONLY(...)
+#endif
+
+// Price policies for BasicStockData. Value is how a price is stored and
+// compared, Sum accumulates prices for averages, and changePercent derives
+// the change from the open in the same representation.
+struct FloatPrices {
+    typedef float Value;
+    typedef double Sum;
+
+    static Value fromDouble(double value) {
+        return float(value);
+    }
+
+    static double toDouble(Sum value) {
+        return value;
+    }
+
+    static Value changePercent(Value open, Value last) {
+        return open != 0 ? (last - open) / open * 100.0f : 0.0f;
+    }
+};
+
+struct DoublePrices {
+    typedef double Value;
+    typedef double Sum;
+
+    static Value fromDouble(double value) {
+        return value;
+    }
+
+    static double toDouble(Sum value) {
+        return value;
+    }
+
+    static Value changePercent(Value open, Value last) {
+        return open != 0 ? (last - open) / open * 100.0 : 0.0;
+    }
+};
+
+// Fixed point: whole ticks of 1/10000, so comparisons and sums are exact
+// integer operations
+struct FixedPrices {
+    typedef int64_t Value;
+    typedef int64_t Sum;
+
+    static const int64_t TICKS_PER_UNIT = 10000;
+
+    static Value fromDouble(double value) {
+        return llround(value * double(TICKS_PER_UNIT));
+    }
+
+    static double toDouble(Sum value) {
+        return double(value) / double(TICKS_PER_UNIT);
+    }
+
+    static Value changePercent(Value open, Value last) {
+        return open != 0 ? (last - open) * 100 * TICKS_PER_UNIT / open : 0;
+    }
+};
+
+// Field sets for BasicStockData: a full quote carries the chart links, and a
+// price-only quote leaves them out of the tree nodes altogether
+struct ChartLinkFields {
     string chartTodayPath; // Field to store today's chart link
     string chart30DaysPath; // Field to store 30-day chart link
     string chart365DaysPath; // Field to store 365-day chart link
 };
 
-// AVL Tree Node
-class AVLTreeNode {
-public:
-    StockData stock;
-    AVLTreeNode* left;
-    AVLTreeNode* right;
-    int height;
-
-    AVLTreeNode(const StockData& stockData)
-        : stock(stockData), left(nullptr), right(nullptr), height(1) {}
+struct NoChartLinkFields {};
+
+// Quote of one stock, laid out at compile time by a price policy and a field set
+template <typename Prices, typename Fields>
+struct BasicStockData : Fields {
+    typedef Prices PricePolicy;
+    typedef typename Prices::Value Price;
+
+    string ticker;
+    Price open;
+    Price dayHigh;
+    Price dayLow;
+    Price lastPrice;
+};
+
+// Struct to hold stock data, including the chart link
+typedef BasicStockData<FloatPrices, ChartLinkFields> StockData;
+
+// Function to convert a quote to another price policy and field set; the
+// chart links are copied only when both layouts have them
+template <typename Target, typename Source>
+Target convertStock(const Source& stock) {
+    typedef typename Source::PricePolicy From;
+    typedef typename Target::PricePolicy To;
+    Target converted;
+    converted.ticker = stock.ticker;
+    converted.open = To::fromDouble(From::toDouble(stock.open));
+    converted.dayHigh = To::fromDouble(From::toDouble(stock.dayHigh));
+    converted.dayLow = To::fromDouble(From::toDouble(stock.dayLow));
+    converted.lastPrice = To::fromDouble(From::toDouble(stock.lastPrice));
+    if constexpr (is_base_of<ChartLinkFields, Target>::value && is_base_of<ChartLinkFields, Source>::value) {
+        converted.chartTodayPath = stock.chartTodayPath;
+        converted.chart30DaysPath = stock.chart30DaysPath;
+        converted.chart365DaysPath = stock.chart365DaysPath;
+    }
+    return converted;
+}
+
+// AVL Tree Node
+template <typename Stock>
+class BasicAVLTreeNode {
+public:
+    typedef typename Stock::Price Price;
+
+    Stock stock;
+    BasicAVLTreeNode* left;
+    BasicAVLTreeNode* right;
+    int height;
+    // Subtree aggregates over lastPrice, kept current by AVLTree::refresh
+    int size;
+    Price minPrice;
+    Price maxPrice;
+    typename Stock::PricePolicy::Sum priceSum;
+
+    BasicAVLTreeNode(Stock stockData)
+        : stock(move(stockData)), left(nullptr), right(nullptr), height(1), size(1),
+          minPrice(stock.lastPrice), maxPrice(stock.lastPrice), priceSum(stock.lastPrice) {}
+};
+
+// Block allocator for tree nodes. Nodes are carved out of fixed-size blocks
+// and released nodes are recycled through a free list. reset() rewinds the
+// pool in O(1) while keeping its blocks; the caller must have destroyed any
+// live nodes that are not trivially destructible.
+template <typename Node>
+class NodePool {
+private:
+    static const size_t BLOCK_SIZE = 1024;
+
+    vector<Node*> blocks;
+    vector<Node*> freeList;
+    size_t blockIndex;  // block currently being carved
+    size_t used;        // nodes handed out from blocks[blockIndex]
+
+    Node* allocate() {
+        if (!freeList.empty()) {
+            Node* node = freeList.back();
+            freeList.pop_back();
+            return node;
+        }
+        if (used == BLOCK_SIZE) {
+            ++blockIndex;
+            used = 0;
+        }
+        if (blockIndex == blocks.size()) {
+            blocks.push_back(static_cast<Node*>(::operator new(sizeof(Node) * BLOCK_SIZE)));
+        }
+        return blocks[blockIndex] + used++;
+    }
+
+public:
+    NodePool() : blockIndex(0), used(0) {}
+
+    ~NodePool() {
+        for (Node* block : blocks) ::operator delete(block);
+    }
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    template <typename... Args>
+    Node* create(Args&&... args) {
+        return new (allocate()) Node(std::forward<Args>(args)...);
+    }
+
+    void release(Node* node) {
+        node->~Node();
+        freeList.push_back(node);
+    }
+
+    void reset() {
+        blockIndex = 0;
+        used = 0;
+        freeList.clear();
+    }
+
+    // Makes sure count nodes can be created without allocating more blocks
+    void reserve(size_t count) {
+        size_t needed = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        while (blocks.size() < needed) {
+            blocks.push_back(static_cast<Node*>(::operator new(sizeof(Node) * BLOCK_SIZE)));
+        }
+    }
+};
+
+// Price fields that the tree keeps a secondary ordering for
+enum class PriceField { LastPrice, Open, DayHigh, DayLow, ChangePercent };
+
+const int PRICE_FIELD_COUNT = 5;
+
+// Names of the price fields in the command language, in PriceField order
+const string_view PRICE_FIELD_NAMES[PRICE_FIELD_COUNT] = {"last", "open", "high", "low", "change"};
+
+// Function to read one price field of a stock
+template <typename Stock>
+typename Stock::Price priceOf(const Stock& stock, PriceField field) {
+    switch (field) {
+        case PriceField::Open:
+            return stock.open;
+        case PriceField::DayHigh:
+            return stock.dayHigh;
+        case PriceField::DayLow:
+            return stock.dayLow;
+        case PriceField::ChangePercent:
+            return Stock::PricePolicy::changePercent(stock.open, stock.lastPrice);
+        default:
+            return stock.lastPrice;
+    }
+}
+
+// Function to order prices for the price indexes: by value, with NaN after
+// every number and equal to itself, so that the order stays a strict weak
+// ordering even when a price is not a number
+template <typename Price>
+bool priceBefore(Price a, Price b) {
+    if constexpr (is_floating_point<Price>::value) {
+        if (isnan(a) || isnan(b)) return !isnan(a) && isnan(b);
+    }
+    return a < b;
+}
+
+// Function to tell whether two prices are equal in the priceBefore order, so
+// that a NaN price counts as unchanged
+template <typename Price>
+bool samePrice(Price a, Price b) {
+    return !priceBefore(a, b) && !priceBefore(b, a);
+}
+
+// One entry of a batch: replaces or adds the stock (upsert), or deletes its ticker
+template <typename Stock>
+struct BasicStockChange {
+    Stock stock;
+    bool remove;
+};
+
+typedef BasicStockChange<StockData> StockChange;
+
+// Function to order a batch by ticker without moving the changes themselves;
+// returns the last change of each ticker, in ticker order
+template <typename Change>
+vector<Change*> sortChanges(vector<Change>& changes) {
+    vector<Change*> sorted;
+    sorted.reserve(changes.size());
+    for (auto& change : changes) sorted.push_back(&change);
+    stable_sort(sorted.begin(), sorted.end(), [](const Change* a, const Change* b) {
+        return a->stock.ticker < b->stock.ticker;
+    });
+
+    size_t kept = 0;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        if (i + 1 < sorted.size() && sorted[i + 1]->stock.ticker == sorted[i]->stock.ticker) continue;
+        sorted[kept++] = sorted[i];
+    }
+    sorted.resize(kept);
+    return sorted;
+}
+
+// Layouts StockWriter can produce
+enum class OutputFormat { Table, Csv, JsonLines };
+
+// Function to map a format name (table, csv, json) to an OutputFormat; false if unknown
+bool parseOutputFormat(string_view name, OutputFormat& format) {
+    if (name == "table")
+        format = OutputFormat::Table;
+    else if (name == "csv")
+        format = OutputFormat::Csv;
+    else if (name == "json" || name == "jsonl")
+        format = OutputFormat::JsonLines;
+    else
+        return false;
+    return true;
+}
+
+// Formats stock rows into a reusable buffer with to_chars and hands the
+// buffer to the stream only when it fills up (or on flush), so printing many
+// rows costs a few large writes rather than one flush per row. The table
+// layout prints numbers like cout does; CSV and JSON lines use the shortest
+// text that reads back as the same float. withChange selects the movers
+// columns (ticker, open, last price, change %) instead of the full quote.
+// Without a stream the writer only accumulates, and the caller sends the
+// bytes from buffered() itself and releases them with consume().
+class StockWriter {
+private:
+    static const size_t BUFFER_BYTES = 1 << 16;
+    static const size_t MAX_NUMBER_CHARS = 32;
+
+    ostream* out;
+    OutputFormat format;
+    bool withChange;
+    bool headerPending;
+    vector<char> buffer;
+    size_t start;  // bytes before start were consumed (buffer-only writers)
+    size_t used;
+
+    void reserve(size_t bytes) {
+        if (used + bytes <= buffer.size()) return;
+        if (out) {
+            flush();
+            if (bytes > buffer.size()) buffer.resize(bytes);
+        } else {
+            // Drop what the caller already sent before growing
+            if (start) {
+                memmove(buffer.data(), buffer.data() + start, used - start);
+                used -= start;
+                start = 0;
+            }
+            if (used + bytes > buffer.size()) buffer.resize(max(buffer.size() * 2, used + bytes));
+        }
+    }
+
+    void append(string_view text) {
+        reserve(text.size());
+        memcpy(buffer.data() + used, text.data(), text.size());
+        used += text.size();
+    }
+
+    template <typename Number>
+    void appendNumber(Number value) {
+        reserve(MAX_NUMBER_CHARS);
+        char* first = buffer.data() + used;
+        char* last = first + MAX_NUMBER_CHARS;
+        to_chars_result result;
+        if (format == OutputFormat::Table) {
+            result = to_chars(first, last, value, chars_format::general, 6);  // cout's default precision
+        } else if (!isfinite(value)) {
+            // JSON has no NaN or infinity; CSV leaves the field empty
+            if (format == OutputFormat::JsonLines) append("null");
+            return;
+        } else {
+            result = to_chars(first, last, value);
+        }
+        used = size_t(result.ptr - buffer.data());
+    }
+
+    void appendCount(size_t value) {
+        reserve(MAX_NUMBER_CHARS);
+        used = size_t(to_chars(buffer.data() + used, buffer.data() + used + MAX_NUMBER_CHARS, value).ptr - buffer.data());
+    }
+
+    // Function to append a CSV field, quoted only when it contains a separator or quote
+    void appendCsvText(string_view text) {
+        if (text.find_first_of(",\"\r\n") == string_view::npos) {
+            append(text);
+            return;
+        }
+        reserve(text.size() * 2 + 2);
+        buffer[used++] = '"';
+        for (char c : text) {
+            if (c == '"') buffer[used++] = '"';
+            buffer[used++] = c;
+        }
+        buffer[used++] = '"';
+    }
+
+    // Function to append a JSON string literal, escaping quotes, backslashes and control characters
+    void appendJsonText(string_view text) {
+        static const char hex[] = "0123456789abcdef";
+        reserve(text.size() * 6 + 2);
+        buffer[used++] = '"';
+        for (char c : text) {
+            unsigned char u = static_cast<unsigned char>(c);
+            if (c == '"' || c == '\\') {
+                buffer[used++] = '\\';
+                buffer[used++] = c;
+            } else if (u < 0x20) {
+                memcpy(buffer.data() + used, "\\u00", 4);
+                buffer[used + 4] = hex[u >> 4];
+                buffer[used + 5] = hex[u & 15];
+                used += 6;
+            } else {
+                buffer[used++] = c;
+            }
+        }
+        buffer[used++] = '"';
+    }
+
+    // Function to append one labelled value in the current format
+    void appendField(string_view tableLabel, string_view key, float value, bool first = false) {
+        if (format == OutputFormat::Table) {
+            if (!first) append(", ");
+            append(tableLabel);
+            append(": ");
+            appendNumber(value);
+        } else if (format == OutputFormat::Csv) {
+            if (!first) append(",");
+            appendNumber(value);
+        } else {
+            append(",\"");
+            append(key);
+            append("\":");
+            appendNumber(value);
+        }
+    }
+
+public:
+    explicit StockWriter(ostream& out = cout, OutputFormat format = OutputFormat::Table, bool withChange = false)
+        : out(&out), format(format), withChange(withChange), headerPending(format == OutputFormat::Csv),
+          buffer(BUFFER_BYTES), start(0), used(0) {}
+
+    // Buffer-only writer
+    explicit StockWriter(OutputFormat format, bool withChange = false)
+        : out(nullptr), format(format), withChange(withChange), headerPending(format == OutputFormat::Csv),
+          buffer(BUFFER_BYTES), start(0), used(0) {}
+
+    ~StockWriter() {
+        flush();
+    }
+
+    StockWriter(const StockWriter&) = delete;
+    StockWriter& operator=(const StockWriter&) = delete;
+
+    void write(const StockData& stock) {
+        if (headerPending) {
+            append(withChange ? "Ticker,Open,LastPrice,ChangePercent\n" : "Ticker,Open,DayHigh,DayLow,LastPrice\n");
+            headerPending = false;
+        }
+
+        if (format == OutputFormat::Table) {
+            append("Ticker: ");
+            append(stock.ticker);
+        } else if (format == OutputFormat::Csv) {
+            appendCsvText(stock.ticker);
+            append(",");
+        } else {
+            append("{\"ticker\":");
+            appendJsonText(stock.ticker);
+        }
+
+        appendField("Open", "open", stock.open, format == OutputFormat::Csv);
+        if (withChange) {
+            appendField("Last Price", "lastPrice", stock.lastPrice);
+            appendField("Change", "changePercent", priceOf(stock, PriceField::ChangePercent));
+            if (format == OutputFormat::Table) append("%");
+        } else {
+            appendField("Day High", "dayHigh", stock.dayHigh);
+            appendField("Day Low", "dayLow", stock.dayLow);
+            appendField("Last Price", "lastPrice", stock.lastPrice);
+        }
+        append(format == OutputFormat::JsonLines ? "}\n" : "\n");
+    }
+
+    // Function to pass a line of text (a message, not a stock row) through the same buffer
+    void writeLine(string_view text) {
+        append(text);
+        append("\n");
+    }
+
+    // Function to report a request that produced no row: the text as a line
+    // in the table layout, {"error":text} in JSON lines and nothing in CSV
+    void writeNote(string_view text) {
+        if (format == OutputFormat::Table) {
+            writeLine(text);
+        } else if (format == OutputFormat::JsonLines) {
+            append("{\"error\":");
+            appendJsonText(text);
+            append("}\n");
+        }
+    }
+
+    // Function to write a next-day price estimate fitted over `days` days of
+    // history; a NaN price means the history was too short to fit. CSV rows
+    // are Ticker,Days,Predicted.
+    void writePrediction(string_view ticker, size_t days, double price) {
+        if (format == OutputFormat::Table) {
+            if (isnan(price)) {
+                append("Not enough history to predict ");
+                append(ticker);
+                append(".\n");
+                return;
+            }
+            append("Predicted price for ");
+            append(ticker);
+            append(" for the next day (day ");
+            appendCount(days);
+            append(") is: ");
+            appendNumber(price);
+            append("\n");
+        } else if (format == OutputFormat::Csv) {
+            appendCsvText(ticker);
+            append(",");
+            appendCount(days);
+            append(",");
+            appendNumber(price);
+            append("\n");
+        } else {
+            append("{\"ticker\":");
+            appendJsonText(ticker);
+            append(",\"days\":");
+            appendCount(days);
+            append(",\"predicted\":");
+            appendNumber(price);
+            append("}\n");
+        }
+    }
+
+    OutputFormat getFormat() const {
+        return format;
+    }
+
+    // Bytes written and not yet consumed (buffer-only writers)
+    string_view buffered() const {
+        return string_view(buffer.data() + start, used - start);
+    }
+
+    void consume(size_t bytes) {
+        start += bytes;
+        if (start == used) start = used = 0;
+    }
+
+    // Function to hand the buffered rows to the stream and flush it
+    void flush() {
+        if (!out) return;
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.outputWrite); stockStats.outputBytes.add(used);)
+        if (used) out->write(buffer.data(), streamsize(used));
+        used = 0;
+        out->flush();
+    }
+};
+
+#ifndef STOCK_NO_STATS
+// Function to format a duration in nanoseconds with a readable unit
+string formatNanos(double nanos) {
+    static const char* const units[] = {"ns", "us", "ms", "s"};
+    int unit = 0;
+    while (unit < 3 && nanos >= 1000.0) {
+        nanos /= 1000.0;
+        ++unit;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), unit ? "%.2f %s" : "%.0f %s", nanos, units[unit]);
+    return text;
+}
+#endif
+
+// Function to write the statistics collected so far: a latency table and a
+// summary in the table layout, Metric,Value rows in CSV and one
+// {"stats":{...}} object in JSON lines
+void writeStats(StockWriter& writer) {
+#ifndef STOCK_NO_STATS
+    const StockStats& stats = stockStats;
+    const pair<const char*, const LatencyHistogram*> latencies[] = {
+        {"tree.insert", &stats.treeInsert}, {"tree.update", &stats.treeUpdate},
+        {"tree.delete", &stats.treeDelete}, {"tree.find", &stats.treeFind},
+        {"tree.range", &stats.treeRange}, {"tree.prefix", &stats.treePrefix},
+        {"tree.getmany", &stats.treeGetMany}, {"tree.batch", &stats.treeBatch},
+        {"csv.parse", &stats.csvParse}, {"regression", &stats.regression},
+        {"output.write", &stats.outputWrite}, {"tick.publish", &stats.tickPublish},
+        {"screen", &stats.screen}};
+    double uptime = chrono::duration<double>(chrono::steady_clock::now() - stats.started).count();
+    double parseSeconds = double(stats.csvParse.totalNanos()) / 1e9;
+    auto perSecond = [parseSeconds](uint64_t amount) {
+        return parseSeconds > 0 ? double(amount) / parseSeconds : 0.0;
+    };
+    auto perOperation = [](uint64_t amount, uint64_t operations) {
+        return operations ? double(amount) / double(operations) : 0.0;
+    };
+    char line[256];
+
+    if (writer.getFormat() == OutputFormat::Table) {
+        snprintf(line, sizeof(line), "Statistics over %.1f s", uptime);
+        writer.writeLine(line);
+        snprintf(line, sizeof(line), "%-14s %10s %10s %10s %10s %10s %10s", "Operation", "Count", "Mean", "p50",
+                 "p99", "p99.9", "Max");
+        writer.writeLine(line);
+        for (const auto& latency : latencies) {
+            const LatencyHistogram& h = *latency.second;
+            snprintf(line, sizeof(line), "%-14s %10llu %10s %10s %10s %10s %10s", latency.first,
+                     (unsigned long long)h.samples(), formatNanos(h.meanNanos()).c_str(),
+                     formatNanos(double(h.percentile(0.5))).c_str(), formatNanos(double(h.percentile(0.99))).c_str(),
+                     formatNanos(double(h.percentile(0.999))).c_str(), formatNanos(double(h.maxNanos())).c_str());
+            writer.writeLine(line);
+        }
+        snprintf(line, sizeof(line),
+                 "Rotations: %.2f per insert, %.2f per update, %.2f per delete, %.2f per batched change",
+                 perOperation(stats.insertRotations.get(), stats.treeInsert.samples()),
+                 perOperation(stats.updateRotations.get(), stats.treeUpdate.samples()),
+                 perOperation(stats.deleteRotations.get(), stats.treeDelete.samples()),
+                 perOperation(stats.batchRotations.get(), stats.batchChanges.get()));
+        writer.writeLine(line);
+        snprintf(line, sizeof(line), "CSV: %llu rows, %.1f MB in %s (%.0f rows/s, %.1f MB/s), %llu rejected",
+                 (unsigned long long)stats.csvRows.get(), double(stats.csvBytes.get()) / 1e6,
+                 formatNanos(double(stats.csvParse.totalNanos())).c_str(), perSecond(stats.csvRows.get()),
+                 perSecond(stats.csvBytes.get()) / 1e6, (unsigned long long)stats.csvRejected.get());
+        writer.writeLine(line);
+        snprintf(line, sizeof(line), "Output: %.1f MB in %llu writes", double(stats.outputBytes.get()) / 1e6,
+                 (unsigned long long)stats.outputWrite.samples());
+        writer.writeLine(line);
+        snprintf(line, sizeof(line), "Ticks: %llu replayed, %llu rejected, %llu bars closed",
+                 (unsigned long long)stats.ticks.get(), (unsigned long long)stats.ticksRejected.get(),
+                 (unsigned long long)stats.tickBars.get());
+        writer.writeLine(line);
+        return;
+    }
+
+    vector<pair<string, double>> metrics = {{"uptimeSeconds", uptime}};
+    for (const auto& latency : latencies) {
+        const LatencyHistogram& h = *latency.second;
+        string name = latency.first;
+        metrics.emplace_back(name + ".count", double(h.samples()));
+        metrics.emplace_back(name + ".meanNs", h.meanNanos());
+        metrics.emplace_back(name + ".p50Ns", double(h.percentile(0.5)));
+        metrics.emplace_back(name + ".p99Ns", double(h.percentile(0.99)));
+        metrics.emplace_back(name + ".p999Ns", double(h.percentile(0.999)));
+        metrics.emplace_back(name + ".maxNs", double(h.maxNanos()));
+    }
+    metrics.insert(metrics.end(), {
+        {"tree.insert.rotations", double(stats.insertRotations.get())},
+        {"tree.update.rotations", double(stats.updateRotations.get())},
+        {"tree.delete.rotations", double(stats.deleteRotations.get())},
+        {"tree.batch.rotations", double(stats.batchRotations.get())},
+        {"tree.batch.changes", double(stats.batchChanges.get())},
+        {"csv.rows", double(stats.csvRows.get())},
+        {"csv.bytes", double(stats.csvBytes.get())},
+        {"csv.rejected", double(stats.csvRejected.get())},
+        {"csv.rowsPerSecond", perSecond(stats.csvRows.get())},
+        {"csv.bytesPerSecond", perSecond(stats.csvBytes.get())},
+        {"output.bytes", double(stats.outputBytes.get())},
+        {"ticks", double(stats.ticks.get())},
+        {"ticks.rejected", double(stats.ticksRejected.get())},
+        {"ticks.bars", double(stats.tickBars.get())}});
+
+    bool json = writer.getFormat() == OutputFormat::JsonLines;
+    string text = json ? "{\"stats\":{" : "Metric,Value\n";
+    for (size_t i = 0; i < metrics.size(); ++i) {
+        snprintf(line, sizeof(line), json ? "%s\"%s\":%.15g" : "%s%s,%.15g\n", json && i ? "," : "",
+                 metrics[i].first.c_str(), metrics[i].second);
+        text += line;
+    }
+    if (json) text += "}}\n";
+    writer.writeLine(string_view(text).substr(0, text.size() - 1));
+#else
+    writer.writeNote("Statistics are compiled out (STOCK_NO_STATS).");
+#endif
+}
+
+#ifndef STOCK_NO_STATS
+// Writes the statistics table to stderr every interval until destroyed
+class StatsReporter {
+private:
+    mutex lock;
+    condition_variable wake;
+    bool stopping;
+    thread worker;
+
+public:
+    explicit StatsReporter(double seconds) : stopping(false) {
+        worker = thread([this, seconds] {
+            unique_lock<mutex> guard(lock);
+            while (!wake.wait_for(guard, chrono::duration<double>(seconds), [this] { return stopping; })) {
+                StockWriter writer(cerr);
+                writeStats(writer);
+            }
+        });
+    }
+
+    ~StatsReporter() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+};
+#endif
+
+// Node of a secondary index; points back at the owning AVL tree node
+template <typename Stock>
+class BasicPriceIndexNode {
+public:
+    typedef typename Stock::Price Price;
+
+    Price price;
+    BasicAVLTreeNode<Stock>* stockNode;
+    BasicPriceIndexNode* left;
+    BasicPriceIndexNode* right;
+    int height;
+    int size;
+
+    BasicPriceIndexNode(Price value, BasicAVLTreeNode<Stock>* node)
+        : price(value), stockNode(node), left(nullptr), right(nullptr), height(1), size(1) {}
+};
+
+// AVL tree ordered by (price, ticker) so price range queries cost O(log n + k)
+template <typename Stock>
+class BasicPriceIndex {
+private:
+    typedef BasicAVLTreeNode<Stock> AVLTreeNode;
+    typedef BasicPriceIndexNode<Stock> PriceIndexNode;
+    typedef typename Stock::Price Price;
+
+    PriceIndexNode* root;
+    NodePool<PriceIndexNode> pool;
+    STOCK_STATS_ONLY(uint64_t rotations = 0;)
+
+    int height(PriceIndexNode* node) {
+        return node ? node->height : 0;
+    }
+
+    int balanceFactor(PriceIndexNode* node) {
+        return node ? height(node->left) - height(node->right) : 0;
+    }
+
+    int size(PriceIndexNode* node) {
+        return node ? node->size : 0;
+    }
+
+    void refresh(PriceIndexNode* node) {
+        node->height = 1 + max(height(node->left), height(node->right));
+        node->size = 1 + size(node->left) + size(node->right);
+    }
+
+    // Orders entries by price first and by ticker to break ties
+    static bool lessThan(Price price, const string& ticker, PriceIndexNode* node) {
+        if (!samePrice(price, node->price)) return priceBefore(price, node->price);
+        return ticker < node->stockNode->stock.ticker;
+    }
+
+    PriceIndexNode* rotateRight(PriceIndexNode* y) {
+        STOCK_STATS_ONLY(++rotations;)
+        PriceIndexNode* x = y->left;
+        PriceIndexNode* T2 = x->right;
+        x->right = y;
+        y->left = T2;
+        refresh(y);
+        refresh(x);
+        return x;
+    }
+
+    PriceIndexNode* rotateLeft(PriceIndexNode* x) {
+        STOCK_STATS_ONLY(++rotations;)
+        PriceIndexNode* y = x->right;
+        PriceIndexNode* T2 = y->left;
+        y->left = x;
+        x->right = T2;
+        refresh(x);
+        refresh(y);
+        return y;
+    }
+
+    PriceIndexNode* rebalance(PriceIndexNode* node) {
+        refresh(node);
+        int balance = balanceFactor(node);
+
+        if (balance > 1 && balanceFactor(node->left) >= 0)
+            return rotateRight(node);
+        if (balance > 1 && balanceFactor(node->left) < 0) {
+            node->left = rotateLeft(node->left);
+            return rotateRight(node);
+        }
+        if (balance < -1 && balanceFactor(node->right) <= 0)
+            return rotateLeft(node);
+        if (balance < -1 && balanceFactor(node->right) > 0) {
+            node->right = rotateRight(node->right);
+            return rotateLeft(node);
+        }
+        return node;
+    }
+
+    PriceIndexNode* insert(PriceIndexNode* node, Price price, AVLTreeNode* stockNode) {
+        if (!node) return pool.create(price, stockNode);
+
+        if (lessThan(price, stockNode->stock.ticker, node))
+            node->left = insert(node->left, price, stockNode);
+        else
+            node->right = insert(node->right, price, stockNode);
+
+        return rebalance(node);
+    }
+
+    PriceIndexNode* removeMin(PriceIndexNode* node, PriceIndexNode*& minOut) {
+        if (!node->left) {
+            minOut = node;
+            return node->right;
+        }
+        node->left = removeMin(node->left, minOut);
+        return rebalance(node);
+    }
+
+    PriceIndexNode* remove(PriceIndexNode* node, Price price, const string& ticker) {
+        if (!node) return node;
+
+        if (lessThan(price, ticker, node)) {
+            node->left = remove(node->left, price, ticker);
+        } else if (!samePrice(price, node->price) || ticker != node->stockNode->stock.ticker) {
+            node->right = remove(node->right, price, ticker);
+        } else {
+            PriceIndexNode* left = node->left;
+            PriceIndexNode* right = node->right;
+            pool.release(node);
+            if (!left) return right;
+            if (!right) return left;
+
+            PriceIndexNode* successor = nullptr;
+            PriceIndexNode* rest = removeMin(right, successor);
+            successor->left = left;
+            successor->right = rest;
+            node = successor;
+        }
+
+        return rebalance(node);
+    }
+
+    template <typename Visitor>
+    void visitRange(PriceIndexNode* node, Price minPrice, Price maxPrice, Visitor& visit) {
+        if (!node) return;
+        bool aboveMin = !priceBefore(node->price, minPrice);
+        bool belowMax = !priceBefore(maxPrice, node->price);
+        if (aboveMin)
+            visitRange(node->left, minPrice, maxPrice, visit);
+        if (aboveMin && belowMax)
+            visit(node->stockNode->stock);
+        if (belowMax)
+            visitRange(node->right, minPrice, maxPrice, visit);
+    }
+
+    // Visits up to count entries from the high end (or low end) of the index
+    template <typename Visitor>
+    void visitExtreme(PriceIndexNode* node, bool highest, int& count, Visitor& visit) {
+        if (!node || count <= 0) return;
+        visitExtreme(highest ? node->right : node->left, highest, count, visit);
+        if (count <= 0) return;
+        visit(node->stockNode->stock);
+        --count;
+        visitExtreme(highest ? node->left : node->right, highest, count, visit);
+    }
+
+    struct BuildEntry {
+        Price price;
+        uint32_t tickerRank;
+        AVLTreeNode* stockNode;
+    };
+
+    PriceIndexNode* buildBalanced(const vector<BuildEntry>& sorted, size_t lo, size_t hi) {
+        if (lo >= hi) return nullptr;
+        size_t mid = lo + (hi - lo) / 2;
+        PriceIndexNode* node = pool.create(sorted[mid].price, sorted[mid].stockNode);
+        node->left = buildBalanced(sorted, lo, mid);
+        node->right = buildBalanced(sorted, mid + 1, hi);
+        refresh(node);
+        return node;
+    }
+
+    // Appends, in index order, every entry except the stale ones. stale is in
+    // index order too, so each stale entry is the next one the walk meets for
+    // its stock and is recognised by pointer, without touching the stock.
+    void collectKept(PriceIndexNode* node, const vector<BuildEntry>& stale, size_t& nextStale,
+                     vector<BuildEntry>& kept) {
+        if (!node) return;
+        collectKept(node->left, stale, nextStale, kept);
+        if (nextStale < stale.size() && stale[nextStale].stockNode == node->stockNode)
+            ++nextStale;
+        else
+            kept.push_back(BuildEntry{node->price, 0, node->stockNode});
+        collectKept(node->right, stale, nextStale, kept);
+    }
+
+public:
+    BasicPriceIndex() : root(nullptr) {}
+
+    BasicPriceIndex(const BasicPriceIndex&) = delete;
+    BasicPriceIndex& operator=(const BasicPriceIndex&) = delete;
+
+    void insert(Price price, AVLTreeNode* stockNode) {
+        root = insert(root, price, stockNode);
+    }
+
+    void remove(Price price, const string& ticker) {
+        root = remove(root, price, ticker);
+    }
+
+#ifndef STOCK_NO_STATS
+    uint64_t rotationCount() const {
+        return rotations;
+    }
+#endif
+
+    // Index nodes are trivially destructible, so dropping them is O(1)
+    void clear() {
+        static_assert(is_trivially_destructible<PriceIndexNode>::value, "PriceIndexNode must not own resources");
+        root = nullptr;
+        pool.reset();
+    }
+
+    // Replaces the index with a perfectly balanced one over nodes, which must
+    // be in ticker order so that position breaks price ties without string compares
+    void build(const vector<AVLTreeNode*>& nodes, int field) {
+        vector<BuildEntry> sorted;
+        sorted.reserve(nodes.size());
+        for (uint32_t i = 0; i < nodes.size(); ++i) {
+            sorted.push_back(BuildEntry{priceOf(nodes[i]->stock, PriceField(field)), i, nodes[i]});
+        }
+        sort(sorted.begin(), sorted.end(), [](const BuildEntry& a, const BuildEntry& b) {
+            return !samePrice(a.price, b.price) ? priceBefore(a.price, b.price) : a.tickerRank < b.tickerRank;
+        });
+        clear();
+        pool.reserve(sorted.size());
+        root = buildBalanced(sorted, 0, sorted.size());
+    }
+
+    // Like build, but order already lists the positions in nodes in (price,
+    // ticker) order and prices[i] is the field value of nodes[i], so nothing
+    // is sorted and the stocks are not touched
+    void buildInOrder(const vector<AVLTreeNode*>& nodes, const vector<Price>& prices, const uint32_t* order) {
+        vector<BuildEntry> sorted;
+        sorted.reserve(nodes.size());
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            uint32_t rank = order[i];
+            sorted.push_back(BuildEntry{prices[rank], rank, nodes[rank]});
+        }
+        clear();
+        pool.reserve(sorted.size());
+        root = buildBalanced(sorted, 0, sorted.size());
+    }
+
+    // Re-sorts the entries of moved, whose prices changed from oldPrices after
+    // they were indexed, by merging them into the rest of the index in one
+    // pass: O(n + k log k) instead of k separate removals and insertions.
+    // moved must be in ticker order, so that a stable sort by price alone
+    // puts its entries in index order.
+    void rebuildMoved(const vector<AVLTreeNode*>& moved, const vector<Price>& oldPrices, int field) {
+        auto byPrice = [](const BuildEntry& a, const BuildEntry& b) { return priceBefore(a.price, b.price); };
+
+        vector<BuildEntry> stale;
+        stale.reserve(moved.size());
+        for (size_t i = 0; i < moved.size(); ++i) stale.push_back(BuildEntry{oldPrices[i], 0, moved[i]});
+        stable_sort(stale.begin(), stale.end(), byPrice);
+
+        vector<BuildEntry> kept;
+        kept.reserve(size(root));
+        size_t nextStale = 0;
+        collectKept(root, stale, nextStale, kept);
+
+        vector<BuildEntry> added;
+        added.reserve(moved.size());
+        for (AVLTreeNode* node : moved) {
+            added.push_back(BuildEntry{priceOf(node->stock, PriceField(field)), 0, node});
+        }
+        stable_sort(added.begin(), added.end(), byPrice);
+
+        auto before = [](const BuildEntry& a, const BuildEntry& b) {
+            if (!samePrice(a.price, b.price)) return priceBefore(a.price, b.price);
+            return a.stockNode->stock.ticker < b.stockNode->stock.ticker;
+        };
+
+        vector<BuildEntry> sorted;
+        sorted.reserve(kept.size() + added.size());
+        merge(kept.begin(), kept.end(), added.begin(), added.end(), back_inserter(sorted), before);
+        clear();
+        pool.reserve(sorted.size());
+        root = buildBalanced(sorted, 0, sorted.size());
+    }
+
+    // Calls visit(stock) for every entry with minPrice <= price <= maxPrice, in price order
+    template <typename Visitor>
+    void forEachInRange(Price minPrice, Price maxPrice, Visitor visit) {
+        visitRange(root, minPrice, maxPrice, visit);
+    }
+
+    // Calls visit(stock) for the k highest (or lowest) entries, best first
+    template <typename Visitor>
+    void forEachTop(int k, bool highest, Visitor visit) {
+        visitExtreme(root, highest, k, visit);
+    }
+
+    // Number of entries ordered strictly before (price, ticker)
+    int countBefore(Price price, const string& ticker) {
+        int count = 0;
+        PriceIndexNode* current = root;
+        while (current) {
+            if (lessThan(price, ticker, current)) {
+                current = current->left;
+            } else {
+                if (samePrice(price, current->price) && ticker == current->stockNode->stock.ticker)
+                    return count + size(current->left);
+                count += size(current->left) + 1;
+                current = current->right;
+            }
+        }
+        return count;
+    }
+
+    // Number of entries with minPrice <= price <= maxPrice, in O(log n)
+    int countInRange(Price minPrice, Price maxPrice) {
+        // Entries below price, or up to and including it
+        auto countBelow = [this](Price price, bool inclusive) {
+            int count = 0;
+            PriceIndexNode* current = root;
+            while (current) {
+                if (inclusive ? !priceBefore(price, current->price) : priceBefore(current->price, price)) {
+                    count += size(current->left) + 1;
+                    current = current->right;
+                } else {
+                    current = current->left;
+                }
+            }
+            return count;
+        };
+        return max(0, countBelow(maxPrice, true) - countBelow(minPrice, false));
+    }
+
+    int size() {
+        return size(root);
+    }
+};
+
+// Node of the ticker index. label holds the bytes that follow the parent's
+// path, and stockNode is set when the path from the root spells a ticker.
+// The first byte of each child's label is kept in childBytes, in order, so a
+// step down scans one short array instead of visiting every child.
+template <typename Stock>
+class BasicTickerIndexNode {
+public:
+    string label;
+    BasicAVLTreeNode<Stock>* stockNode;
+    string childBytes;
+    vector<BasicTickerIndexNode*> children;
+
+    BasicTickerIndexNode(string label, BasicAVLTreeNode<Stock>* stockNode) : label(move(label)), stockNode(stockNode) {}
+};
+
+// Radix tree over the tickers of an AVL tree, for prefix search and batched
+// lookups. A chain of single-child nodes is merged into one labelled edge,
+// so every node without a stock branches and there are fewer than two nodes
+// per ticker; the first k tickers with a prefix are found in O(|prefix| + k)
+// node visits.
+template <typename Stock>
+class BasicTickerIndex {
+private:
+    typedef BasicAVLTreeNode<Stock> AVLTreeNode;
+    typedef BasicTickerIndexNode<Stock> TickerIndexNode;
+
+    TickerIndexNode root;
+    NodePool<TickerIndexNode> pool;
+
+    void destroy(TickerIndexNode* node) {
+        for (TickerIndexNode* child : node->children) {
+            destroy(child);
+            child->~BasicTickerIndexNode();
+        }
+    }
+
+    // Position of the child of node whose label starts with c, or where it would go
+    static size_t childPosition(const TickerIndexNode* node, char c) {
+        const string& bytes = node->childBytes;
+        size_t pos = 0;
+        while (pos < bytes.size() && static_cast<unsigned char>(bytes[pos]) < static_cast<unsigned char>(c)) ++pos;
+        return pos;
+    }
+
+    static TickerIndexNode* child(const TickerIndexNode* node, char c) {
+        size_t pos = node->childBytes.find(c);
+        return pos == string::npos ? nullptr : node->children[pos];
+    }
+
+    static void addChild(TickerIndexNode* node, size_t pos, TickerIndexNode* added) {
+        node->childBytes.insert(node->childBytes.begin() + pos, added->label[0]);
+        node->children.insert(node->children.begin() + pos, added);
+    }
+
+    // Folds the only child of node into it
+    void mergeWithChild(TickerIndexNode* node) {
+        TickerIndexNode* only = node->children[0];
+        node->label += only->label;
+        node->stockNode = only->stockNode;
+        node->childBytes.swap(only->childBytes);
+        node->children.swap(only->children);
+        pool.release(only);
+    }
+
+    // Calls visit(stock) for the subtree's stocks in ticker order; false once remaining runs out
+    template <typename Visitor>
+    bool visitInOrder(TickerIndexNode* node, int& remaining, Visitor& visit) {
+        if (node->stockNode) {
+            visit(static_cast<const Stock&>(node->stockNode->stock));
+            if (--remaining == 0) return false;
+        }
+        for (TickerIndexNode* next : node->children) {
+            if (!visitInOrder(next, remaining, visit)) return false;
+        }
+        return true;
+    }
+
+public:
+    BasicTickerIndex() : root(string(), nullptr) {}
+
+    ~BasicTickerIndex() {
+        destroy(&root);
+    }
+
+    BasicTickerIndex(const BasicTickerIndex&) = delete;
+    BasicTickerIndex& operator=(const BasicTickerIndex&) = delete;
+
+    void clear() {
+        destroy(&root);
+        root.stockNode = nullptr;
+        root.childBytes.clear();
+        root.children.clear();
+        pool.reset();
+    }
+
+    void insert(const string& ticker, AVLTreeNode* stockNode) {
+        TickerIndexNode* node = &root;
+        size_t i = 0;
+        while (i < ticker.size()) {
+            size_t pos = childPosition(node, ticker[i]);
+            if (pos == node->childBytes.size() || node->childBytes[pos] != ticker[i]) {
+                addChild(node, pos, pool.create(ticker.substr(i), stockNode));
+                return;
+            }
+
+            // Split the edge where the ticker leaves it
+            TickerIndexNode* next = node->children[pos];
+            size_t common = 1;
+            while (common < next->label.size() && i + common < ticker.size()
+                   && next->label[common] == ticker[i + common])
+                ++common;
+            if (common < next->label.size()) {
+                TickerIndexNode* middle = pool.create(next->label.substr(0, common), nullptr);
+                next->label.erase(0, common);
+                addChild(middle, 0, next);
+                node->children[pos] = middle;
+                next = middle;
+            }
+            node = next;
+            i += common;
+        }
+        node->stockNode = stockNode;
+    }
+
+    void remove(const string& ticker) {
+        TickerIndexNode* parent = nullptr;
+        size_t position = 0;
+        TickerIndexNode* node = &root;
+        for (size_t i = 0; i < ticker.size(); i += node->label.size()) {
+            size_t pos = node->childBytes.find(ticker[i]);
+            if (pos == string::npos) return;
+            TickerIndexNode* next = node->children[pos];
+            if (ticker.compare(i, next->label.size(), next->label) != 0) return;
+            parent = node;
+            position = pos;
+            node = next;
+        }
+        node->stockNode = nullptr;
+        if (node == &root) return;
+
+        // Keep every node without a stock branching
+        if (node->children.empty()) {
+            parent->childBytes.erase(position, 1);
+            parent->children.erase(parent->children.begin() + position);
+            pool.release(node);
+            if (parent != &root && !parent->stockNode && parent->children.size() == 1) mergeWithChild(parent);
+        } else if (node->children.size() == 1) {
+            mergeWithChild(node);
+        }
+    }
+
+    // Replaces the index with nodes, which must be in ticker order without
+    // duplicates. Each ticker only extends the rightmost path, so the index
+    // is built in time linear in the tickers' length.
+    void build(const vector<AVLTreeNode*>& nodes) {
+        clear();
+        vector<pair<TickerIndexNode*, size_t>> path = {{&root, 0}};  // node, length of its path
+        const string* previous = nullptr;
+        for (AVLTreeNode* stockNode : nodes) {
+            const string& ticker = stockNode->stock.ticker;
+            size_t common = 0;
+            if (previous) {
+                size_t limit = min(previous->size(), ticker.size());
+                while (common < limit && (*previous)[common] == ticker[common]) ++common;
+            }
+            previous = &ticker;
+
+            while (path.back().second > common) {
+                TickerIndexNode* top = path.back().first;
+                size_t start = path.back().second - top->label.size();
+                if (start >= common) {
+                    path.pop_back();
+                    continue;
+                }
+                // The ticker leaves this edge part way: split it in place
+                size_t cut = common - start;
+                TickerIndexNode* rest = pool.create(top->label.substr(cut), top->stockNode);
+                rest->childBytes.swap(top->childBytes);
+                rest->children.swap(top->children);
+                top->label.resize(cut);
+                top->stockNode = nullptr;
+                addChild(top, 0, rest);
+                path.back().second = common;
+            }
+
+            TickerIndexNode* top = path.back().first;
+            if (common == ticker.size()) {
+                top->stockNode = stockNode;
+                continue;
+            }
+            TickerIndexNode* leaf = pool.create(ticker.substr(common), stockNode);
+            addChild(top, top->children.size(), leaf);
+            path.emplace_back(leaf, ticker.size());
+        }
+    }
+
+    // Calls visit(stock) for the first k stocks, in ticker order, whose ticker starts with prefix
+    template <typename Visitor>
+    void forEachWithPrefix(const string& prefix, int k, Visitor visit) {
+        if (k <= 0) return;
+        TickerIndexNode* node = &root;
+        for (size_t i = 0; i < prefix.size(); i += node->label.size()) {
+            node = child(node, prefix[i]);
+            if (!node) return;
+            size_t length = min(node->label.size(), prefix.size() - i);
+            if (prefix.compare(i, length, node->label, 0, length) != 0) return;
+        }
+        visitInOrder(node, k, visit);
+    }
+
+    // Looks up all of tickers; found[i] is the stock of tickers[i] or nullptr.
+    // The tickers are taken in sorted order and each descent resumes from the
+    // deepest node shared with the previous ticker's path.
+    void findMany(const vector<string>& tickers, vector<const Stock*>& found) {
+        found.assign(tickers.size(), nullptr);
+        vector<size_t> order(tickers.size());
+        iota(order.begin(), order.end(), size_t(0));
+        sort(order.begin(), order.end(), [&tickers](size_t a, size_t b) { return tickers[a] < tickers[b]; });
+
+        vector<pair<TickerIndexNode*, size_t>> path = {{&root, 0}};  // node, length of its path
+        const string* previous = nullptr;
+        for (size_t index : order) {
+            const string& ticker = tickers[index];
+            size_t common = 0;
+            if (previous) {
+                size_t limit = min(previous->size(), ticker.size());
+                while (common < limit && (*previous)[common] == ticker[common]) ++common;
+            }
+            previous = &ticker;
+            while (path.back().second > common) path.pop_back();
+
+            TickerIndexNode* node = path.back().first;
+            size_t i = path.back().second;
+            while (i < ticker.size()) {
+                TickerIndexNode* next = child(node, ticker[i]);
+                if (!next || ticker.compare(i, next->label.size(), next->label) != 0) break;
+                node = next;
+                i += node->label.size();
+                path.emplace_back(node, i);
+            }
+            if (i == ticker.size() && node->stockNode) found[index] = &node->stockNode->stock;
+        }
+    }
+};
+
+// AVL Tree for managing stock data
+template <typename Stock>
+class BasicAVLTree {
+private:
+    typedef BasicAVLTreeNode<Stock> AVLTreeNode;
+    typedef BasicPriceIndex<Stock> PriceIndex;
+    typedef BasicTickerIndex<Stock> TickerIndex;
+    typedef BasicStockChange<Stock> StockChange;
+    typedef typename Stock::Price Price;
+    typedef typename Stock::PricePolicy PricePolicy;
+
+    // applyBatch relinks the tree when adds and deletes are at least 1/8 of
+    // the result, and re-sorts a price index when 1/32 of its entries moved.
+    // The indexes are moved on separate threads only when enough entries
+    // moved to pay for starting them.
+    static const size_t BATCH_RELINK_RATIO = 8;
+    static const size_t BATCH_REINDEX_RATIO = 32;
+    static const size_t BATCH_THREAD_MIN_MOVES = 4096;
+
+    AVLTreeNode* root;
+    NodePool<AVLTreeNode> pool;
+    PriceIndex priceIndex[PRICE_FIELD_COUNT];
+    TickerIndex tickerIndex;
+    STOCK_STATS_ONLY(uint64_t rotations = 0;)
+
+#ifndef STOCK_NO_STATS
+    // Rotations made so far by the tree and its price indexes
+    uint64_t rotationCount() const {
+        uint64_t total = rotations;
+        for (const auto& index : priceIndex) total += index.rotationCount();
+        return total;
+    }
+#endif
+
+    int height(AVLTreeNode* node) {
+        return node ? node->height : 0;
+    }
+
+    int balanceFactor(AVLTreeNode* node) {
+        return node ? height(node->left) - height(node->right) : 0;
+    }
+
+    // Recomputes height and the lastPrice aggregates from the node's children;
+    // min and max follow priceBefore, like the price indexes
+    void refresh(AVLTreeNode* node) {
+        node->height = 1 + max(height(node->left), height(node->right));
+        node->size = 1;
+        node->minPrice = node->maxPrice = node->stock.lastPrice;
+        node->priceSum = node->stock.lastPrice;
+        for (AVLTreeNode* child : {node->left, node->right}) {
+            if (!child) continue;
+            node->size += child->size;
+            if (priceBefore(child->minPrice, node->minPrice)) node->minPrice = child->minPrice;
+            if (priceBefore(node->maxPrice, child->maxPrice)) node->maxPrice = child->maxPrice;
+            node->priceSum += child->priceSum;
+        }
+    }
+
+    AVLTreeNode* rotateRight(AVLTreeNode* y) {
+        STOCK_STATS_ONLY(++rotations;)
+        AVLTreeNode* x = y->left;
+        AVLTreeNode* T2 = x->right;
+        x->right = y;
+        y->left = T2;
+        refresh(y);
+        refresh(x);
+        return x;
+    }
+
+    AVLTreeNode* rotateLeft(AVLTreeNode* x) {
+        STOCK_STATS_ONLY(++rotations;)
+        AVLTreeNode* y = x->right;
+        AVLTreeNode* T2 = y->left;
+        y->left = x;
+        x->right = T2;
+        refresh(x);
+        refresh(y);
+        return y;
+    }
+
+   AVLTreeNode* insert(AVLTreeNode* node, const Stock& stockData, AVLTreeNode*& created) {
+        if (!node) return created = pool.create(stockData);
+
+        if (stockData.ticker < node->stock.ticker)
+            node->left = insert(node->left, stockData, created);
+        else if (stockData.ticker > node->stock.ticker)
+            node->right = insert(node->right, stockData, created);
+        else
+            return node;
+
+        refresh(node);
+        int balance = balanceFactor(node);
+
+        if (balance > 1 && stockData.ticker < node->left->stock.ticker)
+            return rotateRight(node);
+        if (balance < -1 && stockData.ticker > node->right->stock.ticker)
+            return rotateLeft(node);
+        if (balance > 1 && stockData.ticker > node->left->stock.ticker) {
+            node->left = rotateLeft(node->left);
+            return rotateRight(node);
+        }
+        if (balance < -1 && stockData.ticker < node->right->stock.ticker) {
+            node->right = rotateRight(node->right);
+            return rotateLeft(node);
+        }
+        return node;
+    }
+
+    AVLTreeNode* update(AVLTreeNode* node, const Stock& stockData) {
+        if (!node) return nullptr;
+
+        if (stockData.ticker < node->stock.ticker) {
+            node->left = update(node->left, stockData);
+        } else if (stockData.ticker > node->stock.ticker) {
+            node->right = update(node->right, stockData);
+        } else {
+            node->stock = stockData;
+        }
+
+        refresh(node);
+        return node;
+    }
+
+    // Walks down to the node holding the extreme lastPrice using the subtree aggregates
+    AVLTreeNode* extremeNode(bool highest) {
+        AVLTreeNode* current = root;
+        while (current) {
+            Price target = highest ? current->maxPrice : current->minPrice;
+            AVLTreeNode* left = current->left;
+            if (left && samePrice(highest ? left->maxPrice : left->minPrice, target))
+                current = left;
+            else if (samePrice(current->stock.lastPrice, target))
+                return current;
+            else
+                current = current->right;
+        }
+        return nullptr;
+    }
+
+    AVLTreeNode* findNode(const string& ticker) {
+        AVLTreeNode* current = root;
+        while (current && current->stock.ticker != ticker) {
+            current = ticker < current->stock.ticker ? current->left : current->right;
+        }
+        return current;
+    }
+
+    AVLTreeNode* minNode(AVLTreeNode* node) {
+        AVLTreeNode* current = node;
+        while (current && current->left) {
+            current = current->left;
+        }
+        return current;
+    }
+
+    AVLTreeNode* deleteNode(AVLTreeNode* node, const string& ticker, bool release = true) {
+        if (!node) return node;
+
+        if (ticker < node->stock.ticker)
+            node->left = deleteNode(node->left, ticker, release);
+        else if (ticker > node->stock.ticker)
+            node->right = deleteNode(node->right, ticker, release);
+        else {
+            if (!node->left) {
+                AVLTreeNode* temp = node->right;
+                if (release) pool.release(node);
+                return temp;
+            } else if (!node->right) {
+                AVLTreeNode* temp = node->left;
+                if (release) pool.release(node);
+                return temp;
+            }
+
+            // Relink the successor instead of copying its stock so that
+            // price index entries keep pointing at live nodes
+            AVLTreeNode* successor = minNode(node->right);
+            successor->right = deleteNode(node->right, successor->stock.ticker, false);
+            successor->left = node->left;
+            pool.release(node);
+            node = successor;
+        }
+
+        refresh(node);
+        int balance = balanceFactor(node);
+
+        if (balance > 1 && balanceFactor(node->left) >= 0)
+            return rotateRight(node);
+        if (balance > 1 && balanceFactor(node->left) < 0) {
+            node->left = rotateLeft(node->left);
+            return rotateRight(node);
+        }
+        if (balance < -1 && balanceFactor(node->right) <= 0)
+            return rotateLeft(node);
+        if (balance < -1 && balanceFactor(node->right) > 0) {
+            node->right = rotateRight(node->right);
+            return rotateLeft(node);
+        }
+
+        return node;
+    }
+
+    void destroy(AVLTreeNode* node) {
+        if (!node) return;
+        destroy(node->left);
+        destroy(node->right);
+        node->~AVLTreeNode();
+    }
+
+    AVLTreeNode* buildBalanced(const vector<const Stock*>& sorted, size_t lo, size_t hi,
+                               vector<AVLTreeNode*>& nodes) {
+        if (lo >= hi) return nullptr;
+        size_t mid = lo + (hi - lo) / 2;
+        AVLTreeNode* node = pool.create(*sorted[mid]);
+        node->left = buildBalanced(sorted, lo, mid, nodes);
+        nodes.push_back(node);
+        node->right = buildBalanced(sorted, mid + 1, hi, nodes);
+        refresh(node);
+        return node;
+    }
+
+    // Links nodes, which are in ticker order, into a perfectly balanced tree
+    AVLTreeNode* linkBalanced(const vector<AVLTreeNode*>& nodes, size_t lo, size_t hi) {
+        if (lo >= hi) return nullptr;
+        size_t mid = lo + (hi - lo) / 2;
+        AVLTreeNode* node = nodes[mid];
+        node->left = linkBalanced(nodes, lo, mid);
+        node->right = linkBalanced(nodes, mid + 1, hi);
+        refresh(node);
+        return node;
+    }
+
+    // Rebuilds the ticker index and every price index from nodes in ticker
+    // order. Each index has its own pool, so they are built side by side.
+    void buildIndexes(const vector<AVLTreeNode*>& nodes) {
+        vector<thread> builders;
+        for (int f = 1; f < PRICE_FIELD_COUNT; ++f) {
+            builders.emplace_back([this, &nodes, f] { priceIndex[f].build(nodes, f); });
+        }
+        priceIndex[0].build(nodes, 0);
+        tickerIndex.build(nodes);
+        for (auto& builder : builders) builder.join();
+    }
+
+    // Work left over by applyChanges for the second phase of applyBatch
+    struct BatchPlan {
+        vector<AVLTreeNode*> removals;                  // in ticker order
+        vector<const Stock*> additions;                 // in ticker order
+        vector<AVLTreeNode*> moved[PRICE_FIELD_COUNT];  // nodes whose field changed
+        vector<Price> oldPrices[PRICE_FIELD_COUNT];     // field of moved[f][i] before the change
+    };
+
+    // Merges the sorted changes[lo, hi) into the subtree in one descent. Upserts
+    // of existing tickers are applied in place; deletions and new tickers are
+    // left in plan. Aggregates are refreshed once per visited node.
+    void applyChanges(AVLTreeNode* node, const vector<StockChange*>& changes, size_t lo, size_t hi, BatchPlan& plan) {
+        if (lo >= hi) return;
+        if (!node) {
+            for (size_t i = lo; i < hi; ++i) {
+                if (!changes[i]->remove) plan.additions.push_back(&changes[i]->stock);
+            }
+            return;
+        }
+
+        const string& ticker = node->stock.ticker;
+        size_t mid = lower_bound(changes.begin() + lo, changes.begin() + hi, ticker,
+                                 [](const StockChange* change, const string& key) {
+                                     return change->stock.ticker < key;
+                                 }) - changes.begin();
+        bool match = mid < hi && changes[mid]->stock.ticker == ticker;
+
+        applyChanges(node->left, changes, lo, mid, plan);
+        if (match && changes[mid]->remove) {
+            plan.removals.push_back(node);
+        } else if (match) {
+            Stock& stock = changes[mid]->stock;
+            for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+                Price oldPrice = priceOf(node->stock, PriceField(f));
+                if (samePrice(oldPrice, priceOf(stock, PriceField(f)))) continue;
+                plan.moved[f].push_back(node);
+                plan.oldPrices[f].push_back(oldPrice);
+            }
+            node->stock = move(stock);
+        }
+        applyChanges(node->right, changes, match ? mid + 1 : mid, hi, plan);
+        refresh(node);
+    }
+
+    // Appends the subtree's nodes in ticker order, leaving out removals (also in ticker order)
+    void collectNodes(AVLTreeNode* node, const vector<AVLTreeNode*>& removals, size_t& nextRemoval,
+                      vector<AVLTreeNode*>& nodes) {
+        if (!node) return;
+        collectNodes(node->left, removals, nextRemoval, nodes);
+        if (nextRemoval < removals.size() && removals[nextRemoval] == node)
+            ++nextRemoval;
+        else
+            nodes.push_back(node);
+        collectNodes(node->right, removals, nextRemoval, nodes);
+    }
+
+    // Relinks the whole tree with the batch's deletions dropped and its new
+    // stocks merged in, then rebuilds the price indexes
+    void relinkWith(const BatchPlan& plan) {
+        vector<AVLTreeNode*> kept;
+        kept.reserve(size());
+        size_t nextRemoval = 0;
+        collectNodes(root, plan.removals, nextRemoval, kept);
+        for (AVLTreeNode* node : plan.removals) pool.release(node);
+
+        vector<AVLTreeNode*> nodes;
+        nodes.reserve(kept.size() + plan.additions.size());
+        size_t k = 0;
+        for (const Stock* stock : plan.additions) {
+            while (k < kept.size() && kept[k]->stock.ticker < stock->ticker) nodes.push_back(kept[k++]);
+            nodes.push_back(pool.create(*stock));
+        }
+        nodes.insert(nodes.end(), kept.begin() + k, kept.end());
+
+        root = linkBalanced(nodes, 0, nodes.size());
+        buildIndexes(nodes);
+    }
+
+    template <typename Visitor>
+    void visitInOrder(AVLTreeNode* node, Visitor& visit) {
+        if (!node) return;
+        visitInOrder(node->left, visit);
+        visit(node->stock);
+        visitInOrder(node->right, visit);
+    }
+
+public:
+    BasicAVLTree() : root(nullptr) {}
+
+    ~BasicAVLTree() {
+        destroy(root);
+    }
+
+    // Drops every stock; node memory stays in the pool for reuse
+    void clear() {
+        destroy(root);
+        root = nullptr;
+        pool.reset();
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) priceIndex[f].clear();
+        tickerIndex.clear();
+    }
+
+    // Replaces the contents with stockList, building perfectly balanced trees
+    // without rotations. Like insert, the first row for a ticker wins.
+    void bulkLoad(const vector<Stock>& stockList) {
+        vector<const Stock*> sorted;
+        sorted.reserve(stockList.size());
+        for (const auto& stock : stockList) sorted.push_back(&stock);
+        stable_sort(sorted.begin(), sorted.end(), [](const Stock* a, const Stock* b) {
+            return a->ticker < b->ticker;
+        });
+        sorted.erase(unique(sorted.begin(), sorted.end(), [](const Stock* a, const Stock* b) {
+            return a->ticker == b->ticker;
+        }), sorted.end());
+
+        clear();
+        pool.reserve(sorted.size());
+        vector<AVLTreeNode*> nodes;
+        nodes.reserve(sorted.size());
+        root = buildBalanced(sorted, 0, sorted.size(), nodes);
+        buildIndexes(nodes);
+    }
+
+    // Replaces the contents with sorted, which must be in ticker order without
+    // duplicates; priceOrders[f] lists its positions in (field f, ticker)
+    // order. Used to restore a snapshot without sorting anything.
+    bool bulkLoadSorted(vector<Stock>& sorted, const uint32_t* const priceOrders[PRICE_FIELD_COUNT]) {
+        clear();
+        pool.reserve(sorted.size());
+        vector<Price> prices[PRICE_FIELD_COUNT];
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            prices[f].reserve(sorted.size());
+            for (const auto& stock : sorted) prices[f].push_back(priceOf(stock, PriceField(f)));
+        }
+
+        vector<AVLTreeNode*> nodes;
+        nodes.reserve(sorted.size());
+        for (auto& stock : sorted) nodes.push_back(pool.create(move(stock)));
+        root = linkBalanced(nodes, 0, nodes.size());
+
+        vector<thread> builders;
+        for (int f = 1; f < PRICE_FIELD_COUNT; ++f) {
+            builders.emplace_back([this, &nodes, &prices, priceOrders, f] {
+                priceIndex[f].buildInOrder(nodes, prices[f], priceOrders[f]);
+            });
+        }
+        priceIndex[0].buildInOrder(nodes, prices[0], priceOrders[0]);
+        tickerIndex.build(nodes);
+        for (auto& builder : builders) builder.join();
+        return true;
+    }
+
+    // Applies a batch of upserts and deletions; unlike update, an upsert of a
+    // missing ticker inserts it. The batch is sorted by ticker (the last change
+    // of a ticker wins) and merged into the tree in one descent. Price index
+    // entries that moved are re-sorted together when there are many of them,
+    // and a batch that adds or deletes a large share of the tree relinks it.
+    void applyBatch(vector<StockChange> changes) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeBatch); stockStats.batchChanges.add(changes.size());
+                         uint64_t rotationsBefore = rotationCount();)
+        vector<StockChange*> sorted = sortChanges(changes);
+        BatchPlan plan;
+        applyChanges(root, sorted, 0, sorted.size(), plan);
+
+        size_t count = size_t(size());
+        size_t structural = plan.removals.size() + plan.additions.size();
+        if (structural * BATCH_RELINK_RATIO >= count + structural) {
+            relinkWith(plan);
+            return;
+        }
+
+        // Each index has its own pool, so the fields are moved side by side
+        auto moveEntries = [this, &plan, count](int f) {
+            const vector<AVLTreeNode*>& moved = plan.moved[f];
+            if (moved.size() * BATCH_REINDEX_RATIO >= count) {
+                priceIndex[f].rebuildMoved(moved, plan.oldPrices[f], f);
+                return;
+            }
+            // Removing and inserting in price order keeps the index paths warm
+            vector<pair<Price, AVLTreeNode*>> entries;
+            entries.reserve(moved.size());
+            for (size_t i = 0; i < moved.size(); ++i) entries.emplace_back(plan.oldPrices[f][i], moved[i]);
+            auto byPrice = [](const pair<Price, AVLTreeNode*>& a, const pair<Price, AVLTreeNode*>& b) {
+                return priceBefore(a.first, b.first);
+            };
+            sort(entries.begin(), entries.end(), byPrice);
+            for (const auto& entry : entries) priceIndex[f].remove(entry.first, entry.second->stock.ticker);
+            for (auto& entry : entries) entry.first = priceOf(entry.second->stock, PriceField(f));
+            sort(entries.begin(), entries.end(), byPrice);
+            for (const auto& entry : entries) priceIndex[f].insert(entry.first, entry.second);
+        };
+
+        vector<int> fields;
+        size_t movedEntries = 0;
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            if (!plan.moved[f].empty()) fields.push_back(f);
+            movedEntries += plan.moved[f].size();
+        }
+        vector<thread> movers;
+        if (movedEntries >= BATCH_THREAD_MIN_MOVES) {
+            for (size_t i = 1; i < fields.size(); ++i) movers.emplace_back(moveEntries, fields[i]);
+        } else {
+            for (size_t i = 1; i < fields.size(); ++i) moveEntries(fields[i]);
+        }
+        if (!fields.empty()) moveEntries(fields[0]);
+        for (auto& mover : movers) mover.join();
+        STOCK_STATS_ONLY(stockStats.batchRotations.add(rotationCount() - rotationsBefore);)
+
+        // Counted as single inserts and deletes, rotations included
+        for (AVLTreeNode* node : plan.removals) {
+            string ticker = node->stock.ticker;  // the node is released during the delete
+            deleteStock(ticker);
+        }
+        for (const Stock* stock : plan.additions) insert(*stock);
+    }
+
+    void insert(const Stock& stockData) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeInsert); uint64_t rotationsBefore = rotationCount();)
+        AVLTreeNode* created = nullptr;
+        root = insert(root, stockData, created);
+        if (!created) return;
+
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            priceIndex[f].insert(priceOf(created->stock, PriceField(f)), created);
+        }
+        tickerIndex.insert(created->stock.ticker, created);
+        STOCK_STATS_ONLY(stockStats.insertRotations.add(rotationCount() - rotationsBefore);)
+    }
+
+    // Replaces the stock's data and moves its price index entries if the prices changed
+    void update(const Stock& stockData) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeUpdate); uint64_t rotationsBefore = rotationCount();)
+        AVLTreeNode* node = findNode(stockData.ticker);
+        if (!node) return;
+
+        bool moved[PRICE_FIELD_COUNT];
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            Price oldPrice = priceOf(node->stock, PriceField(f));
+            moved[f] = !samePrice(oldPrice, priceOf(stockData, PriceField(f)));
+            if (moved[f]) priceIndex[f].remove(oldPrice, node->stock.ticker);
+        }
+
+        root = update(root, stockData);
+
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            if (moved[f]) priceIndex[f].insert(priceOf(node->stock, PriceField(f)), node);
+        }
+        STOCK_STATS_ONLY(stockStats.updateRotations.add(rotationCount() - rotationsBefore);)
+    }
+
+    void deleteStock(const string& ticker) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeDelete); uint64_t rotationsBefore = rotationCount();)
+        AVLTreeNode* node = findNode(ticker);
+        if (!node) return;
+
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            priceIndex[f].remove(priceOf(node->stock, PriceField(f)), ticker);
+        }
+        tickerIndex.remove(ticker);
+        root = deleteNode(root, ticker);
+        STOCK_STATS_ONLY(stockStats.deleteRotations.add(rotationCount() - rotationsBefore);)
+    }
+
+    void printTree(StockWriter& writer) {
+        forEach([&writer](const Stock& stock) { writer.write(stock); });
+    }
+
+    const Stock* find(const string& ticker) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeFind);)
+        AVLTreeNode* node = findNode(ticker);
+        return node ? &node->stock : nullptr;
+    }
+
+    // Calls visit(stock) for every stock, in ticker order
+    template <typename Visitor>
+    void forEach(Visitor visit) {
+        visitInOrder(root, visit);
+    }
+
+    // Calls visit(stock) for every stock whose field lies in [minPrice, maxPrice], in price order
+    template <typename Visitor>
+    void forEachInRange(PriceField field, Price minPrice, Price maxPrice, Visitor visit) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeRange);)
+        priceIndex[int(field)].forEachInRange(minPrice, maxPrice, visit);
+    }
+
+    // Number of stocks whose field lies in [minPrice, maxPrice], without visiting them
+    int countInRange(PriceField field, Price minPrice, Price maxPrice) {
+        return priceIndex[int(field)].countInRange(minPrice, maxPrice);
+    }
+
+    // Calls visit(stock) for the first k stocks, in ticker order, whose ticker starts with prefix
+    template <typename Visitor>
+    void forEachWithPrefix(const string& prefix, int k, Visitor visit) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treePrefix);)
+        tickerIndex.forEachWithPrefix(prefix, k, visit);
+    }
+
+    // Looks up several tickers at once; found[i] is the stock of tickers[i] or nullptr
+    void getMany(const vector<string>& tickers, vector<const Stock*>& found) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeGetMany);)
+        tickerIndex.findMany(tickers, found);
+    }
+
+    // Highest and lowest lastPrice in O(log n); nullptr when the tree is empty
+    const Stock* highest() {
+        AVLTreeNode* node = extremeNode(true);
+        return node ? &node->stock : nullptr;
+    }
+
+    const Stock* lowest() {
+        AVLTreeNode* node = extremeNode(false);
+        return node ? &node->stock : nullptr;
+    }
+
+    // 1-based position of the ticker when ordered by lastPrice, highest first; 0 if absent
+    int rankByPrice(const string& ticker) {
+        AVLTreeNode* node = findNode(ticker);
+        if (!node) return 0;
+        PriceIndex& index = priceIndex[int(PriceField::LastPrice)];
+        return index.size() - index.countBefore(node->stock.lastPrice, ticker);
+    }
+
+    // Calls visit(stock) for the k stocks with the highest (or lowest) field value
+    template <typename Visitor>
+    void forEachTop(PriceField field, int k, bool highest, Visitor visit) {
+        priceIndex[int(field)].forEachTop(k, highest, visit);
+    }
+
+    int size() {
+        return root ? root->size : 0;
+    }
+
+    double averagePrice() {
+        return root ? PricePolicy::toDouble(root->priceSum) / root->size : 0.0;
+    }
+
+    AVLTreeNode* getRoot() {
+        return root;
+    }
+};
+
+typedef BasicAVLTree<StockData> AVLTree;
+
+// Ticker packed big-endian into two words so that integer order matches string order
+struct TickerKey {
+    uint64_t hi;
+    uint64_t lo;
+
+    bool operator<(const TickerKey& other) const {
+        return hi != other.hi ? hi < other.hi : lo < other.lo;
+    }
+
+    bool operator==(const TickerKey& other) const {
+        return hi == other.hi && lo == other.lo;
+    }
+};
+
+const size_t MAX_PACKED_TICKER = 16;
+
+TickerKey packTicker(string_view ticker) {
+    uint64_t words[2] = {0, 0};
+    size_t length = min(ticker.size(), MAX_PACKED_TICKER);
+    for (size_t i = 0; i < length; ++i) {
+        words[i / 8] |= uint64_t(uint8_t(ticker[i])) << (56 - 8 * (i % 8));
+    }
+    return {words[0], words[1]};
+}
+
+// Stock store backed by sorted flat arrays. Lookups binary-search a contiguous
+// array of packed ticker keys and each price ordering is a sorted array of
+// (price, slot) pairs. Full records, including the chart paths, live in a
+// slot-indexed side table that is only touched once a stock has been found.
+class FlatStockTree {
+private:
+    struct PriceEntry {
+        float price;
+        uint32_t slot;
+    };
+
+    vector<TickerKey> keys;          // sorted ticker keys
+    vector<uint32_t> keySlots;       // slot of keys[i]
+    vector<TickerKey> slotKeys;      // key of each slot, for price tie-breaks
+    vector<StockData> records;       // side table indexed by slot
+    vector<uint32_t> freeSlots;
+    vector<PriceEntry> byPrice[PRICE_FIELD_COUNT];
+    double priceSum;
+
+    // Position of key in keys, or keys.size() if absent
+    size_t findPosition(const TickerKey& key) {
+        size_t pos = lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        return pos < keys.size() && keys[pos] == key ? pos : keys.size();
+    }
+
+    // First entry not ordered before (price, key)
+    size_t pricePosition(int field, float price, const TickerKey& key) {
+        const vector<PriceEntry>& entries = byPrice[field];
+        size_t lo = 0, hi = entries.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            const PriceEntry& entry = entries[mid];
+            bool before = !samePrice(entry.price, price) ? priceBefore(entry.price, price) : slotKeys[entry.slot] < key;
+            if (before) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    void addPrice(int field, uint32_t slot) {
+        float price = priceOf(records[slot], PriceField(field));
+        size_t pos = pricePosition(field, price, slotKeys[slot]);
+        byPrice[field].insert(byPrice[field].begin() + pos, PriceEntry{price, slot});
+    }
+
+    void removePrice(int field, uint32_t slot) {
+        float price = priceOf(records[slot], PriceField(field));
+        size_t pos = pricePosition(field, price, slotKeys[slot]);
+        byPrice[field].erase(byPrice[field].begin() + pos);
+    }
+
+    // Ties resolve to the lowest ticker, matching AVLTree
+    const StockData* extreme(bool highest) {
+        int field = int(PriceField::LastPrice);
+        const vector<PriceEntry>& entries = byPrice[field];
+        if (entries.empty()) return nullptr;
+        if (!highest) return &records[entries.front().slot];
+        return &records[entries[pricePosition(field, entries.back().price, TickerKey{0, 0})].slot];
+    }
+
+public:
+    FlatStockTree() : priceSum(0.0) {}
+
+    void clear() {
+        keys.clear();
+        keySlots.clear();
+        slotKeys.clear();
+        records.clear();
+        freeSlots.clear();
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) byPrice[f].clear();
+        priceSum = 0.0;
+    }
+
+    // Replaces the contents with stockList. Like insert, the first row for a ticker wins.
+    void bulkLoad(const vector<StockData>& stockList) {
+        vector<const StockData*> sorted;
+        sorted.reserve(stockList.size());
+        for (const auto& stock : stockList) {
+            if (stock.ticker.size() > MAX_PACKED_TICKER) {
+                cerr << "Error: Ticker " << stock.ticker << " is longer than "
+                     << MAX_PACKED_TICKER << " characters." << endl;
+                continue;
+            }
+            sorted.push_back(&stock);
+        }
+        stable_sort(sorted.begin(), sorted.end(), [](const StockData* a, const StockData* b) {
+            return a->ticker < b->ticker;
+        });
+        sorted.erase(unique(sorted.begin(), sorted.end(), [](const StockData* a, const StockData* b) {
+            return a->ticker == b->ticker;
+        }), sorted.end());
+
+        clear();
+        records.reserve(sorted.size());
+        for (uint32_t slot = 0; slot < sorted.size(); ++slot) {
+            records.push_back(*sorted[slot]);
+            slotKeys.push_back(packTicker(sorted[slot]->ticker));
+            keySlots.push_back(slot);
+            priceSum += sorted[slot]->lastPrice;
+        }
+        keys = slotKeys;
+
+        auto buildField = [this](int f) {
+            vector<PriceEntry>& entries = byPrice[f];
+            entries.reserve(records.size());
+            for (uint32_t slot = 0; slot < records.size(); ++slot) {
+                entries.push_back(PriceEntry{priceOf(records[slot], PriceField(f)), slot});
+            }
+            // Slots are in ticker order, so the slot number breaks price ties
+            sort(entries.begin(), entries.end(), [](const PriceEntry& a, const PriceEntry& b) {
+                return !samePrice(a.price, b.price) ? priceBefore(a.price, b.price) : a.slot < b.slot;
+            });
+        };
+
+        vector<thread> builders;
+        for (int f = 1; f < PRICE_FIELD_COUNT; ++f) builders.emplace_back(buildField, f);
+        buildField(0);
+        for (auto& builder : builders) builder.join();
+    }
+
+    // Replaces the contents with sorted, which must be in ticker order without
+    // duplicates; priceOrders[f] lists its positions in (field f, ticker)
+    // order. Used to restore a snapshot without sorting anything. False, with
+    // the tree left empty, if a ticker is too long for this backend.
+    bool bulkLoadSorted(vector<StockData>& sorted, const uint32_t* const priceOrders[PRICE_FIELD_COUNT]) {
+        clear();
+        for (const auto& stock : sorted) {
+            if (stock.ticker.size() > MAX_PACKED_TICKER) return false;
+        }
+
+        records = move(sorted);
+        sorted.clear();
+        slotKeys.reserve(records.size());
+        keySlots.reserve(records.size());
+        for (uint32_t slot = 0; slot < records.size(); ++slot) {
+            slotKeys.push_back(packTicker(records[slot].ticker));
+            keySlots.push_back(slot);
+            priceSum += records[slot].lastPrice;
+        }
+        keys = slotKeys;
+
+        vector<float> prices(records.size());
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            for (uint32_t slot = 0; slot < records.size(); ++slot) prices[slot] = priceOf(records[slot], PriceField(f));
+            vector<PriceEntry>& entries = byPrice[f];
+            entries.reserve(records.size());
+            for (size_t i = 0; i < records.size(); ++i) {
+                uint32_t slot = priceOrders[f][i];
+                entries.push_back(PriceEntry{prices[slot], slot});
+            }
+        }
+        return true;
+    }
+
+    void insert(const StockData& stockData) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeInsert);)
+        if (stockData.ticker.size() > MAX_PACKED_TICKER) {
+            cerr << "Error: Ticker " << stockData.ticker << " is longer than "
+                 << MAX_PACKED_TICKER << " characters." << endl;
+            return;
+        }
+
+        TickerKey key = packTicker(stockData.ticker);
+        size_t pos = lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        if (pos < keys.size() && keys[pos] == key) return;
+
+        uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            records[slot] = stockData;
+            slotKeys[slot] = key;
+        } else {
+            slot = uint32_t(records.size());
+            records.push_back(stockData);
+            slotKeys.push_back(key);
+        }
+
+        keys.insert(keys.begin() + pos, key);
+        keySlots.insert(keySlots.begin() + pos, slot);
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) addPrice(f, slot);
+        priceSum += stockData.lastPrice;
+    }
+
+    // Replaces the stock's data and moves its price entries if the prices changed
+    void update(const StockData& stockData) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeUpdate);)
+        size_t pos = findPosition(packTicker(stockData.ticker));
+        if (pos == keys.size()) return;
+
+        uint32_t slot = keySlots[pos];
+        StockData& record = records[slot];
+        bool moved[PRICE_FIELD_COUNT];
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            moved[f] = !samePrice(priceOf(record, PriceField(f)), priceOf(stockData, PriceField(f)));
+            if (moved[f]) removePrice(f, slot);
+        }
+
+        priceSum += double(stockData.lastPrice) - record.lastPrice;
+        record = stockData;
+
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            if (moved[f]) addPrice(f, slot);
+        }
+    }
+
+    // Applies a batch of upserts and deletions; an upsert of a missing ticker
+    // inserts it. The sorted batch is merged into the key array and into each
+    // price array in one pass per array, O(n + k log k) overall, instead of
+    // shifting the arrays once per change.
+    void applyBatch(vector<StockChange> changes) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeBatch); stockStats.batchChanges.add(changes.size());)
+        vector<StockChange*> sorted = sortChanges(changes);
+
+        struct Addition {
+            size_t position;  // insert before keys[position]
+            TickerKey key;
+            uint32_t slot;
+        };
+        vector<size_t> removedPositions;
+        vector<uint32_t> removedSlots;
+        vector<Addition> additions;
+        vector<uint32_t> moved[PRICE_FIELD_COUNT];  // slots whose field needs a new entry
+        vector<uint8_t> staleFields(records.size());  // bit f set: the slot's old field-f entry goes
+
+        size_t cursor = 0;
+        for (StockChange* change : sorted) {
+            StockData& stock = change->stock;
+            if (stock.ticker.size() > MAX_PACKED_TICKER) {
+                if (!change->remove) {
+                    cerr << "Error: Ticker " << stock.ticker << " is longer than "
+                         << MAX_PACKED_TICKER << " characters." << endl;
+                }
+                continue;
+            }
+
+            TickerKey key = packTicker(stock.ticker);
+            cursor = lower_bound(keys.begin() + cursor, keys.end(), key) - keys.begin();
+            bool found = cursor < keys.size() && keys[cursor] == key;
+
+            if (found && change->remove) {
+                uint32_t slot = keySlots[cursor];
+                removedPositions.push_back(cursor);
+                removedSlots.push_back(slot);
+                staleFields[slot] = (1 << PRICE_FIELD_COUNT) - 1;
+                priceSum -= records[slot].lastPrice;
+            } else if (found) {
+                uint32_t slot = keySlots[cursor];
+                StockData& record = records[slot];
+                for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+                    if (samePrice(priceOf(record, PriceField(f)), priceOf(stock, PriceField(f)))) continue;
+                    staleFields[slot] |= 1 << f;
+                    moved[f].push_back(slot);
+                }
+                priceSum += double(stock.lastPrice) - record.lastPrice;
+                record = move(stock);
+            } else if (!change->remove) {
+                uint32_t slot;
+                if (!freeSlots.empty()) {
+                    slot = freeSlots.back();
+                    freeSlots.pop_back();
+                    slotKeys[slot] = key;
+                } else {
+                    slot = uint32_t(records.size());
+                    records.emplace_back();
+                    slotKeys.push_back(key);
+                }
+                priceSum += stock.lastPrice;
+                records[slot] = move(stock);
+                additions.push_back(Addition{cursor, key, slot});
+                for (int f = 0; f < PRICE_FIELD_COUNT; ++f) moved[f].push_back(slot);
+            }
+        }
+
+        if (!removedPositions.empty() || !additions.empty()) {
+            vector<TickerKey> mergedKeys;
+            vector<uint32_t> mergedSlots;
+            size_t total = keys.size() - removedPositions.size() + additions.size();
+            mergedKeys.reserve(total);
+            mergedSlots.reserve(total);
+            size_t nextRemoval = 0, nextAddition = 0;
+            for (size_t pos = 0; pos <= keys.size(); ++pos) {
+                while (nextAddition < additions.size() && additions[nextAddition].position == pos) {
+                    mergedKeys.push_back(additions[nextAddition].key);
+                    mergedSlots.push_back(additions[nextAddition].slot);
+                    ++nextAddition;
+                }
+                if (pos == keys.size()) break;
+                if (nextRemoval < removedPositions.size() && removedPositions[nextRemoval] == pos) {
+                    ++nextRemoval;
+                    continue;
+                }
+                mergedKeys.push_back(keys[pos]);
+                mergedSlots.push_back(keySlots[pos]);
+            }
+            keys.swap(mergedKeys);
+            keySlots.swap(mergedSlots);
+        }
+
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            if (moved[f].empty() && removedSlots.empty()) continue;
+
+            vector<PriceEntry>& entries = byPrice[f];
+            uint8_t bit = uint8_t(1 << f);
+            entries.erase(remove_if(entries.begin(), entries.end(), [&](const PriceEntry& entry) {
+                return entry.slot < staleFields.size() && (staleFields[entry.slot] & bit);
+            }), entries.end());
+
+            auto before = [this](const PriceEntry& a, const PriceEntry& b) {
+                return !samePrice(a.price, b.price) ? priceBefore(a.price, b.price) : slotKeys[a.slot] < slotKeys[b.slot];
+            };
+            vector<PriceEntry> added;
+            added.reserve(moved[f].size());
+            for (uint32_t slot : moved[f]) added.push_back(PriceEntry{priceOf(records[slot], PriceField(f)), slot});
+            sort(added.begin(), added.end(), before);
+
+            size_t middle = entries.size();
+            entries.insert(entries.end(), added.begin(), added.end());
+            inplace_merge(entries.begin(), entries.begin() + middle, entries.end(), before);
+        }
+
+        for (uint32_t slot : removedSlots) {
+            records[slot] = StockData();
+            freeSlots.push_back(slot);
+        }
+    }
+
+    void deleteStock(const string& ticker) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeDelete);)
+        size_t pos = findPosition(packTicker(ticker));
+        if (pos == keys.size()) return;
+
+        uint32_t slot = keySlots[pos];
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) removePrice(f, slot);
+        priceSum -= records[slot].lastPrice;
+
+        keys.erase(keys.begin() + pos);
+        keySlots.erase(keySlots.begin() + pos);
+        records[slot] = StockData();
+        freeSlots.push_back(slot);
+    }
+
+    void printTree(StockWriter& writer) {
+        for (uint32_t slot : keySlots) writer.write(records[slot]);
+    }
+
+    const StockData* find(const string& ticker) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeFind);)
+        size_t pos = findPosition(packTicker(ticker));
+        return pos == keys.size() ? nullptr : &records[keySlots[pos]];
+    }
+
+    // Calls visit(stock) for every stock, in ticker order
+    template <typename Visitor>
+    void forEach(Visitor visit) {
+        for (uint32_t slot : keySlots) visit(records[slot]);
+    }
+
+    // Calls visit(stock) for every stock whose field lies in [minPrice, maxPrice], in price order
+    template <typename Visitor>
+    void forEachInRange(PriceField field, float minPrice, float maxPrice, Visitor visit) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeRange);)
+        const vector<PriceEntry>& entries = byPrice[int(field)];
+        auto it = lower_bound(entries.begin(), entries.end(), minPrice,
+                              [](const PriceEntry& entry, float price) { return priceBefore(entry.price, price); });
+        for (; it != entries.end() && !priceBefore(maxPrice, it->price); ++it) {
+            visit(records[it->slot]);
+        }
+    }
+
+    // Number of stocks whose field lies in [minPrice, maxPrice], without visiting them
+    int countInRange(PriceField field, float minPrice, float maxPrice) {
+        const vector<PriceEntry>& entries = byPrice[int(field)];
+        auto first = lower_bound(entries.begin(), entries.end(), minPrice,
+                                 [](const PriceEntry& entry, float price) { return priceBefore(entry.price, price); });
+        auto last = upper_bound(first, entries.end(), maxPrice,
+                                [](float price, const PriceEntry& entry) { return priceBefore(price, entry.price); });
+        return int(last - first);
+    }
+
+    // Calls visit(stock) for the first k stocks, in ticker order, whose ticker
+    // starts with prefix. Zero padding makes the packed prefix the lowest key
+    // sharing it, so the matches are the keys that follow its position.
+    template <typename Visitor>
+    void forEachWithPrefix(const string& prefix, int k, Visitor visit) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treePrefix);)
+        if (k <= 0 || prefix.size() > MAX_PACKED_TICKER) return;
+        size_t pos = lower_bound(keys.begin(), keys.end(), packTicker(prefix)) - keys.begin();
+        for (; pos < keys.size() && k > 0; ++pos, --k) {
+            const StockData& stock = records[keySlots[pos]];
+            if (stock.ticker.compare(0, prefix.size(), prefix) != 0) break;
+            visit(stock);
+        }
+    }
+
+    // Looks up several tickers at once; found[i] is the stock of tickers[i] or
+    // nullptr. The keys are searched in sorted order, each one galloping
+    // forward from the position of the previous.
+    void getMany(const vector<string>& tickers, vector<const StockData*>& found) {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.treeGetMany);)
+        found.assign(tickers.size(), nullptr);
+        vector<pair<TickerKey, size_t>> queries;
+        queries.reserve(tickers.size());
+        for (size_t i = 0; i < tickers.size(); ++i) queries.emplace_back(packTicker(tickers[i]), i);
+        sort(queries.begin(), queries.end(), [](const pair<TickerKey, size_t>& a, const pair<TickerKey, size_t>& b) {
+            return a.first < b.first;
+        });
+
+        size_t lo = 0;
+        for (const auto& query : queries) {
+            size_t step = 1, hi = lo;
+            while (hi < keys.size() && keys[hi] < query.first) {
+                lo = hi + 1;
+                hi += step;
+                step *= 2;
+            }
+            hi = min(hi, keys.size());
+            lo = lower_bound(keys.begin() + lo, keys.begin() + hi, query.first) - keys.begin();
+            if (lo < keys.size() && keys[lo] == query.first) found[query.second] = &records[keySlots[lo]];
+        }
+    }
+
+    const StockData* highest() {
+        return extreme(true);
+    }
+
+    const StockData* lowest() {
+        return extreme(false);
+    }
+
+    // 1-based position of the ticker when ordered by lastPrice, highest first; 0 if absent
+    int rankByPrice(const string& ticker) {
+        TickerKey key = packTicker(ticker);
+        size_t pos = findPosition(key);
+        if (pos == keys.size()) return 0;
+
+        int field = int(PriceField::LastPrice);
+        size_t before = pricePosition(field, records[keySlots[pos]].lastPrice, key);
+        return int(byPrice[field].size() - before);
+    }
+
+    // Calls visit(stock) for the k stocks with the highest (or lowest) field value
+    template <typename Visitor>
+    void forEachTop(PriceField field, int k, bool highest, Visitor visit) {
+        const vector<PriceEntry>& entries = byPrice[int(field)];
+        size_t count = min(entries.size(), size_t(max(k, 0)));
+        for (size_t i = 0; i < count; ++i) {
+            visit(records[entries[highest ? entries.size() - 1 - i : i].slot]);
+        }
+    }
+
+    int size() {
+        return int(keys.size());
+    }
+
+    double averagePrice() {
+        return keys.empty() ? 0.0 : priceSum / keys.size();
+    }
+};
+
+// Compile with -DSTOCK_FLAT_BACKEND to serve the menu from the flat array backend
+#ifdef STOCK_FLAT_BACKEND
+typedef FlatStockTree StockTree;
+#else
+typedef AVLTree StockTree;
+#endif
+
+// StockTree shared between reader threads and writer threads using left-right
+// concurrency control. Two copies of the tree are kept. Readers use the live
+// copy and only touch a per-thread counter, so they never wait. A writer
+// applies its mutation to the idle copy, makes that copy live, waits for the
+// readers still inside the old copy to leave, then replays the mutation there.
+// Writers are serialized and pay for every change twice, so feeds should group
+// changes into batches (updateBatch) rather than write one stock at a time.
+class ConcurrentStockTree {
+private:
+    static const size_t READER_SLOTS = 32;
+
+    // One counter per cache line so that readers on different cores do not contend
+    struct alignas(64) ReaderCount {
+        atomic<long> value;
+        ReaderCount() : value(0) {}
+    };
+
+    // Decrements the reader count when a read finishes, even by exception
+    struct ReadGuard {
+        atomic<long>& count;
+        ~ReadGuard() {
+            count.fetch_sub(1);
+        }
+    };
+
+    StockTree trees[2];
+    atomic<int> liveIndex;              // copy that new reads use
+    atomic<int> versionIndex;           // reader counters that new reads increment
+    ReaderCount readers[2][READER_SLOTS];
+    mutex writeLock;
+
+    static size_t readerSlot() {
+        static atomic<size_t> nextSlot(0);
+        static thread_local size_t slot = nextSlot.fetch_add(1) % READER_SLOTS;
+        return slot;
+    }
+
+    void waitForReaders(int version) {
+        for (size_t i = 0; i < READER_SLOTS; ++i) {
+            while (readers[version][i].value.load() != 0) this_thread::yield();
+        }
+    }
+
+public:
+    ConcurrentStockTree() : liveIndex(0), versionIndex(0) {}
+
+    // Runs visit(tree) against a consistent copy and returns its result. The
+    // visitor must only call the tree's read methods.
+    template <typename Visitor>
+    auto read(Visitor visit) {
+        int version = versionIndex.load();
+        atomic<long>& count = readers[version][readerSlot()].value;
+        count.fetch_add(1);
+        ReadGuard guard{count};
+        return visit(trees[liveIndex.load()]);
+    }
+
+    // Applies mutate(tree) to both copies; mutate must be deterministic
+    template <typename Mutation>
+    void write(Mutation mutate) {
+        lock_guard<mutex> guard(writeLock);
+        int live = liveIndex.load();
+        mutate(trees[1 - live]);
+        liveIndex.store(1 - live);
+
+        // Readers that saw the old live index registered under either version
+        // counter; drain both before touching the old copy
+        int version = versionIndex.load();
+        waitForReaders(1 - version);
+        versionIndex.store(1 - version);
+        waitForReaders(version);
+
+        mutate(trees[live]);
+    }
+
+    void bulkLoad(const vector<StockData>& stockList) {
+        write([&stockList](StockTree& tree) { tree.bulkLoad(stockList); });
+    }
+
+    void insert(const StockData& stockData) {
+        write([&stockData](StockTree& tree) { tree.insert(stockData); });
+    }
+
+    void update(const StockData& stockData) {
+        write([&stockData](StockTree& tree) { tree.update(stockData); });
+    }
+
+    void deleteStock(const string& ticker) {
+        write([&ticker](StockTree& tree) { tree.deleteStock(ticker); });
+    }
+
+    // Publishes all of updates at once; readers see either none or all of them
+    void updateBatch(const vector<StockData>& updates) {
+        write([&updates](StockTree& tree) {
+            for (const auto& stock : updates) tree.update(stock);
+        });
+    }
+
+    // Publishes a batch of upserts and deletions at once
+    void applyBatch(const vector<StockChange>& changes) {
+        write([&changes](StockTree& tree) { tree.applyBatch(changes); });
+    }
+
+    // True if both copies hold the same stocks; call while no writer is active
+    bool consistent() {
+        lock_guard<mutex> guard(writeLock);
+        vector<const StockData*> first;
+        trees[0].forEach([&first](const StockData& stock) { first.push_back(&stock); });
+        size_t i = 0;
+        bool same = true;
+        trees[1].forEach([&](const StockData& stock) {
+            if (i >= first.size()) {
+                same = false;
+                return;
+            }
+            const StockData& other = *first[i++];
+            same = same && stock.ticker == other.ticker && stock.open == other.open
+                   && stock.dayHigh == other.dayHigh && stock.dayLow == other.dayLow
+                   && stock.lastPrice == other.lastPrice;
+        });
+        return same && i == first.size();
+    }
+};
+
+// Read-only view of a whole file. Memory-mapped on POSIX systems; elsewhere
+// the file is read into a buffer once.
+class MappedFile {
+private:
+    const char* data;
+    size_t length;
+#ifdef _WIN32
+    string buffer;
+#else
+    void* mapping;
+#endif
+
+public:
+#ifdef _WIN32
+    MappedFile() : data(nullptr), length(0) {}
+#else
+    MappedFile() : data(nullptr), length(0), mapping(nullptr) {}
+#endif
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& filePath) {
+        close();
+#ifdef _WIN32
+        ifstream file(filePath, ios::binary);
+        if (!file.is_open()) return false;
+        buffer.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        data = buffer.data();
+        length = buffer.size();
+        return true;
+#else
+        int fd = ::open(filePath.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        length = size_t(info.st_size);
+        if (length > 0) {
+            mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                mapping = nullptr;
+                length = 0;
+                ::close(fd);
+                return false;
+            }
+            madvise(mapping, length, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(mapping);
+        }
+        ::close(fd);
+        return true;
+#endif
+    }
+
+    void close() {
+#ifdef _WIN32
+        buffer.clear();
+#else
+        if (mapping) munmap(mapping, length);
+        mapping = nullptr;
+#endif
+        data = nullptr;
+        length = 0;
+    }
+
+    const char* begin() const {
+        return data;
+    }
+
+    const char* end() const {
+        return data + length;
+    }
+
+    size_t size() const {
+        return length;
+    }
+};
+
+// Function to find the next ',' or '\n' in [p, end), 16 bytes at a time where SSE2 is available
+inline const char* findDelimiter(const char* p, const char* end) {
+#ifdef __SSE2__
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, comma),
+                                                  _mm_cmpeq_epi8(chunk, newline)));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != ',' && *p != '\n') ++p;
+    return p;
+}
+
+// One CSV row. The fields are views into the mapped file and stay valid
+// while the reader is open.
+struct CsvRow {
+    vector<string_view> fields;
+    size_t lineNumber;
+};
+
+// Streams rows out of a range of a mapped CSV file without copying or
+// allocating per row. Line numbers count from the start of the range.
+class CsvReader {
+private:
+    const char* cursor;
+    const char* end;
+    size_t lineNumber;
+
+public:
+    CsvReader(const char* begin, const char* end) : cursor(begin), end(end), lineNumber(0) {}
+
+    explicit CsvReader(const MappedFile& file) : CsvReader(file.begin(), file.end()) {}
+
+    size_t linesRead() const {
+        return lineNumber;
+    }
+
+    // Splits the next line into at most maxFields fields; the rest of the line
+    // is skipped. A trailing '\r' is dropped. Returns false at the end of the range.
+    bool next(CsvRow& row, size_t maxFields = SIZE_MAX) {
+        if (!cursor || cursor >= end) return false;
+
+        row.fields.clear();
+        row.lineNumber = ++lineNumber;
+
+        const char* p = cursor;
+        while (true) {
+            const char* delimiter = findDelimiter(p, end);
+            const char* fieldEnd = delimiter;
+            bool lineEnd = delimiter == end || *delimiter == '\n';
+            if (lineEnd && fieldEnd > p && fieldEnd[-1] == '\r') --fieldEnd;
+            row.fields.emplace_back(p, size_t(fieldEnd - p));
+
+            if (lineEnd) {
+                cursor = delimiter == end ? end : delimiter + 1;
+                return true;
+            }
+            p = delimiter + 1;
+
+            if (row.fields.size() == maxFields) {
+                const char* newline = static_cast<const char*>(memchr(p, '\n', size_t(end - p)));
+                cursor = newline ? newline + 1 : end;
+                return true;
+            }
+        }
+    }
+};
+
+// Function to parse a whole field as a number; surrounding spaces are allowed
+template <typename Number>
+bool parseNumber(string_view text, Number& value) {
+    while (!text.empty() && text.front() == ' ') text.remove_prefix(1);
+    while (!text.empty() && text.back() == ' ') text.remove_suffix(1);
+    if (!text.empty() && text.front() == '+') text.remove_prefix(1);
+    if (text.empty()) return false;
+
+    from_chars_result result = from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == errc() && result.ptr == text.data() + text.size();
+}
+
+// Function to parse a price; like parseNumber, but nan and inf are rejected
+bool parsePrice(string_view text, float& price) {
+    return parseNumber(text, price) && isfinite(price);
+}
+
+// Counts rejected rows while parsing and reports them once at the end
+class ParseReport {
+private:
+    static const size_t MAX_SAMPLES = 10;
+
+    size_t rejected;
+    vector<size_t> sampleLines;
+
+public:
+    ParseReport() : rejected(0) {}
+
+    void reject(size_t lineNumber) {
+        if (sampleLines.size() < MAX_SAMPLES) sampleLines.push_back(lineNumber);
+        ++rejected;
+    }
+
+    // Folds in the report of a later chunk whose first line is lineOffset + 1
+    void merge(const ParseReport& other, size_t lineOffset) {
+        for (size_t line : other.sampleLines) {
+            if (sampleLines.size() == MAX_SAMPLES) break;
+            sampleLines.push_back(line + lineOffset);
+        }
+        rejected += other.rejected;
+    }
+
+    size_t count() const {
+        return rejected;
+    }
+
+    void print(const string& filePath) const {
+        if (!rejected) return;
+        cerr << "Warning: Skipped " << rejected << " malformed row" << (rejected == 1 ? "" : "s")
+             << " in " << filePath << " (line";
+        cerr << (sampleLines.size() == 1 ? " " : "s ");
+        for (size_t i = 0; i < sampleLines.size(); ++i) {
+            cerr << (i ? ", " : "") << sampleLines[i];
+        }
+        cerr << (rejected > sampleLines.size() ? ", ...)" : ")") << endl;
+    }
+};
+
+// Function to convert one livestock row into a StockData; false if the row is malformed
+bool parseStockRow(const CsvRow& row, StockData& stock) {
+    // Columns: 1 ticker, 3-6 open/high/low/last, 20 365-day, 23 30-day and 24 today's chart
+    bool valid = row.fields.size() > 6 && !row.fields[1].empty()
+                 && parsePrice(row.fields[3], stock.open)
+                 && parsePrice(row.fields[4], stock.dayHigh)
+                 && parsePrice(row.fields[5], stock.dayLow)
+                 && parsePrice(row.fields[6], stock.lastPrice);
+    if (!valid) return false;
+
+    stock.ticker = string(row.fields[1]);
+    stock.chart365DaysPath = row.fields.size() > 20 ? string(row.fields[20]) : string();
+    stock.chart30DaysPath = row.fields.size() > 23 ? string(row.fields[23]) : string();
+    stock.chartTodayPath = row.fields.size() > 24 ? string(row.fields[24]) : string();
+    return true;
+}
+
+// Rows parsed from one chunk of the livestock file
+struct StockChunk {
+    const char* begin;
+    const char* end;
+    vector<StockData> stocks;
+    ParseReport report;
+    size_t lines;
+};
+
+// Function to parse the rows of one chunk
+void parseStockChunk(StockChunk& chunk) {
+    const size_t columnsUsed = 25;
+    CsvReader reader(chunk.begin, chunk.end);
+    CsvRow row;
+    StockData stock;
+
+    while (reader.next(row, columnsUsed)) {
+        if (row.fields.size() == 1 && row.fields[0].empty()) continue;  // blank line
+        if (parseStockRow(row, stock))
+            chunk.stocks.push_back(std::move(stock));
+        else
+            chunk.report.reject(row.lineNumber);
+    }
+    chunk.lines = reader.linesRead();
+}
+
+// Function to load stock data and chart links from a CSV file. The file is
+// split at line boundaries into one chunk per thread (0 = all cores); rows are
+// appended to stockList in file order, so the first row of a ticker still wins.
+void loadStockData(const string& filePath, vector<StockData>& stockList, int threads = 0) {
+    MappedFile file;
+    if (!file.open(filePath)) {
+        cerr << "Error: Could not open the file " << filePath << endl;
+        return;
+    }
+    STOCK_STATS_ONLY(ScopedLatency parseTimer(stockStats.csvParse);)
+
+    // Skip the header
+    const char* body = static_cast<const char*>(memchr(file.begin(), '\n', file.size()));
+    body = body ? body + 1 : file.end();
+    size_t bodySize = size_t(file.end() - body);
+
+    // Chunks smaller than this are not worth a thread
+    const size_t minChunkBytes = 1 << 20;
+    if (threads <= 0) threads = max(1, int(thread::hardware_concurrency()));
+    threads = int(min(size_t(threads), bodySize / minChunkBytes + 1));
+
+    vector<StockChunk> chunks(threads);
+    const char* chunkBegin = body;
+    for (int i = 0; i < threads; ++i) {
+        const char* chunkEnd = file.end();
+        if (i + 1 < threads) {
+            chunkEnd = body + bodySize / threads * (i + 1);
+            chunkEnd = max(chunkEnd, chunkBegin);
+            const char* newline = static_cast<const char*>(memchr(chunkEnd, '\n', size_t(file.end() - chunkEnd)));
+            chunkEnd = newline ? newline + 1 : file.end();
+        }
+        chunks[i].begin = chunkBegin;
+        chunks[i].end = chunkEnd;
+        chunkBegin = chunkEnd;
+    }
+
+    vector<thread> workers;
+    for (int i = 1; i < threads; ++i) {
+        workers.emplace_back(parseStockChunk, ref(chunks[i]));
+    }
+    parseStockChunk(chunks[0]);
+    for (auto& worker : workers) worker.join();
+
+    size_t total = stockList.size();
+    for (const auto& chunk : chunks) total += chunk.stocks.size();
+    stockList.reserve(total);
+
+    ParseReport report;
+    size_t lineOffset = 1;  // header
+    for (auto& chunk : chunks) {
+        move(chunk.stocks.begin(), chunk.stocks.end(), back_inserter(stockList));
+        report.merge(chunk.report, lineOffset);
+        lineOffset += chunk.lines;
+    }
+    report.print(filePath);
+    STOCK_STATS_ONLY(stockStats.csvRows.add(lineOffset - 1); stockStats.csvBytes.add(file.size());
+                     stockStats.csvRejected.add(report.count());)
+}
+
+// Function to open URL in default browser
+void openURL(const string& url) {
+  system(("start " + url).c_str());
+}
+
+// Chart links of one stock
+struct ChartLinks {
+    string today;
+    string days30;
+    string days365;
+};
+
+// Binary image of a loaded stock file for fast restarts, all fields
+// little-endian and every section 8-byte aligned:
+//   SnapshotHeader
+//   SnapshotRecord[count]          stocks in ticker order, first row of a ticker wins
+//   uint32_t[PRICE_FIELD_COUNT][count]  record positions in (price, ticker) order per field
+//   char[poolBytes]                ticker and chart link text referenced by the records
+// The checksum covers everything after the header. The source file's size and
+// modification time are stored so that a snapshot of an older file is not used.
+struct SnapshotString {
+    uint32_t offset;  // into the string pool
+    uint32_t length;
+};
+
+struct SnapshotRecord {
+    float open;
+    float dayHigh;
+    float dayLow;
+    float lastPrice;
+    SnapshotString ticker;
+    SnapshotString chartToday;
+    SnapshotString chart30Days;
+    SnapshotString chart365Days;
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;  // SNAPSHOT_BYTE_ORDER as written by the producing machine
+    uint64_t count;
+    uint64_t poolBytes;
+    uint64_t sourceSize;
+    int64_t sourceModified;
+    uint64_t checksum;
+};
+
+static_assert(sizeof(SnapshotRecord) == 48 && sizeof(SnapshotHeader) == 56, "snapshot layout must not depend on padding");
+
+const char SNAPSHOT_MAGIC[8] = {'S', 'T', 'K', 'S', 'N', 'A', 'P', '\0'};
+const uint32_t SNAPSHOT_VERSION = 1;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+// Function to checksum a byte range 8 bytes at a time. A multiply-xorshift
+// hash: it catches truncated or corrupted files, not deliberate tampering.
+uint64_t snapshotChecksum(const char* data, size_t length) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, length - i);
+    hash = (hash ^ tail) * 0xFF51AFD7ED558CCDull;
+    return hash ^ (hash >> 29);
+}
+
+// Function to read the size and modification time that identify a source file
+bool sourceIdentity(const string& path, uint64_t& size, int64_t& modified) {
+    error_code ec;
+    size = filesystem::file_size(path, ec);
+    if (ec) return false;
+    modified = int64_t(filesystem::last_write_time(path, ec).time_since_epoch().count());
+    return !ec;
+}
+
+// Memory-mapped snapshot of the stock file. Opening checks the header, the
+// checksum and every offset; after that the records are read in place.
+class StockSnapshot {
+private:
+    MappedFile file;
+    const SnapshotHeader* header;
+    const SnapshotRecord* records;
+    const uint32_t* priceOrders[PRICE_FIELD_COUNT];
+    const char* pool;
+
+    static size_t aligned(size_t bytes) {
+        return (bytes + 7) / 8 * 8;
+    }
+
+    string_view text(const SnapshotString& ref) const {
+        return string_view(pool + ref.offset, ref.length);
+    }
+
+    bool damaged(const string& path) {
+        cerr << "Error: Snapshot " << path << " is damaged; reloading the stock file." << endl;
+        close();
+        return false;
+    }
+
+public:
+    StockSnapshot() : header(nullptr), records(nullptr), priceOrders(), pool(nullptr) {}
+
+    // Maps the snapshot at path; false if it is missing, damaged, from another
+    // format version, or older than sourcePath
+    bool open(const string& path, const string& sourcePath) {
+        close();
+        uint64_t sourceSize;
+        int64_t sourceModified;
+        if (!sourceIdentity(sourcePath, sourceSize, sourceModified) || !file.open(path)) return false;
+
+        if (file.size() < sizeof(SnapshotHeader)) return damaged(path);
+        const SnapshotHeader* candidate = reinterpret_cast<const SnapshotHeader*>(file.begin());
+        if (memcmp(candidate->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) return damaged(path);
+        if (candidate->version != SNAPSHOT_VERSION || candidate->byteOrder != SNAPSHOT_BYTE_ORDER) {
+            close();
+            return false;
+        }
+        if (candidate->sourceSize != sourceSize || candidate->sourceModified != sourceModified) {
+            close();
+            return false;
+        }
+
+        uint64_t count = candidate->count;
+        if (count > UINT32_MAX || candidate->poolBytes > UINT32_MAX) return damaged(path);
+        size_t recordBytes = size_t(count) * sizeof(SnapshotRecord);
+        size_t orderBytes = aligned(size_t(count) * sizeof(uint32_t) * PRICE_FIELD_COUNT);
+        if (file.size() != sizeof(SnapshotHeader) + recordBytes + orderBytes + candidate->poolBytes) return damaged(path);
+
+        const char* body = file.begin() + sizeof(SnapshotHeader);
+        if (snapshotChecksum(body, file.size() - sizeof(SnapshotHeader)) != candidate->checksum) return damaged(path);
+
+        header = candidate;
+        records = reinterpret_cast<const SnapshotRecord*>(body);
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            priceOrders[f] = reinterpret_cast<const uint32_t*>(body + recordBytes) + f * count;
+        }
+        pool = body + recordBytes + orderBytes;
+
+        // Offsets are checked once here so that reads never need to
+        auto inPool = [this](const SnapshotString& ref) {
+            return uint64_t(ref.offset) + ref.length <= header->poolBytes;
+        };
+        for (size_t i = 0; i < count; ++i) {
+            const SnapshotRecord& record = records[i];
+            if (!inPool(record.ticker) || !inPool(record.chartToday) || !inPool(record.chart30Days)
+                || !inPool(record.chart365Days))
+                return damaged(path);
+            for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+                if (priceOrders[f][i] >= count) return damaged(path);
+            }
+        }
+        return true;
+    }
+
+    void close() {
+        file.close();
+        header = nullptr;
+        records = nullptr;
+        pool = nullptr;
+    }
+
+    bool isOpen() const {
+        return header != nullptr;
+    }
+
+    size_t size() const {
+        return header ? size_t(header->count) : 0;
+    }
+
+    // Appends every stock, in ticker order
+    void readStocks(vector<StockData>& stockList) const {
+        stockList.reserve(stockList.size() + size());
+        for (size_t i = 0; i < size(); ++i) {
+            const SnapshotRecord& record = records[i];
+            StockData stock;
+            stock.ticker = text(record.ticker);
+            stock.open = record.open;
+            stock.dayHigh = record.dayHigh;
+            stock.dayLow = record.dayLow;
+            stock.lastPrice = record.lastPrice;
+            stock.chartTodayPath = text(record.chartToday);
+            stock.chart30DaysPath = text(record.chart30Days);
+            stock.chart365DaysPath = text(record.chart365Days);
+            stockList.push_back(move(stock));
+        }
+    }
+
+    // Replaces the tree's contents with the snapshot, reusing the stored
+    // price orders instead of sorting
+    bool loadInto(StockTree& tree) const {
+        vector<StockData> stocks;
+        readStocks(stocks);
+        return tree.bulkLoadSorted(stocks, priceOrders);
+    }
+
+    // Chart links of ticker, found by binary search over the mapped records
+    bool findLinks(const string& ticker, ChartLinks& links) const {
+        const SnapshotRecord* found = lower_bound(records, records + size(), ticker,
+                                                  [this](const SnapshotRecord& record, const string& key) {
+                                                      return text(record.ticker) < key;
+                                                  });
+        if (found == records + size() || text(found->ticker) != ticker) return false;
+        links.today = text(found->chartToday);
+        links.days30 = text(found->chart30Days);
+        links.days365 = text(found->chart365Days);
+        return true;
+    }
+
+    // Writes a snapshot of stockList, which was loaded from sourcePath. The
+    // file is written beside path and renamed over it, so readers never see
+    // a partial snapshot.
+    static bool write(const string& path, const string& sourcePath, const vector<StockData>& stockList) {
+        SnapshotHeader snapshotHeader;
+        memcpy(snapshotHeader.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        snapshotHeader.version = SNAPSHOT_VERSION;
+        snapshotHeader.byteOrder = SNAPSHOT_BYTE_ORDER;
+        if (!sourceIdentity(sourcePath, snapshotHeader.sourceSize, snapshotHeader.sourceModified)) return false;
+
+        // Same order and duplicate rule as bulkLoad
+        vector<const StockData*> sorted;
+        sorted.reserve(stockList.size());
+        for (const auto& stock : stockList) sorted.push_back(&stock);
+        stable_sort(sorted.begin(), sorted.end(), [](const StockData* a, const StockData* b) {
+            return a->ticker < b->ticker;
+        });
+        sorted.erase(unique(sorted.begin(), sorted.end(), [](const StockData* a, const StockData* b) {
+            return a->ticker == b->ticker;
+        }), sorted.end());
+        size_t count = sorted.size();
+
+        string strings;
+        auto addString = [&strings](const string& value) {
+            SnapshotString ref{uint32_t(strings.size()), uint32_t(value.size())};
+            strings += value;
+            return ref;
+        };
+        vector<SnapshotRecord> recordList;
+        recordList.reserve(count);
+        for (const StockData* stock : sorted) {
+            recordList.push_back(SnapshotRecord{stock->open, stock->dayHigh, stock->dayLow, stock->lastPrice,
+                                                addString(stock->ticker), addString(stock->chartTodayPath),
+                                                addString(stock->chart30DaysPath), addString(stock->chart365DaysPath)});
+        }
+        if (strings.size() > UINT32_MAX) return false;
+
+        vector<uint32_t> orders;
+        orders.reserve(count * PRICE_FIELD_COUNT);
+        for (int f = 0; f < PRICE_FIELD_COUNT; ++f) {
+            vector<pair<float, uint32_t>> entries;
+            entries.reserve(count);
+            for (uint32_t i = 0; i < count; ++i) entries.emplace_back(priceOf(*sorted[i], PriceField(f)), i);
+            sort(entries.begin(), entries.end(), [](const pair<float, uint32_t>& a, const pair<float, uint32_t>& b) {
+                return !samePrice(a.first, b.first) ? priceBefore(a.first, b.first) : a.second < b.second;
+            });
+            for (const auto& entry : entries) orders.push_back(entry.second);
+        }
+
+        string body;
+        body.reserve(count * sizeof(SnapshotRecord) + aligned(orders.size() * sizeof(uint32_t)) + strings.size());
+        body.append(reinterpret_cast<const char*>(recordList.data()), recordList.size() * sizeof(SnapshotRecord));
+        body.append(reinterpret_cast<const char*>(orders.data()), orders.size() * sizeof(uint32_t));
+        body.resize(aligned(body.size()), '\0');
+        body += strings;
+
+        snapshotHeader.count = count;
+        snapshotHeader.poolBytes = strings.size();
+        snapshotHeader.checksum = snapshotChecksum(body.data(), body.size());
+
+        string temporary = path + ".tmp";
+        {
+            ofstream out(temporary, ios::binary | ios::trunc);
+            if (!out.is_open()) {
+                cerr << "Error: Could not write snapshot " << temporary << endl;
+                return false;
+            }
+            out.write(reinterpret_cast<const char*>(&snapshotHeader), sizeof(snapshotHeader));
+            out.write(body.data(), body.size());
+            if (!out) {
+                cerr << "Error: Could not write snapshot " << temporary << endl;
+                return false;
+            }
+        }
+        error_code ec;
+        filesystem::rename(temporary, path, ec);
+        if (ec) {
+            cerr << "Error: Could not replace snapshot " << path << endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Hashed ticker -> chart links, built once from the loaded rows. The source
+// file's size and modification time are remembered and the table is only
+// rebuilt when they change.
+class ChartTable {
+private:
+    string filePath;
+    unordered_map<string, ChartLinks> links;
+    const StockSnapshot* snapshot;  // serves lookups instead of links when set
+    ChartLinks snapshotLinks;       // last lookup answered from the snapshot
+    filesystem::file_time_type modified;
+    uintmax_t fileSize;
+
+    void remember() {
+        error_code ec;
+        modified = filesystem::last_write_time(filePath, ec);
+        fileSize = filesystem::file_size(filePath, ec);
+    }
+
+    bool sourceChanged() {
+        error_code ec;
+        filesystem::file_time_type nowModified = filesystem::last_write_time(filePath, ec);
+        if (ec) return false;  // keep serving the old links if the file is briefly missing
+        uintmax_t nowSize = filesystem::file_size(filePath, ec);
+        return nowModified != modified || nowSize != fileSize;
+    }
+
+public:
+    ChartTable() : snapshot(nullptr), fileSize(0) {}
+
+    // Indexes the chart links of stockList, which was loaded from path
+    void build(const string& path, const vector<StockData>& stockList) {
+        filePath = path;
+        remember();
+        snapshot = nullptr;
+        links.clear();
+        links.reserve(stockList.size());
+        for (const auto& stock : stockList) {
+            // emplace keeps the first row of a ticker, like the tree does
+            links.emplace(stock.ticker, ChartLinks{stock.chartTodayPath, stock.chart30DaysPath, stock.chart365DaysPath});
+        }
+    }
+
+    // Serves links straight from a snapshot of path, which must stay open
+    void attach(const string& path, const StockSnapshot& source) {
+        filePath = path;
+        remember();
+        links.clear();
+        snapshot = &source;
+    }
+
+    // Chart links for ticker, or nullptr. Re-reads the source first if it changed.
+    const ChartLinks* find(const string& ticker) {
+        if (!filePath.empty() && sourceChanged()) {
+            vector<StockData> stockList;
+            loadStockData(filePath, stockList);
+            build(filePath, stockList);
+        }
+        if (snapshot) return snapshot->findLinks(ticker, snapshotLinks) ? &snapshotLinks : nullptr;
+        auto it = links.find(ticker);
+        return it == links.end() ? nullptr : &it->second;
+    }
+};
+
+// Function to visualize stock chart by ticker
+void visualize(ChartTable& charts, const string& ticker) {
+    const ChartLinks* links = charts.find(ticker);
+    if (!links) {
+        cerr << "Error: Stock ticker " << ticker << " not found.\n";
+        return;
+    }
+
+    int chartChoice;
+    cout << "\nWhich chart do you want to visualize?\n";
+    cout << "1. Today's Chart\n";
+    cout << "2. 30-Day Chart\n";
+    cout << "3. 365-Day Chart\n";
+    cout << "Enter your choice: ";
+    cin >> chartChoice;
+
+    string chartLink;
+    switch (chartChoice) {
+        case 1:
+            chartLink = links->today;
+            break;
+        case 2:
+            chartLink = links->days30;
+            break;
+        case 3:
+            chartLink = links->days365;
+            break;
+        default:
+            cout << "Invalid choice. No chart displayed.\n";
+            return;
+    }
+
+    if (!chartLink.empty()) {
+        cout << "Opening chart for " << ticker << " at " << chartLink << endl;
+        openURL(chartLink);
+    } else {
+        cout << "No chart available for the selected period.\n";
+    }
+}
+// Function to print the k biggest gainers (or losers) by change from the open;
+// writer should have been made withChange
+void fetchTopMovers(StockTree& tree, int k, bool gainers, StockWriter& writer) {
+    tree.forEachTop(PriceField::ChangePercent, k, gainers, [&writer](const StockData& stock) {
+        writer.write(stock);
+    });
+}
+
+// Function to print every stock whose chosen price field lies in [minPrice, maxPrice]
+void fetchByRange(StockTree& tree, PriceField field, float minPrice, float maxPrice, StockWriter& writer) {
+    tree.forEachInRange(field, minPrice, maxPrice, [&writer](const StockData& stock) { writer.write(stock); });
+}
+
+// Function to print one stock, or a note if the ticker is missing
+void fetchByName(StockTree& tree, const string& ticker, StockWriter& writer) {
+    const StockData* stock = tree.find(ticker);
+    if (stock)
+        writer.write(*stock);
+    else
+        writer.writeNote("Stock with ticker " + ticker + " not found.");
+}
+
+// Function to print several stocks in the order asked, with a note for each missing ticker
+void fetchMany(StockTree& tree, const vector<string>& tickers, StockWriter& writer) {
+    vector<const StockData*> found;
+    tree.getMany(tickers, found);
+    for (size_t i = 0; i < tickers.size(); ++i) {
+        if (found[i])
+            writer.write(*found[i]);
+        else
+            writer.writeNote("Stock with ticker " + tickers[i] + " not found.");
+    }
+}
+
+// Function to print the first k stocks, in ticker order, whose ticker starts with prefix
+void fetchByPrefix(StockTree& tree, const string& prefix, int k, StockWriter& writer) {
+    bool any = false;
+    tree.forEachWithPrefix(prefix, k, [&writer, &any](const StockData& stock) {
+        writer.write(stock);
+        any = true;
+    });
+    if (!any) writer.writeNote("No stocks found with prefix " + prefix + ".");
+}
+
+// Analytics kernels over contiguous price columns. Every kernel has a scalar
+// version and, on x86 builds, an AVX2 version chosen at runtime when the CPU
+// supports it. Both versions use the same update formulas.
+//
+// The rolling kernels (moving average, rolling standard deviation, EMA) are
+// sequential recurrences. The AVX2 versions split the output into four
+// contiguous segments and advance one segment per vector lane, moving data
+// in and out of the lanes with 4x4 transposes. Sliding-window state is
+// recomputed exactly every reanchorInterval() outputs so that rounding
+// cannot build up over long series.
+
+// Function to check once whether the AVX2 kernels may be used
+bool useAvx2Kernels() {
+#ifdef STOCK_AVX2_KERNELS
+    static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// Sums of centered products, the building block of regression and correlation
+struct CenteredSums {
+    double xx;
+    double yy;
+    double xy;
+};
+
+double sumSeriesScalar(const double* x, size_t n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) sum += x[i];
+    return sum;
+}
+
+CenteredSums centeredSumsScalar(const double* x, const double* y, size_t n, double meanX, double meanY) {
+    CenteredSums sums = {0.0, 0.0, 0.0};
+    for (size_t i = 0; i < n; ++i) {
+        double dx = x[i] - meanX;
+        double dy = y[i] - meanY;
+        sums.xx += dx * dx;
+        sums.yy += dy * dy;
+        sums.xy += dx * dy;
+    }
+    return sums;
+}
+
+// Returns (sum of price * volume, sum of volume)
+pair<double, double> volumeSumsScalar(const double* price, const double* volume, size_t n) {
+    double weighted = 0.0, total = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        weighted += price[i] * volume[i];
+        total += volume[i];
+    }
+    return make_pair(weighted, total);
+}
+
+// out[i] = p[i + 1] / p[i] - 1 for i < n - 1
+void simpleReturnsScalar(const double* p, size_t n, double* out) {
+    for (size_t i = 0; i + 1 < n; ++i) out[i] = p[i + 1] / p[i] - 1.0;
+}
+
+// Outputs between exact recomputations of a sliding window; a multiple of 4
+// that keeps the recomputation cost at or below a quarter of the sliding work
+size_t reanchorInterval(size_t w) {
+    return (max(size_t(256), 4 * w) + 3) / 4 * 4;
+}
+
+// out[i] = mean of p[i .. i + w - 1] for i <= n - w
+void movingAverageScalar(const double* p, size_t n, size_t w, double* out) {
+    size_t interval = reanchorInterval(w);
+    double invW = 1.0 / w;
+    double sum = 0.0;
+    for (size_t i = 0, sinceAnchor = 0; i + w <= n; ++i, ++sinceAnchor) {
+        if (i == 0 || sinceAnchor == interval) {
+            sum = sumSeriesScalar(p + i, w);
+            sinceAnchor = 0;
+        }
+        out[i] = sum * invW;
+        if (i + w < n) sum += p[i + w] - p[i];
+    }
+}
+
+// Mean and sum of squared deviations of p[0 .. w - 1], computed in two passes
+void windowMoments(const double* p, size_t w, double& mean, double& m2) {
+    mean = 0.0;
+    for (size_t i = 0; i < w; ++i) mean += p[i];
+    mean /= w;
+    m2 = 0.0;
+    for (size_t i = 0; i < w; ++i) m2 += (p[i] - mean) * (p[i] - mean);
+}
+
+// out[i] = sample standard deviation of p[i .. i + w - 1] for i <= n - w (w >= 2).
+// The window slides with Welford's replace-one update, which avoids the
+// cancellation of a running sum of squares.
+void rollingStdDevScalar(const double* p, size_t n, size_t w, double* out) {
+    size_t interval = reanchorInterval(w);
+    double invW = 1.0 / w;
+    double invDof = 1.0 / (w - 1);
+    double mean = 0.0, m2 = 0.0;
+    for (size_t i = 0, sinceAnchor = 0; i + w <= n; ++i, ++sinceAnchor) {
+        if (i == 0 || sinceAnchor == interval) {
+            windowMoments(p + i, w, mean, m2);
+            sinceAnchor = 0;
+        }
+        out[i] = sqrt(max(m2, 0.0) * invDof);
+        if (i + w < n) {
+            double incoming = p[i + w], outgoing = p[i];
+            double delta = incoming - outgoing;
+            double newMean = mean + delta * invW;
+            m2 += delta * (incoming - newMean + outgoing - mean);
+            mean = newMean;
+        }
+    }
+}
+
+// out[0] = p[0], out[i] = out[i - 1] + alpha * (p[i] - out[i - 1])
+void exponentialMovingAverageScalar(const double* p, size_t n, double alpha, double* out, double previous) {
+    for (size_t i = 0; i < n; ++i) {
+        previous += alpha * (p[i] - previous);
+        out[i] = previous;
+    }
+}
+
+#ifdef STOCK_AVX2_KERNELS
+// Turns four rows of four doubles into four columns
+STOCK_AVX2 inline void transpose4(__m256d& r0, __m256d& r1, __m256d& r2, __m256d& r3) {
+    __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+    __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+    __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+    __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+    r0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+    r1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+    r2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+    r3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+}
+
+// Loads elements offset .. offset + 3 of each of the four lane segments, transposed
+// so that v<j> holds element offset + j of every segment
+STOCK_AVX2 inline void loadLanes(const double* p, size_t laneLength, size_t offset,
+                                 __m256d& v0, __m256d& v1, __m256d& v2, __m256d& v3) {
+    v0 = _mm256_loadu_pd(p + offset);
+    v1 = _mm256_loadu_pd(p + laneLength + offset);
+    v2 = _mm256_loadu_pd(p + 2 * laneLength + offset);
+    v3 = _mm256_loadu_pd(p + 3 * laneLength + offset);
+    transpose4(v0, v1, v2, v3);
+}
+
+STOCK_AVX2 inline void storeLanes(double* out, size_t laneLength, size_t offset,
+                                  __m256d v0, __m256d v1, __m256d v2, __m256d v3) {
+    transpose4(v0, v1, v2, v3);
+    _mm256_storeu_pd(out + offset, v0);
+    _mm256_storeu_pd(out + laneLength + offset, v1);
+    _mm256_storeu_pd(out + 2 * laneLength + offset, v2);
+    _mm256_storeu_pd(out + 3 * laneLength + offset, v3);
+}
+
+STOCK_AVX2 inline double horizontalSum(__m256d v) {
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+STOCK_AVX2 double sumSeriesAvx2(const double* x, size_t n) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(x + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(x + i + 4));
+        acc2 = _mm256_add_pd(acc2, _mm256_loadu_pd(x + i + 8));
+        acc3 = _mm256_add_pd(acc3, _mm256_loadu_pd(x + i + 12));
+    }
+    double sum = horizontalSum(_mm256_add_pd(_mm256_add_pd(acc0, acc1), _mm256_add_pd(acc2, acc3)));
+    return sum + sumSeriesScalar(x + i, n - i);
+}
+
+STOCK_AVX2 CenteredSums centeredSumsAvx2(const double* x, const double* y, size_t n, double meanX, double meanY) {
+    __m256d mx = _mm256_set1_pd(meanX), my = _mm256_set1_pd(meanY);
+    __m256d xx0 = _mm256_setzero_pd(), yy0 = xx0, xy0 = xx0, xx1 = xx0, yy1 = xx0, xy1 = xx0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256d dx0 = _mm256_sub_pd(_mm256_loadu_pd(x + i), mx);
+        __m256d dy0 = _mm256_sub_pd(_mm256_loadu_pd(y + i), my);
+        __m256d dx1 = _mm256_sub_pd(_mm256_loadu_pd(x + i + 4), mx);
+        __m256d dy1 = _mm256_sub_pd(_mm256_loadu_pd(y + i + 4), my);
+        xx0 = _mm256_fmadd_pd(dx0, dx0, xx0);
+        yy0 = _mm256_fmadd_pd(dy0, dy0, yy0);
+        xy0 = _mm256_fmadd_pd(dx0, dy0, xy0);
+        xx1 = _mm256_fmadd_pd(dx1, dx1, xx1);
+        yy1 = _mm256_fmadd_pd(dy1, dy1, yy1);
+        xy1 = _mm256_fmadd_pd(dx1, dy1, xy1);
+    }
+    CenteredSums tail = centeredSumsScalar(x + i, y + i, n - i, meanX, meanY);
+    return CenteredSums{horizontalSum(_mm256_add_pd(xx0, xx1)) + tail.xx,
+                        horizontalSum(_mm256_add_pd(yy0, yy1)) + tail.yy,
+                        horizontalSum(_mm256_add_pd(xy0, xy1)) + tail.xy};
+}
+
+STOCK_AVX2 pair<double, double> volumeSumsAvx2(const double* price, const double* volume, size_t n) {
+    __m256d weighted0 = _mm256_setzero_pd(), weighted1 = weighted0, total0 = weighted0, total1 = weighted0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256d v0 = _mm256_loadu_pd(volume + i);
+        __m256d v1 = _mm256_loadu_pd(volume + i + 4);
+        weighted0 = _mm256_fmadd_pd(_mm256_loadu_pd(price + i), v0, weighted0);
+        weighted1 = _mm256_fmadd_pd(_mm256_loadu_pd(price + i + 4), v1, weighted1);
+        total0 = _mm256_add_pd(total0, v0);
+        total1 = _mm256_add_pd(total1, v1);
+    }
+    pair<double, double> tail = volumeSumsScalar(price + i, volume + i, n - i);
+    return make_pair(horizontalSum(_mm256_add_pd(weighted0, weighted1)) + tail.first,
+                     horizontalSum(_mm256_add_pd(total0, total1)) + tail.second);
+}
+
+STOCK_AVX2 void simpleReturnsAvx2(const double* p, size_t n, double* out) {
+    if (n < 2) return;
+    __m256d one = _mm256_set1_pd(1.0);
+    size_t i = 0;
+    for (; i + 4 < n; i += 4) {
+        __m256d ratio = _mm256_div_pd(_mm256_loadu_pd(p + i + 1), _mm256_loadu_pd(p + i));
+        _mm256_storeu_pd(out + i, _mm256_sub_pd(ratio, one));
+    }
+    simpleReturnsScalar(p + i, n - i, out + i);
+}
+
+STOCK_AVX2 void movingAverageAvx2(const double* p, size_t n, size_t w, double* out) {
+    size_t outputs = n - w + 1;
+    // Outputs per lane, a multiple of 4. Keeping 4 * lane < outputs means the
+    // last update never reads past p[n - 1].
+    size_t lane = (outputs - 1) / 16 * 4;
+    if (lane == 0) {
+        movingAverageScalar(p, n, w, out);
+        return;
+    }
+
+    size_t interval = reanchorInterval(w);
+    __m256d invW = _mm256_set1_pd(1.0 / w);
+    __m256d sum = _mm256_setzero_pd();
+    __m256d out0, out1, out2, out3, in0, in1, in2, in3;
+    for (size_t b = 0; b < lane; b += 4) {
+        if (b % interval == 0) {
+            double exact[4];
+            for (int k = 0; k < 4; ++k) exact[k] = sumSeriesScalar(p + k * lane + b, w);
+            sum = _mm256_loadu_pd(exact);
+        }
+        loadLanes(p, lane, b, out0, out1, out2, out3);
+        loadLanes(p + w, lane, b, in0, in1, in2, in3);
+        __m256d r0 = _mm256_mul_pd(sum, invW);
+        sum = _mm256_add_pd(sum, _mm256_sub_pd(in0, out0));
+        __m256d r1 = _mm256_mul_pd(sum, invW);
+        sum = _mm256_add_pd(sum, _mm256_sub_pd(in1, out1));
+        __m256d r2 = _mm256_mul_pd(sum, invW);
+        sum = _mm256_add_pd(sum, _mm256_sub_pd(in2, out2));
+        __m256d r3 = _mm256_mul_pd(sum, invW);
+        sum = _mm256_add_pd(sum, _mm256_sub_pd(in3, out3));
+        storeLanes(out, lane, b, r0, r1, r2, r3);
+    }
+
+    movingAverageScalar(p + 4 * lane, n - 4 * lane, w, out + 4 * lane);
+}
+
+// One step of the sliding Welford update; returns the standard deviation
+// of the window before the step
+STOCK_AVX2 inline __m256d slideDeviation(__m256d& mean, __m256d& m2, __m256d incoming, __m256d outgoing,
+                                         __m256d invW, __m256d invDof) {
+    __m256d result = _mm256_sqrt_pd(_mm256_mul_pd(_mm256_max_pd(m2, _mm256_setzero_pd()), invDof));
+    __m256d delta = _mm256_sub_pd(incoming, outgoing);
+    __m256d newMean = _mm256_fmadd_pd(delta, invW, mean);
+    __m256d spread = _mm256_add_pd(_mm256_sub_pd(incoming, newMean), _mm256_sub_pd(outgoing, mean));
+    m2 = _mm256_fmadd_pd(delta, spread, m2);
+    mean = newMean;
+    return result;
+}
+
+STOCK_AVX2 void rollingStdDevAvx2(const double* p, size_t n, size_t w, double* out) {
+    size_t outputs = n - w + 1;
+    size_t lane = (outputs - 1) / 16 * 4;
+    if (lane == 0) {
+        rollingStdDevScalar(p, n, w, out);
+        return;
+    }
+
+    size_t interval = reanchorInterval(w);
+    __m256d invW = _mm256_set1_pd(1.0 / w);
+    __m256d invDof = _mm256_set1_pd(1.0 / (w - 1));
+    __m256d mean = _mm256_setzero_pd(), m2 = mean;
+    __m256d out0, out1, out2, out3, in0, in1, in2, in3;
+    for (size_t b = 0; b < lane; b += 4) {
+        if (b % interval == 0) {
+            double exactMean[4], exactM2[4];
+            for (int k = 0; k < 4; ++k) windowMoments(p + k * lane + b, w, exactMean[k], exactM2[k]);
+            mean = _mm256_loadu_pd(exactMean);
+            m2 = _mm256_loadu_pd(exactM2);
+        }
+        loadLanes(p, lane, b, out0, out1, out2, out3);
+        loadLanes(p + w, lane, b, in0, in1, in2, in3);
+        __m256d r0 = slideDeviation(mean, m2, in0, out0, invW, invDof);
+        __m256d r1 = slideDeviation(mean, m2, in1, out1, invW, invDof);
+        __m256d r2 = slideDeviation(mean, m2, in2, out2, invW, invDof);
+        __m256d r3 = slideDeviation(mean, m2, in3, out3, invW, invDof);
+        storeLanes(out, lane, b, r0, r1, r2, r3);
+    }
+
+    rollingStdDevScalar(p + 4 * lane, n - 4 * lane, w, out + 4 * lane);
+}
+
+// Lanes after the first start from a warm-up run long enough that the
+// unknown starting value decays below double precision, (1 - alpha)^warmup < 1e-17
+STOCK_AVX2 void exponentialMovingAverageAvx2(const double* p, size_t n, double alpha, double* out) {
+    size_t lane = n / 16 * 4;
+    double decay = log1p(-alpha);
+    size_t warmup = decay < 0.0 ? size_t(ceil(log(1e-17) / decay)) : n;
+    if (lane == 0 || warmup > lane) {
+        exponentialMovingAverageScalar(p, n, alpha, out, n ? p[0] : 0.0);
+        return;
+    }
+
+    double start[4] = {p[0], 0.0, 0.0, 0.0};
+    for (int k = 1; k < 4; ++k) {
+        const double* warm = p + k * lane - warmup;
+        double value = warm[0];
+        for (size_t i = 1; i < warmup; ++i) value += alpha * (warm[i] - value);
+        start[k] = value;
+    }
+    __m256d previous = _mm256_loadu_pd(start);
+    __m256d a = _mm256_set1_pd(alpha);
+
+    __m256d v0, v1, v2, v3;
+    for (size_t b = 0; b < lane; b += 4) {
+        loadLanes(p, lane, b, v0, v1, v2, v3);
+        v0 = previous = _mm256_fmadd_pd(a, _mm256_sub_pd(v0, previous), previous);
+        v1 = previous = _mm256_fmadd_pd(a, _mm256_sub_pd(v1, previous), previous);
+        v2 = previous = _mm256_fmadd_pd(a, _mm256_sub_pd(v2, previous), previous);
+        v3 = previous = _mm256_fmadd_pd(a, _mm256_sub_pd(v3, previous), previous);
+        storeLanes(out, lane, b, v0, v1, v2, v3);
+    }
+
+    exponentialMovingAverageScalar(p + 4 * lane, n - 4 * lane, alpha, out + 4 * lane, out[4 * lane - 1]);
+}
+#endif
+
+double sumSeries(const double* x, size_t n) {
+#ifdef STOCK_AVX2_KERNELS
+    if (useAvx2Kernels()) return sumSeriesAvx2(x, n);
+#endif
+    return sumSeriesScalar(x, n);
+}
+
+CenteredSums centeredSums(const double* x, const double* y, size_t n, double meanX, double meanY) {
+#ifdef STOCK_AVX2_KERNELS
+    if (useAvx2Kernels()) return centeredSumsAvx2(x, y, n, meanX, meanY);
+#endif
+    return centeredSumsScalar(x, y, n, meanX, meanY);
+}
+
+// Function to compute day-over-day returns; one fewer value than prices
+vector<double> simpleReturns(const vector<double>& prices) {
+    vector<double> returns(prices.size() > 1 ? prices.size() - 1 : 0);
+    if (returns.empty()) return returns;
+#ifdef STOCK_AVX2_KERNELS
+    if (useAvx2Kernels()) {
+        simpleReturnsAvx2(prices.data(), prices.size(), returns.data());
+        return returns;
+    }
+#endif
+    simpleReturnsScalar(prices.data(), prices.size(), returns.data());
+    return returns;
+}
+
+// Function to compute the simple moving average; value i covers prices[i .. i + window - 1]
+vector<double> movingAverage(const vector<double>& prices, size_t window) {
+    if (window == 0 || prices.size() < window) return vector<double>();
+    vector<double> averages(prices.size() - window + 1);
+#ifdef STOCK_AVX2_KERNELS
+    if (useAvx2Kernels()) {
+        movingAverageAvx2(prices.data(), prices.size(), window, averages.data());
+        return averages;
+    }
+#endif
+    movingAverageScalar(prices.data(), prices.size(), window, averages.data());
+    return averages;
+}
+
+// Function to compute the rolling sample standard deviation over window values
+vector<double> rollingStdDev(const vector<double>& values, size_t window) {
+    if (window < 2 || values.size() < window) return vector<double>();
+    vector<double> deviations(values.size() - window + 1);
+#ifdef STOCK_AVX2_KERNELS
+    if (useAvx2Kernels()) {
+        rollingStdDevAvx2(values.data(), values.size(), window, deviations.data());
+        return deviations;
+    }
+#endif
+    rollingStdDevScalar(values.data(), values.size(), window, deviations.data());
+    return deviations;
+}
+
+// Function to compute the exponential moving average with smoothing factor alpha in (0, 1]
+vector<double> exponentialMovingAverage(const vector<double>& prices, double alpha) {
+    vector<double> averages(prices.size());
+    if (prices.empty()) return averages;
+#ifdef STOCK_AVX2_KERNELS
+    if (useAvx2Kernels()) {
+        exponentialMovingAverageAvx2(prices.data(), prices.size(), alpha, averages.data());
+        return averages;
+    }
+#endif
+    exponentialMovingAverageScalar(prices.data(), prices.size(), alpha, averages.data(), prices[0]);
+    return averages;
+}
+
+// Function to compute the Pearson correlation of two equally long series
+double correlation(const vector<double>& x, const vector<double>& y) {
+    size_t n = min(x.size(), y.size());
+    if (n < 2) return 0.0;
+    double meanX = sumSeries(x.data(), n) / n;
+    double meanY = sumSeries(y.data(), n) / n;
+    CenteredSums sums = centeredSums(x.data(), y.data(), n, meanX, meanY);
+    if (sums.xx == 0.0 || sums.yy == 0.0) return 0.0;
+    return sums.xy / sqrt(sums.xx * sums.yy);
+}
+
+// Function to compute the volume-weighted average price
+double vwap(const vector<double>& prices, const vector<double>& volumes) {
+    size_t n = min(prices.size(), volumes.size());
+    pair<double, double> sums;
+#ifdef STOCK_AVX2_KERNELS
+    if (useAvx2Kernels())
+        sums = volumeSumsAvx2(prices.data(), volumes.data(), n);
+    else
+#endif
+        sums = volumeSumsScalar(prices.data(), volumes.data(), n);
+    return sums.second != 0.0 ? sums.first / sums.second : 0.0;
+}
+
+double mean(const vector<double>& data) {
+    double sum = sumSeries(data.data(), data.size());
+    return sum / data.size();
+}
+
+// Function to calculate linear regression coefficients (slope and intercept)
+void linearRegression(const vector<double>& x, const vector<double>& y, double& slope, double& intercept) {
+    STOCK_STATS_ONLY(ScopedLatency timer(stockStats.regression);)
+    double x_mean = mean(x);
+    double y_mean = mean(y);
+
+    CenteredSums sums = centeredSums(x.data(), y.data(), min(x.size(), y.size()), x_mean, y_mean);
+    double numerator = sums.xy;
+    double denominator = sums.xx;
+
+    if (denominator == 0) {
+        cerr << "Error: Denominator for slope calculation is zero." << endl;
+        return;
+    }
+
+    slope = numerator / denominator;
+    intercept = y_mean - slope * x_mean;
+}
+
+// Function to predict a future stock price
+double predictPrice(int dayIndex, double slope, double intercept) {
+    return slope * dayIndex + intercept;
+}
+
+// Least-squares fit of y against x maintained one point at a time. Means and
+// co-moments are updated Welford-style, so there is no second pass and no
+// cancellation from large running sums. remove() exactly undoes an add().
+class RegressionAccumulator {
+private:
+    size_t n;
+    double meanX;
+    double meanY;
+    double sxx;  // sum of (x - meanX)^2
+    double sxy;  // sum of (x - meanX) * (y - meanY)
+
+public:
+    RegressionAccumulator() : n(0), meanX(0.0), meanY(0.0), sxx(0.0), sxy(0.0) {}
+
+    void add(double x, double y) {
+        ++n;
+        double dx = x - meanX;
+        meanX += dx / n;
+        meanY += (y - meanY) / n;
+        sxx += dx * (x - meanX);
+        sxy += dx * (y - meanY);
+    }
+
+    void remove(double x, double y) {
+        if (n <= 1) {
+            *this = RegressionAccumulator();
+            return;
+        }
+        double oldMeanX = (n * meanX - x) / (n - 1);
+        double oldMeanY = (n * meanY - y) / (n - 1);
+        sxx -= (x - oldMeanX) * (x - meanX);
+        sxy -= (x - oldMeanX) * (y - meanY);
+        meanX = oldMeanX;
+        meanY = oldMeanY;
+        --n;
+    }
+
+    size_t count() const {
+        return n;
+    }
+
+    // False while fewer than two distinct x values have been seen
+    bool fit(double& slope, double& intercept) const {
+        if (n < 2 || sxx <= 0.0) return false;
+        slope = sxy / sxx;
+        intercept = meanY - slope * meanX;
+        return true;
+    }
+};
+
+// Regression over only the last `window` points; the oldest point is evicted
+// in O(1). Each time the ring buffer wraps, the fit is rebuilt from the buffer
+// so rounding from repeated removals cannot build up (amortized O(1) per point).
+class SlidingRegression {
+private:
+    RegressionAccumulator fitState;
+    vector<pair<double, double>> points;  // ring buffer
+    size_t window;
+    size_t oldest;
+
+public:
+    explicit SlidingRegression(size_t window) : window(max(window, size_t(1))), oldest(0) {
+        points.reserve(this->window);
+    }
+
+    void add(double x, double y) {
+        if (points.size() < window) {
+            points.emplace_back(x, y);
+        } else {
+            fitState.remove(points[oldest].first, points[oldest].second);
+            points[oldest] = make_pair(x, y);
+            oldest = (oldest + 1) % points.size();
+            if (oldest == 0) {
+                fitState = RegressionAccumulator();
+                for (const auto& point : points) fitState.add(point.first, point.second);
+                return;
+            }
+        }
+        fitState.add(x, y);
+    }
+
+    size_t count() const {
+        return fitState.count();
+    }
+
+    bool fit(double& slope, double& intercept) const {
+        return fitState.fit(slope, intercept);
+    }
+};
+
+// Price series of one stock fitted against the day index as ticks arrive,
+// both over the whole history and over the most recent window
+class PriceModel {
+private:
+    RegressionAccumulator history;
+    SlidingRegression recent;
+    size_t days;
+
+public:
+    explicit PriceModel(size_t windowDays) : recent(windowDays), days(0) {}
+
+    void addPrice(double price) {
+        history.add(double(days), price);
+        recent.add(double(days), price);
+        ++days;
+    }
+
+    size_t dayCount() const {
+        return days;
+    }
+
+    // Predicted price for the day after the last tick, from the whole history
+    // (or the recent window); false if there is not enough data to fit
+    bool predictNext(double& price, bool windowOnly = false) const {
+        STOCK_STATS_ONLY(ScopedLatency timer(stockStats.regression);)
+        double slope, intercept;
+        if (!(windowOnly ? recent.fit(slope, intercept) : history.fit(slope, intercept))) return false;
+        price = predictPrice(int(days), slope, intercept);
+        return true;
+    }
+};
+
+// Function to call visit(price) for each numeric value in one column of a CSV
+// file, in file order; false if the file cannot be opened
+template <typename Visitor>
+bool forEachPriceInCSV(const string& filename, int priceColumnIndex, Visitor visit) {
+    MappedFile file;
+    if (priceColumnIndex < 0 || !file.open(filename)) {
+        cerr << "Error: Could not open file " << filename << endl;
+        return false;
+    }
+
+    STOCK_STATS_ONLY(ScopedLatency parseTimer(stockStats.csvParse);)
+    CsvReader reader(file);
+    CsvRow row;
+    ParseReport report;
+    size_t column = size_t(priceColumnIndex);
+    reader.next(row, 1);  // header
+
+    while (reader.next(row, column + 1)) {
+        if (row.fields.size() <= column) continue;
+
+        double price;
+        if (parseNumber(row.fields[column], price))
+            visit(price);
+        else
+            report.reject(row.lineNumber);  // non-numeric data
+    }
+
+    report.print(filename);
+    STOCK_STATS_ONLY(stockStats.csvRows.add(max<size_t>(reader.linesRead(), 1) - 1);
+                     stockStats.csvBytes.add(file.size()); stockStats.csvRejected.add(report.count());)
+    return true;
+}
+
+// Function to read stock prices from a CSV file
+vector<double> readPricesFromCSV(const string& filename, int priceColumnIndex) {
+    vector<double> prices;
+    forEachPriceInCSV(filename, priceColumnIndex, [&prices](double price) { prices.push_back(price); });
+    return prices;
+}
+
+// Function to convert a Y-M-D date to days since 1970-01-01. Days past the
+// end of the month carry into the following months.
+int32_t daysFromCivil(int year, int month, int day) {
+    year -= month <= 2;
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int yearOfEra = year - era * 400;
+    int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return int32_t(era * 146097 + dayOfEra - 719468 + (day - 1));
+}
+
+// Function to get the number of days in a month of the Gregorian calendar
+int daysInMonth(int year, int month) {
+    static const int lengths[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    return month == 2 && leap ? 29 : lengths[month - 1];
+}
+
+// Function to parse a YYYY-MM-DD date into days since 1970-01-01; false if
+// the day does not exist in that month
+bool parseDate(string_view text, int32_t& days) {
+    size_t first = text.find('-');
+    size_t second = first == string_view::npos ? first : text.find('-', first + 1);
+    if (second == string_view::npos) return false;
+
+    int year, month, day;
+    if (!parseNumber(text.substr(0, first), year) || !parseNumber(text.substr(first + 1, second - first - 1), month)
+        || !parseNumber(text.substr(second + 1), day) || month < 1 || month > 12 || day < 1
+        || day > daysInMonth(year, month))
+        return false;
+    days = daysFromCivil(year, month, day);
+    return true;
+}
+
+// Append-only bit stream, packed from the low bit of each word
+class BitStream {
+private:
+    vector<uint64_t> words;
+    size_t bitCount;
+
+public:
+    BitStream() : bitCount(0) {}
+
+    // Appends the low `bits` bits of value (1 <= bits <= 64)
+    void write(uint64_t value, int bits) {
+        if (bits < 64) value &= (uint64_t(1) << bits) - 1;
+        size_t offset = bitCount & 63;
+        if (offset == 0) {
+            words.push_back(value);
+        } else {
+            words.back() |= value << offset;
+            if (offset + bits > 64) words.push_back(value >> (64 - offset));
+        }
+        bitCount += bits;
+    }
+
+    size_t size() const {
+        return bitCount;
+    }
+
+    const vector<uint64_t>& data() const {
+        return words;
+    }
+
+    // Restores a stream saved from data() and size()
+    void assign(const uint64_t* source, size_t wordCount, size_t bits) {
+        words.assign(source, source + wordCount);
+        bitCount = bits;
+    }
+};
+
+class BitReader {
+private:
+    const uint64_t* words;
+    size_t position;
+
+public:
+    explicit BitReader(const BitStream& stream) : words(stream.data().data()), position(0) {}
+
+    uint64_t read(int bits) {
+        size_t index = position >> 6;
+        unsigned offset = position & 63;
+        uint64_t value = words[index] >> offset;
+        if (offset + bits > 64) value |= words[index + 1] << (64 - offset);
+        position += bits;
+        return bits == 64 ? value : value & ((uint64_t(1) << bits) - 1);
+    }
+
+    bool readBit() {
+        bool bit = (words[position >> 6] >> (position & 63)) & 1;
+        ++position;
+        return bit;
+    }
+};
+
+// XOR compression of a double column: each value is XORed with the previous
+// one and only the bits that differ are stored, reusing the previous
+// leading/trailing zero window when it still fits. Repeated values cost one bit.
+struct XorEncoder {
+    uint64_t previous;
+    uint8_t leading;   // 64 until a window exists
+    uint8_t trailing;
+
+    XorEncoder() : previous(0), leading(64), trailing(0) {}
+
+    void encode(BitStream& out, double value, bool first) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        uint64_t diff = bits ^ previous;
+        previous = bits;
+        if (first) {
+            out.write(bits, 64);
+            return;
+        }
+        if (diff == 0) {
+            out.write(0, 1);
+            return;
+        }
+
+        int lead = min(__builtin_clzll(diff), 31);
+        int trail = __builtin_ctzll(diff);
+        if (leading != 64 && lead >= leading && trail >= trailing) {
+            out.write(0b01, 2);  // '1' then '0': reuse the window
+            out.write(diff >> trailing, 64 - leading - trailing);
+            return;
+        }
+        int length = 64 - lead - trail;
+        out.write(0b11, 2);
+        out.write(uint64_t(lead), 5);
+        out.write(uint64_t(length & 63), 6);  // 64 is stored as 0
+        out.write(diff >> trail, length);
+        leading = uint8_t(lead);
+        trailing = uint8_t(trail);
+    }
+};
+
+struct XorDecoder {
+    uint64_t previous;
+    int leading;
+    int trailing;
+
+    XorDecoder() : previous(0), leading(0), trailing(0) {}
+
+    double decode(BitReader& in, bool first) {
+        if (first) {
+            previous = in.read(64);
+        } else if (in.readBit()) {
+            if (in.readBit()) {
+                leading = int(in.read(5));
+                int length = int(in.read(6));
+                if (length == 0) length = 64;
+                trailing = 64 - leading - length;
+            }
+            previous ^= in.read(64 - leading - trailing) << trailing;
+        }
+        double value;
+        memcpy(&value, &previous, sizeof(value));
+        return value;
+    }
+};
+
+// Delta-of-delta compression of the day numbers: a steady calendar step costs one bit
+struct DateEncoder {
+    int32_t previous;
+    int32_t previousDelta;
+
+    DateEncoder() : previous(0), previousDelta(0) {}
+
+    void encode(BitStream& out, int32_t date, bool first) {
+        if (first) {
+            out.write(uint32_t(date), 32);
+        } else {
+            int32_t delta = date - previous;
+            int64_t change = int64_t(delta) - previousDelta;
+            if (change == 0) {
+                out.write(0, 1);
+            } else if (change >= -64 && change < 64) {
+                out.write(0b01, 2);
+                out.write(uint64_t(change), 7);
+            } else if (change >= -256 && change < 256) {
+                out.write(0b011, 3);
+                out.write(uint64_t(change), 9);
+            } else if (change >= -2048 && change < 2048) {
+                out.write(0b0111, 4);
+                out.write(uint64_t(change), 12);
+            } else {
+                out.write(0b1111, 4);
+                out.write(uint64_t(change), 32);
+            }
+            previousDelta = delta;
+        }
+        previous = date;
+    }
+};
+
+struct DateDecoder {
+    int32_t previous;
+    int32_t previousDelta;
+
+    DateDecoder() : previous(0), previousDelta(0) {}
+
+    static int64_t signExtend(uint64_t value, int bits) {
+        uint64_t sign = uint64_t(1) << (bits - 1);
+        return int64_t((value ^ sign) - sign);
+    }
+
+    int32_t decode(BitReader& in, bool first) {
+        if (first) {
+            previous = int32_t(uint32_t(in.read(32)));
+            return previous;
+        }
+        int64_t change = 0;
+        if (in.readBit()) {
+            if (!in.readBit())
+                change = signExtend(in.read(7), 7);
+            else if (!in.readBit())
+                change = signExtend(in.read(9), 9);
+            else if (!in.readBit())
+                change = signExtend(in.read(12), 12);
+            else
+                change = signExtend(in.read(32), 32);
+        }
+        previousDelta = int32_t(previousDelta + change);
+        previous += previousDelta;
+        return previous;
+    }
+};
+
+// Columns of a daily OHLCV history
+enum class OhlcvField { Open, High, Low, Close, Volume };
+
+const int OHLCV_FIELD_COUNT = 5;
+
+// One day of a ticker's history; date is days since 1970-01-01
+struct OhlcvRow {
+    int32_t date;
+    double values[OHLCV_FIELD_COUNT];  // indexed by OhlcvField
+};
+
+// Up to HistoryStore::BLOCK_ROWS consecutive rows of one ticker, one
+// compressed stream per column
+struct HistoryBlock {
+    int32_t firstDate;
+    int32_t lastDate;
+    uint32_t rows;
+    BitStream dates;
+    BitStream columns[OHLCV_FIELD_COUNT];
+    DateEncoder dateEncoder;  // appends continue from here
+    XorEncoder encoders[OHLCV_FIELD_COUNT];
+
+    HistoryBlock() : firstDate(0), lastDate(0), rows(0) {}
+};
+
+// Compressed, append-only daily OHLCV histories keyed by ticker. Rows of a
+// ticker are kept in date order and split into blocks, so a date range scan
+// decodes only the blocks that overlap it, and only the columns it reads.
+// Reads may run concurrently with each other but not with appends.
+class HistoryStore {
+private:
+    static const uint32_t BLOCK_ROWS = 1024;
+    static const uint32_t FILE_VERSION = 2;
+
+    unordered_map<string, vector<HistoryBlock>> series;
+
+    const vector<HistoryBlock>* find(const string& ticker) const {
+        auto it = series.find(ticker);
+        return it == series.end() ? nullptr : &it->second;
+    }
+
+    // Decodes the rows of block dated within [from, to]. Only the columns in
+    // the fieldMask bit set are decoded; the others are left at zero.
+    template <typename Visitor>
+    static void decodeBlock(const HistoryBlock& block, unsigned fieldMask, int32_t from, int32_t to, Visitor& visit) {
+        BitReader dateReader(block.dates);
+        DateDecoder dateDecoder;
+        BitReader readers[OHLCV_FIELD_COUNT] = {BitReader(block.columns[0]), BitReader(block.columns[1]),
+                                                BitReader(block.columns[2]), BitReader(block.columns[3]),
+                                                BitReader(block.columns[4])};
+        XorDecoder decoders[OHLCV_FIELD_COUNT];
+        OhlcvRow row = {};
+        for (uint32_t i = 0; i < block.rows; ++i) {
+            row.date = dateDecoder.decode(dateReader, i == 0);
+            if (row.date > to) return;
+            for (int f = 0; f < OHLCV_FIELD_COUNT; ++f) {
+                if (fieldMask & (1u << f)) row.values[f] = decoders[f].decode(readers[f], i == 0);
+            }
+            if (row.date >= from) visit(row);
+        }
+    }
+
+    template <typename Visitor>
+    void scanFields(const string& ticker, unsigned fieldMask, int32_t from, int32_t to, Visitor& visit) const {
+        const vector<HistoryBlock>* blocks = find(ticker);
+        if (!blocks) return;
+        auto first = lower_bound(blocks->begin(), blocks->end(), from,
+                                 [](const HistoryBlock& block, int32_t date) { return block.lastDate < date; });
+        for (auto it = first; it != blocks->end() && it->firstDate <= to; ++it) {
+            decodeBlock(*it, fieldMask, from, to, visit);
+        }
+    }
+
+public:
+    // Appends a row; false if it is older than the ticker's last row
+    bool append(const string& ticker, const OhlcvRow& row) {
+        vector<HistoryBlock>& blocks = series[ticker];
+        if (!blocks.empty() && row.date < blocks.back().lastDate) return false;
+        if (blocks.empty() || blocks.back().rows == BLOCK_ROWS) {
+            blocks.emplace_back();
+            blocks.back().firstDate = row.date;
+        }
+
+        HistoryBlock& block = blocks.back();
+        bool first = block.rows == 0;
+        block.dateEncoder.encode(block.dates, row.date, first);
+        for (int f = 0; f < OHLCV_FIELD_COUNT; ++f) {
+            block.encoders[f].encode(block.columns[f], row.values[f], first);
+        }
+        block.lastDate = row.date;
+        ++block.rows;
+        return true;
+    }
+
+    bool contains(const string& ticker) const {
+        return find(ticker) != nullptr;
+    }
+
+    size_t rowCount(const string& ticker) const {
+        size_t rows = 0;
+        if (const vector<HistoryBlock>* blocks = find(ticker)) {
+            for (const auto& block : *blocks) rows += block.rows;
+        }
+        return rows;
+    }
+
+    // Calls visit(ticker) for every ticker in the store
+    template <typename Visitor>
+    void forEachTicker(Visitor visit) const {
+        for (const auto& entry : series) visit(entry.first);
+    }
+
+    // Calls visit(row) for every row of ticker dated within [from, to], in date order
+    template <typename Visitor>
+    void scan(const string& ticker, int32_t from, int32_t to, Visitor visit) const {
+        scanFields(ticker, (1u << OHLCV_FIELD_COUNT) - 1, from, to, visit);
+    }
+
+    // Calls visit(date, value) for one column, decoding nothing else but the dates
+    template <typename Visitor>
+    void scanColumn(const string& ticker, OhlcvField field, int32_t from, int32_t to, Visitor visit) const {
+        int f = int(field);
+        auto forward = [&visit, f](const OhlcvRow& row) { visit(row.date, row.values[f]); };
+        scanFields(ticker, 1u << f, from, to, forward);
+    }
+
+    // Function to decode one column over a date range into out, for the analytics kernels
+    void column(const string& ticker, OhlcvField field, vector<double>& out,
+                int32_t from = INT32_MIN, int32_t to = INT32_MAX) const {
+        out.clear();
+        scanColumn(ticker, field, from, to, [&out](int32_t, double value) { out.push_back(value); });
+    }
+
+    // Bytes held by the compressed streams
+    size_t compressedBytes() const {
+        size_t bytes = 0;
+        for (const auto& entry : series) {
+            for (const auto& block : entry.second) {
+                bytes += block.dates.data().size() * sizeof(uint64_t);
+                for (const auto& column : block.columns) bytes += column.data().size() * sizeof(uint64_t);
+            }
+        }
+        return bytes;
+    }
+
+    // Function to append a Date,Open,High,Low,Close,Adj Close,Volume CSV file
+    // to ticker's history. Rows are sorted by date first; rows dated on or
+    // before the last stored day are taken as already imported and skipped,
+    // so importing a growing file again adds only its new days. Returns the
+    // number of rows added.
+    size_t importCSV(const string& ticker, const string& filePath) {
+        MappedFile file;
+        if (!file.open(filePath)) {
+            cerr << "Error: Could not open file " << filePath << endl;
+            return 0;
+        }
+
+        STOCK_STATS_ONLY(ScopedLatency parseTimer(stockStats.csvParse);)
+        CsvReader reader(file);
+        CsvRow csvRow;
+        ParseReport report;
+        vector<OhlcvRow> rows;
+        const int columnOf[OHLCV_FIELD_COUNT] = {1, 2, 3, 4, 6};
+        reader.next(csvRow, 1);  // header
+
+        while (reader.next(csvRow, 7)) {
+            OhlcvRow row = {};
+            bool valid = csvRow.fields.size() > 4 && parseDate(csvRow.fields[0], row.date);
+            for (int f = 0; valid && f < OHLCV_FIELD_COUNT; ++f) {
+                size_t column = size_t(columnOf[f]);
+                if (column < csvRow.fields.size())
+                    valid = parseNumber(csvRow.fields[column], row.values[f]);
+                else
+                    valid = OhlcvField(f) == OhlcvField::Volume;  // volume is optional
+            }
+            if (valid)
+                rows.push_back(row);
+            else
+                report.reject(csvRow.lineNumber);
+        }
+        report.print(filePath);
+        STOCK_STATS_ONLY(stockStats.csvRows.add(max<size_t>(reader.linesRead(), 1) - 1);
+                         stockStats.csvBytes.add(file.size()); stockStats.csvRejected.add(report.count());)
+
+        stable_sort(rows.begin(), rows.end(), [](const OhlcvRow& a, const OhlcvRow& b) { return a.date < b.date; });
+        const vector<HistoryBlock>* stored = find(ticker);
+        bool hasHistory = stored && !stored->empty();
+        int32_t lastStored = hasHistory ? stored->back().lastDate : 0;
+        size_t added = 0;
+        for (const auto& row : rows) {
+            if (!hasHistory || row.date > lastStored) added += append(ticker, row);
+        }
+        return added;
+    }
+
+    // Writes the store to path: header, then per ticker its name and blocks
+    // with their encoder state and raw stream words. Written beside path and
+    // renamed over it.
+    bool save(const string& path) const {
+        string body;
+        auto put = [&body](const void* value, size_t bytes) {
+            body.append(static_cast<const char*>(value), bytes);
+        };
+        auto putStream = [&put](const BitStream& stream) {
+            uint64_t bits = stream.size();
+            put(&bits, sizeof(bits));
+            put(stream.data().data(), stream.data().size() * sizeof(uint64_t));
+        };
+
+        for (const auto& entry : series) {
+            uint32_t nameLength = uint32_t(entry.first.size());
+            uint32_t blockCount = uint32_t(entry.second.size());
+            put(&nameLength, sizeof(nameLength));
+            put(entry.first.data(), nameLength);
+            put(&blockCount, sizeof(blockCount));
+            for (const auto& block : entry.second) {
+                put(&block.firstDate, sizeof(block.firstDate));
+                put(&block.lastDate, sizeof(block.lastDate));
+                put(&block.rows, sizeof(block.rows));
+                // Encoder state field by field, so the file holds no struct padding
+                put(&block.dateEncoder.previous, sizeof(block.dateEncoder.previous));
+                put(&block.dateEncoder.previousDelta, sizeof(block.dateEncoder.previousDelta));
+                for (const auto& encoder : block.encoders) {
+                    put(&encoder.previous, sizeof(encoder.previous));
+                    put(&encoder.leading, sizeof(encoder.leading));
+                    put(&encoder.trailing, sizeof(encoder.trailing));
+                }
+                putStream(block.dates);
+                for (const auto& column : block.columns) putStream(column);
+            }
+        }
+
+        uint64_t header[4] = {0, FILE_VERSION | uint64_t(SNAPSHOT_BYTE_ORDER) << 32, series.size(),
+                              snapshotChecksum(body.data(), body.size())};
+        memcpy(&header[0], "STKHIST", 8);
+
+        string temporary = path + ".tmp";
+        {
+            ofstream out(temporary, ios::binary | ios::trunc);
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            out.write(body.data(), body.size());
+            if (!out) {
+                cerr << "Error: Could not write history store " << temporary << endl;
+                return false;
+            }
+        }
+        error_code ec;
+        filesystem::rename(temporary, path, ec);
+        if (ec) {
+            cerr << "Error: Could not replace history store " << path << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // True if path starts like a file written by save()
+    static bool isStoreFile(const string& path) {
+        ifstream in(path, ios::binary);
+        char magic[8] = {};
+        return in.read(magic, sizeof(magic)) && memcmp(magic, "STKHIST", 8) == 0;
+    }
+
+    // Replaces the contents with the store saved at path; false (contents
+    // cleared) if the file is missing, from another version or damaged
+    bool load(const string& path) {
+        series.clear();
+        MappedFile file;
+        if (!file.open(path)) return false;
+
+        uint64_t header[4];
+        if (file.size() < sizeof(header)) return false;
+        memcpy(header, file.begin(), sizeof(header));
+        if (memcmp(file.begin(), "STKHIST", 8) != 0
+            || header[1] != (FILE_VERSION | uint64_t(SNAPSHOT_BYTE_ORDER) << 32))
+            return false;
+
+        const char* p = file.begin() + sizeof(header);
+        const char* end = file.end();
+        if (snapshotChecksum(p, size_t(end - p)) != header[3]) {
+            cerr << "Error: History store " << path << " is damaged." << endl;
+            return false;
+        }
+
+        bool intact = true;
+        auto get = [&](void* value, size_t bytes) {
+            if (size_t(end - p) < bytes) {
+                intact = false;
+                return;
+            }
+            memcpy(value, p, bytes);
+            p += bytes;
+        };
+        auto getStream = [&](BitStream& stream) {
+            uint64_t bits = 0;
+            get(&bits, sizeof(bits));
+            uint64_t wordCount = (bits + 63) / 64;
+            if (!intact || wordCount > uint64_t(end - p) / sizeof(uint64_t)) {
+                intact = false;
+                return;
+            }
+            vector<uint64_t> words(wordCount);
+            get(words.data(), wordCount * sizeof(uint64_t));
+            stream.assign(words.data(), words.size(), size_t(bits));
+        };
+
+        for (uint64_t s = 0; intact && s < header[2]; ++s) {
+            uint32_t nameLength = 0, blockCount = 0;
+            get(&nameLength, sizeof(nameLength));
+            if (!intact || nameLength > size_t(end - p)) break;
+            string ticker(p, nameLength);
+            p += nameLength;
+            get(&blockCount, sizeof(blockCount));
+
+            vector<HistoryBlock>& blocks = series[ticker];
+            for (uint32_t b = 0; intact && b < blockCount; ++b) {
+                blocks.emplace_back();
+                HistoryBlock& block = blocks.back();
+                get(&block.firstDate, sizeof(block.firstDate));
+                get(&block.lastDate, sizeof(block.lastDate));
+                get(&block.rows, sizeof(block.rows));
+                get(&block.dateEncoder.previous, sizeof(block.dateEncoder.previous));
+                get(&block.dateEncoder.previousDelta, sizeof(block.dateEncoder.previousDelta));
+                for (auto& encoder : block.encoders) {
+                    get(&encoder.previous, sizeof(encoder.previous));
+                    get(&encoder.leading, sizeof(encoder.leading));
+                    get(&encoder.trailing, sizeof(encoder.trailing));
+                }
+                getStream(block.dates);
+                for (auto& column : block.columns) getStream(column);
+            }
+        }
+
+        if (!intact || p != end) {
+            cerr << "Error: History store " << path << " is damaged." << endl;
+            series.clear();
+            return false;
+        }
+        return true;
+    }
+};
+
+// Days used by the short-term prediction
+const size_t PREDICTION_WINDOW_DAYS = 30;
+const size_t INDICATOR_WINDOW_DAYS = 20;
+
+// Fixed set of worker threads, each with its own task deque. A worker runs its
+// own tasks newest first and, when it runs dry, steals the oldest task of
+// another worker, so a few long tasks do not leave the other threads idle.
+class WorkStealingPool {
+private:
+    struct WorkerQueue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<WorkerQueue>> queues;
+    vector<thread> workers;
+    mutex stateLock;
+    condition_variable wake;  // tasks queued or stopping
+    condition_variable done;  // nothing left to run
+    size_t queued;            // tasks waiting in a deque, guarded by stateLock
+    size_t running;           // tasks taken but not finished, guarded by stateLock
+    size_t nextQueue;
+    bool stopping;
+
+    bool take(size_t self, function<void()>& task) {
+        size_t count = queues.size();
+        for (size_t i = 0; i < count; ++i) {
+            WorkerQueue& queue = *queues[(self + i) % count];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty()) continue;
+            if (i == 0) {
+                task = move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(size_t self) {
+        function<void()> task;
+        while (true) {
+            {
+                unique_lock<mutex> guard(stateLock);
+                wake.wait(guard, [this] { return stopping || queued > 0; });
+                if (queued == 0) return;
+                --queued;
+                ++running;
+            }
+            // queued counted this task, so some deque holds it
+            while (!take(self, task)) this_thread::yield();
+            task();
+            task = nullptr;
+
+            lock_guard<mutex> guard(stateLock);
+            if (--running == 0 && queued == 0) done.notify_all();
+        }
+    }
+
+public:
+    // 0 threads = all cores
+    explicit WorkStealingPool(int threads = 0) : queued(0), running(0), nextQueue(0), stopping(false) {
+        if (threads <= 0) threads = max(1, int(thread::hardware_concurrency()));
+        for (int i = 0; i < threads; ++i) queues.push_back(make_unique<WorkerQueue>());
+        for (int i = 0; i < threads; ++i) workers.emplace_back(&WorkStealingPool::workerLoop, this, size_t(i));
+    }
+
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> guard(stateLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    // Tasks are dealt to the workers round-robin
+    void submit(function<void()> task) {
+        WorkerQueue& queue = *queues[nextQueue++ % queues.size()];
+        {
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back(move(task));
+        }
+        {
+            lock_guard<mutex> guard(stateLock);
+            ++queued;
+        }
+        wake.notify_one();
+    }
+
+    // Blocks until every submitted task has finished
+    void wait() {
+        unique_lock<mutex> guard(stateLock);
+        done.wait(guard, [this] { return queued == 0 && running == 0; });
+    }
+};
+
+// Next-day estimate for one symbol
+struct BatchPrediction {
+    string ticker;
+    string historyFile;
+    size_t days;
+    double predicted;
+    double recent;
+    bool fitted;
+};
+
+// Function to map tickers to history files. source is either a directory, where
+// every .csv file is the history of the ticker named by its file name, or a
+// text file listing one history file path per line.
+bool collectHistoryFiles(const string& source, unordered_map<string, string>& filesByTicker) {
+    namespace fs = std::filesystem;
+    error_code error;
+    vector<fs::path> paths;
+
+    if (fs::is_directory(source, error)) {
+        for (const auto& entry : fs::directory_iterator(source, error)) {
+            if (entry.path().extension() == ".csv") paths.push_back(entry.path());
+        }
+    } else {
+        ifstream list(source);
+        if (!list.is_open()) {
+            cerr << "Error: Could not open history list " << source << endl;
+            return false;
+        }
+        string line;
+        while (getline(list, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) paths.emplace_back(line);
+        }
+    }
+
+    for (const auto& path : paths) {
+        filesByTicker.emplace(path.stem().string(), path.string());
+    }
+    return true;
+}
+
+// Function to predict the next-day price of every stock in the tree that has a
+// history, fitting the histories in parallel, and write the results as CSV to
+// outputPath in ticker order. source is a history store written by
+// HistoryStore::save (closing prices are used) or anything collectHistoryFiles
+// accepts. Returns the number of symbols predicted.
+size_t predictBatch(StockTree& stockTree, const string& source, int priceColumnIndex,
+                    const string& outputPath, int threads = 0) {
+    HistoryStore store;
+    bool fromStore = HistoryStore::isStoreFile(source);
+    unordered_map<string, string> filesByTicker;
+    if (fromStore) {
+        if (!store.load(source)) {
+            cerr << "Error: Could not load history store " << source << endl;
+            return 0;
+        }
+    } else if (!collectHistoryFiles(source, filesByTicker)) {
+        return 0;
+    }
+
+    vector<BatchPrediction> results;
+    size_t withoutHistory = 0;
+    stockTree.forEach([&](const StockData& stock) {
+        if (fromStore) {
+            if (store.contains(stock.ticker)) {
+                results.push_back(BatchPrediction{stock.ticker, source, 0, 0.0, 0.0, false});
+                return;
+            }
+        } else {
+            auto it = filesByTicker.find(stock.ticker);
+            if (it != filesByTicker.end()) {
+                results.push_back(BatchPrediction{stock.ticker, it->second, 0, 0.0, 0.0, false});
+                return;
+            }
+        }
+        ++withoutHistory;
+    });
+
+    {
+        WorkStealingPool pool(threads);
+        for (auto& result : results) {
+            pool.submit([&result, &store, fromStore, priceColumnIndex] {
+                PriceModel model(PREDICTION_WINDOW_DAYS);
+                if (fromStore) {
+                    store.scanColumn(result.ticker, OhlcvField::Close, INT32_MIN, INT32_MAX,
+                                     [&model](int32_t, double price) { model.addPrice(price); });
+                } else {
+                    forEachPriceInCSV(result.historyFile, priceColumnIndex, [&model](double price) {
+                        model.addPrice(price);
+                    });
+                }
+                result.days = model.dayCount();
+                result.fitted = model.predictNext(result.predicted);
+                if (result.fitted && !model.predictNext(result.recent, true)) result.recent = result.predicted;
+            });
+        }
+        pool.wait();
+    }
+
+    ofstream output(outputPath);
+    if (!output.is_open()) {
+        cerr << "Error: Could not open output file " << outputPath << endl;
+        return 0;
+    }
+
+    size_t predicted = 0;
+    output << "Ticker,Days,Predicted,Predicted" << PREDICTION_WINDOW_DAYS << "Days\n";
+    for (const auto& result : results) {
+        output << result.ticker << ',' << result.days << ',';
+        if (result.fitted) {
+            output << result.predicted << ',' << result.recent;
+            ++predicted;
+        } else {
+            output << ',';
+        }
+        output << '\n';
+    }
+
+    cout << "Predicted " << predicted << " of " << results.size() << " symbols with history into "
+         << outputPath << " (" << withoutHistory << " symbols without history)" << endl;
+    return predicted;
+}
+
+// Function to measure concurrent throughput: for 1, 2, 4, ... reader threads,
+// run lookups, narrow price-range scans and top-10 queries for `seconds`
+// while `writers` threads publish batches of random price updates, then
+// report operations per second and check that both tree copies agree
+void runStressTest(const vector<StockData>& stockList, double seconds, int writers, int maxReaders) {
+    if (stockList.empty()) {
+        cerr << "Error: No stocks loaded for the stress test." << endl;
+        return;
+    }
+
+    ConcurrentStockTree tree;
+    tree.bulkLoad(stockList);
+    const size_t batchSize = 64;
+    bool passed = true;
+
+    cout << "Readers  Reads/s      Updates/s    (" << writers << " writer threads, batches of "
+         << batchSize << ")" << endl;
+    for (int readerCount = 1; readerCount <= maxReaders; readerCount *= 2) {
+        atomic<bool> stop(false);
+        atomic<long long> reads(0), updates(0);
+        vector<thread> threads;
+
+        for (int r = 0; r < readerCount; ++r) {
+            threads.emplace_back([&, r] {
+                mt19937 random(1000 + r);
+                long long done = 0;
+                while (!stop.load(memory_order_relaxed)) {
+                    const StockData& probe = stockList[random() % stockList.size()];
+                    unsigned kind = random() % 20;
+                    tree.read([&](StockTree& snapshot) {
+                        if (kind < 16) {
+                            return snapshot.find(probe.ticker) != nullptr;
+                        }
+                        int seen = 0;
+                        if (kind < 19) {
+                            snapshot.forEachInRange(PriceField::LastPrice, probe.lastPrice, probe.lastPrice * 1.001f,
+                                                    [&seen](const StockData&) { ++seen; });
+                        } else {
+                            snapshot.forEachTop(PriceField::ChangePercent, 10, true, [&seen](const StockData&) { ++seen; });
+                        }
+                        return seen > 0;
+                    });
+                    ++done;
+                }
+                reads += done;
+            });
+        }
+
+        for (int w = 0; w < writers; ++w) {
+            threads.emplace_back([&, w] {
+                mt19937 random(2000 + w);
+                uniform_real_distribution<float> move(0.98f, 1.02f);
+                vector<StockData> batch(batchSize);
+                long long done = 0;
+                while (!stop.load(memory_order_relaxed)) {
+                    for (auto& stock : batch) {
+                        stock = stockList[random() % stockList.size()];
+                        stock.lastPrice *= move(random);
+                        stock.dayHigh = max(stock.dayHigh, stock.lastPrice);
+                        stock.dayLow = min(stock.dayLow, stock.lastPrice);
+                    }
+                    tree.updateBatch(batch);
+                    done += batch.size();
+                }
+                updates += done;
+            });
+        }
+
+        auto start = chrono::steady_clock::now();
+        this_thread::sleep_for(chrono::duration<double>(seconds));
+        stop = true;
+        for (auto& worker : threads) worker.join();
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        bool same = tree.consistent();
+        passed = passed && same;
+        cout << left;
+        cout.width(9);
+        cout << readerCount;
+        cout.width(13);
+        cout << (long long)(reads / elapsed);
+        cout.width(13);
+        cout << (long long)(updates / elapsed) << (same ? "" : "copies differ!") << right << endl;
+    }
+
+    cout << (passed ? "Stress test passed." : "Stress test FAILED: tree copies diverged.") << endl;
+}
+
+// Screening queries over the loaded stocks, for example
+//   last between 10 and 50 and (high - low) / open > 3% and last > open sort change desc top 20
+// Conditions are expressions over the price fields (last, open, high, low,
+// change), numbers (a trailing % divides by 100), + - * / and parentheses,
+// joined with and. change is already in percent, so a condition on change
+// must compare it with plain numbers: "change > 3%" is rejected rather than
+// read as change > 0.03. Each expression is compiled to a postfix program and run a
+// column at a time: every field the screen uses is gathered once into a
+// contiguous array, each operator is one loop over whole columns, and each
+// comparison ANDs its outcome into a bitmap of the rows still passing.
+//
+// A condition that bounds a bare field by constants can be answered by the
+// field's price index. When the narrowest such condition keeps at most one
+// stock in SCREEN_INDEX_RATIO, only the stocks in its range are gathered.
+const int SCREEN_INDEX_RATIO = 8;
+
+class StockScreen {
+private:
+    struct ScreenOp {
+        enum Kind { Field, Constant, Add, Subtract, Multiply, Divide, Negate };
+
+        Kind kind;
+        PriceField field;  // Field
+        float value;       // Constant
+    };
+
+    typedef vector<ScreenOp> Expression;  // postfix
+
+    struct Condition {
+        enum Compare { Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual, Between };
+
+        Expression left;
+        Compare compare;
+        Expression right;
+        Expression upper;  // Between only; right is the lower bound
+    };
+
+    // One operand while a program runs: a constant, or one value per row
+    struct Values {
+        const float* data;  // null for a constant
+        vector<float> owned;  // backs data when the values were computed
+        float constant;
+    };
+
+    vector<Condition> conditions;
+    Expression sortKey;  // empty to keep ticker order
+    bool descending;
+    int limit;  // 0 for every match
+
+    // Rest of the text being parsed, its current token, and whether the
+    // condition being parsed has a % number; used only by parse
+    string_view text;
+    string_view token;
+    bool sawPercent;
+
+    // Function to move token to the next token of text; empty at the end
+    void next() {
+        while (!text.empty() && (text.front() == ' ' || text.front() == '\t' || text.front() == '\r'))
+            text.remove_prefix(1);
+        size_t length = 0;
+        if (text.empty()) {
+        } else if (isalpha((unsigned char)text[0])) {
+            while (length < text.size() && isalnum((unsigned char)text[length])) ++length;
+        } else if (isdigit((unsigned char)text[0]) || text[0] == '.') {
+            while (length < text.size() && (isdigit((unsigned char)text[length]) || text[length] == '.')) ++length;
+        } else if (text.size() > 1 && text[1] == '=' && strchr("<>!", text[0])) {
+            length = 2;
+        } else {
+            length = 1;
+        }
+        token = text.substr(0, length);
+        text.remove_prefix(length);
+    }
+
+    bool parseFactor(Expression& expression, string& error) {
+        if (token == "-") {
+            next();
+            if (!parseFactor(expression, error)) return false;
+            expression.push_back(ScreenOp{ScreenOp::Negate, PriceField::LastPrice, 0});
+            return true;
+        }
+        if (token == "(") {
+            next();
+            if (!parseSum(expression, error)) return false;
+            if (token != ")") {
+                error = "expected ) in screen";
+                return false;
+            }
+            next();
+            return true;
+        }
+        float value;
+        if (!token.empty() && (isdigit((unsigned char)token[0]) || token[0] == '.')) {
+            if (!parseNumber(token, value)) {
+                error = "bad number " + string(token) + " in screen";
+                return false;
+            }
+            next();
+            if (token == "%") {
+                value /= 100;
+                sawPercent = true;
+                next();
+            }
+            expression.push_back(ScreenOp{ScreenOp::Constant, PriceField::LastPrice, value});
+            return true;
+        }
+        int field = int(find(begin(PRICE_FIELD_NAMES), end(PRICE_FIELD_NAMES), token) - begin(PRICE_FIELD_NAMES));
+        if (field == PRICE_FIELD_COUNT) {
+            if (token.empty())
+                error = "unexpected end of screen";
+            else
+                error = (isalpha((unsigned char)token[0]) ? "unknown field " : "unexpected ") + string(token) + " in screen";
+            return false;
+        }
+        next();
+        expression.push_back(ScreenOp{ScreenOp::Field, PriceField(field), 0});
+        return true;
+    }
+
+    bool parseProduct(Expression& expression, string& error) {
+        if (!parseFactor(expression, error)) return false;
+        while (token == "*" || token == "/") {
+            ScreenOp::Kind kind = token == "*" ? ScreenOp::Multiply : ScreenOp::Divide;
+            next();
+            if (!parseFactor(expression, error)) return false;
+            expression.push_back(ScreenOp{kind, PriceField::LastPrice, 0});
+        }
+        return true;
+    }
+
+    bool parseSum(Expression& expression, string& error) {
+        if (!parseProduct(expression, error)) return false;
+        while (token == "+" || token == "-") {
+            ScreenOp::Kind kind = token == "+" ? ScreenOp::Add : ScreenOp::Subtract;
+            next();
+            if (!parseProduct(expression, error)) return false;
+            expression.push_back(ScreenOp{kind, PriceField::LastPrice, 0});
+        }
+        return true;
+    }
+
+    // Function to parse an expression, folding it to one constant if it reads no field
+    bool parseExpression(Expression& expression, string& error) {
+        expression.clear();
+        if (!parseSum(expression, error)) return false;
+        bool constant = none_of(expression.begin(), expression.end(),
+                                [](const ScreenOp& op) { return op.kind == ScreenOp::Field; });
+        if (constant && expression.size() > 1) {
+            Values folded = evaluate(expression, {}, 0);
+            expression.assign(1, ScreenOp{ScreenOp::Constant, PriceField::LastPrice, folded.constant});
+        }
+        return true;
+    }
+
+    bool parseCondition(Condition& condition, string& error) {
+        static const pair<string_view, Condition::Compare> compares[] = {
+            {"<", Condition::Less},     {"<=", Condition::LessEqual}, {">", Condition::Greater},
+            {">=", Condition::GreaterEqual}, {"=", Condition::Equal}, {"!=", Condition::NotEqual}};
+        sawPercent = false;
+        if (!parseExpression(condition.left, error)) return false;
+        if (token == "between") {
+            next();
+            condition.compare = Condition::Between;
+            if (!parseExpression(condition.right, error)) return false;
+            if (token != "and") {
+                error = "expected between <low> and <high> in screen";
+                return false;
+            }
+            next();
+            if (!parseExpression(condition.upper, error)) return false;
+        } else {
+            auto compare = find_if(begin(compares), end(compares),
+                                   [this](const pair<string_view, Condition::Compare>& c) { return c.first == token; });
+            if (compare == end(compares)) {
+                error = "expected a comparison in screen";
+                return false;
+            }
+            next();
+            condition.compare = compare->second;
+            if (!parseExpression(condition.right, error)) return false;
+        }
+
+        auto readsChange = [](const Expression& expression) {
+            return any_of(expression.begin(), expression.end(), [](const ScreenOp& op) {
+                return op.kind == ScreenOp::Field && op.field == PriceField::ChangePercent;
+            });
+        };
+        if (sawPercent && (readsChange(condition.left) || readsChange(condition.right) || readsChange(condition.upper))) {
+            error = "change is in percent already; compare it without % in screen";
+            return false;
+        }
+        return true;
+    }
+
+    // Function to make a constant operand into one value per row
+    static const float* spread(Values& values, size_t rows) {
+        if (!values.data) {
+            values.owned.assign(rows, values.constant);
+            values.data = values.owned.data();
+        }
+        return values.data;
+    }
+
+    template <typename Op>
+    static Values combine(Values left, Values right, size_t rows, Op op) {
+        if (!left.data && !right.data) return Values{nullptr, {}, op(left.constant, right.constant)};
+        const float* a = spread(left, rows);
+        const float* b = spread(right, rows);
+        Values result{nullptr, left.owned.empty() ? move(right.owned) : move(left.owned), 0};
+        result.owned.resize(rows);
+        float* out = result.owned.data();
+        for (size_t i = 0; i < rows; ++i) out[i] = op(a[i], b[i]);
+        result.data = out;
+        return result;
+    }
+
+    // Function to run a postfix program over rows rows of the gathered columns
+    static Values evaluate(const Expression& expression, const vector<float>* columns, size_t rows) {
+        vector<Values> stack;
+        for (const auto& op : expression) {
+            if (op.kind == ScreenOp::Field) {
+                stack.push_back(Values{columns[int(op.field)].data(), {}, 0});
+                continue;
+            }
+            if (op.kind == ScreenOp::Constant) {
+                stack.push_back(Values{nullptr, {}, op.value});
+                continue;
+            }
+            if (op.kind == ScreenOp::Negate) {
+                Values operand = move(stack.back());
+                stack.pop_back();
+                stack.push_back(combine(Values{nullptr, {}, 0}, move(operand), rows, minus<float>()));
+                continue;
+            }
+            Values right = move(stack.back());
+            stack.pop_back();
+            Values left = move(stack.back());
+            stack.pop_back();
+            if (op.kind == ScreenOp::Add)
+                stack.push_back(combine(move(left), move(right), rows, plus<float>()));
+            else if (op.kind == ScreenOp::Subtract)
+                stack.push_back(combine(move(left), move(right), rows, minus<float>()));
+            else if (op.kind == ScreenOp::Multiply)
+                stack.push_back(combine(move(left), move(right), rows, multiplies<float>()));
+            else
+                stack.push_back(combine(move(left), move(right), rows, divides<float>()));
+        }
+        return move(stack.back());
+    }
+
+    // Function to clear the bits of the rows where compare(left, right) is false
+    template <typename Compare>
+    static void filter(Values& left, Values& right, size_t rows, vector<uint64_t>& bitmap, Compare compare) {
+        if (!left.data && !right.data) {
+            if (!compare(left.constant, right.constant)) fill(bitmap.begin(), bitmap.end(), 0);
+            return;
+        }
+        const float* a = spread(left, rows);
+        const float* b = spread(right, rows);
+        for (size_t word = 0; word < bitmap.size(); ++word) {
+            if (!bitmap[word]) continue;
+            size_t base = word * 64, count = min<size_t>(64, rows - base);
+            uint64_t passed = 0;
+            for (size_t bit = 0; bit < count; ++bit)
+                passed |= uint64_t(compare(a[base + bit], b[base + bit])) << bit;
+            bitmap[word] &= passed;
+        }
+    }
+
+    static void apply(const Condition& condition, const vector<float>* columns, size_t rows, vector<uint64_t>& bitmap) {
+        Values left = evaluate(condition.left, columns, rows);
+        Values right = evaluate(condition.right, columns, rows);
+        switch (condition.compare) {
+            case Condition::Less:
+                filter(left, right, rows, bitmap, less<float>());
+                break;
+            case Condition::LessEqual:
+                filter(left, right, rows, bitmap, less_equal<float>());
+                break;
+            case Condition::Greater:
+                filter(left, right, rows, bitmap, greater<float>());
+                break;
+            case Condition::GreaterEqual:
+                filter(left, right, rows, bitmap, greater_equal<float>());
+                break;
+            case Condition::Equal:
+                filter(left, right, rows, bitmap, equal_to<float>());
+                break;
+            case Condition::NotEqual:
+                filter(left, right, rows, bitmap, not_equal_to<float>());
+                break;
+            case Condition::Between: {
+                Values upper = evaluate(condition.upper, columns, rows);
+                filter(left, right, rows, bitmap, greater_equal<float>());
+                filter(left, upper, rows, bitmap, less_equal<float>());
+                break;
+            }
+        }
+    }
+
+    // Function to read a condition as field in [minPrice, maxPrice]; false
+    // if it is not a bare field bounded by constants
+    static bool indexRange(const Condition& condition, PriceField& field, float& minPrice, float& maxPrice) {
+        const float infinity = numeric_limits<float>::infinity();
+        auto isField = [](const Expression& e) { return e.size() == 1 && e[0].kind == ScreenOp::Field; };
+        auto isConstant = [](const Expression& e) { return e.size() == 1 && e[0].kind == ScreenOp::Constant; };
+        Condition::Compare compare = condition.compare;
+        float bound;
+        if (compare == Condition::Between) {
+            if (!isField(condition.left) || !isConstant(condition.right) || !isConstant(condition.upper)) return false;
+            field = condition.left[0].field;
+            minPrice = condition.right[0].value;
+            maxPrice = condition.upper[0].value;
+            return true;
+        }
+        if (compare == Condition::NotEqual) return false;
+        if (isField(condition.left) && isConstant(condition.right)) {
+            field = condition.left[0].field;
+            bound = condition.right[0].value;
+        } else if (isConstant(condition.left) && isField(condition.right)) {
+            // Turn "constant < field" into "field > constant"
+            static const Condition::Compare flipped[] = {Condition::Greater, Condition::GreaterEqual, Condition::Less,
+                                                        Condition::LessEqual, Condition::Equal};
+            field = condition.right[0].field;
+            bound = condition.left[0].value;
+            compare = flipped[compare];
+        } else {
+            return false;
+        }
+        minPrice = -infinity;
+        maxPrice = infinity;
+        if (compare == Condition::Less) maxPrice = nextafter(bound, -infinity);
+        if (compare == Condition::LessEqual || compare == Condition::Equal) maxPrice = bound;
+        if (compare == Condition::Greater) minPrice = nextafter(bound, infinity);
+        if (compare == Condition::GreaterEqual || compare == Condition::Equal) minPrice = bound;
+        return true;
+    }
+
+public:
+    StockScreen() : descending(true), limit(0), sawPercent(false) {}
+
+    // Function to parse "[condition (and condition)*] [sort <expression> [asc|desc]] [top <k>]";
+    // false with a message in error if malformed
+    bool parse(string_view screenText, string& error) {
+        conditions.clear();
+        sortKey.clear();
+        descending = true;
+        limit = 0;
+        text = screenText;
+        next();
+        if (!token.empty() && token != "sort" && token != "top") {
+            do {
+                if (!conditions.empty()) next();
+                conditions.emplace_back();
+                if (!parseCondition(conditions.back(), error)) return false;
+            } while (token == "and");
+        }
+        if (token == "sort") {
+            next();
+            if (!parseExpression(sortKey, error)) return false;
+            if (token == "asc" || token == "desc") {
+                descending = token == "desc";
+                next();
+            }
+        }
+        if (token == "top") {
+            next();
+            if (!parseNumber(token, limit) || limit <= 0) {
+                error = "expected top <count> in screen";
+                return false;
+            }
+            next();
+        }
+        if (!token.empty()) {
+            error = "unexpected " + string(token) + " in screen";
+            return false;
+        }
+        return true;
+    }
+
+    // Function to collect the matching stocks of tree, in sort key order (ties
+    // and unsorted screens in ticker order, keys that are not numbers last),
+    // at most limit of them
+    void run(StockTree& tree, vector<const StockData*>& matches) const {
+        // Pick the narrowest condition the price indexes can answer
+        int indexed = -1, indexedCount = tree.size();
+        PriceField field = PriceField::LastPrice;
+        float minPrice = 0, maxPrice = 0;
+        for (size_t i = 0; i < conditions.size(); ++i) {
+            PriceField f;
+            float low, high;
+            if (!indexRange(conditions[i], f, low, high)) continue;
+            int count = low <= high ? tree.countInRange(f, low, high) : 0;
+            if (count < indexedCount) {
+                indexed = int(i);
+                indexedCount = count;
+                field = f;
+                minPrice = low;
+                maxPrice = high;
+            }
+        }
+
+        // Gather the fields used by the screen, one column each, while each
+        // stock is visited, so every stock is read from memory once
+        bool used[PRICE_FIELD_COUNT] = {};
+        auto markFields = [&used](const Expression& expression) {
+            for (const auto& op : expression)
+                if (op.kind == ScreenOp::Field) used[int(op.field)] = true;
+        };
+        for (const auto& condition : conditions) {
+            markFields(condition.left);
+            markFields(condition.right);
+            markFields(condition.upper);
+        }
+        markFields(sortKey);
+        vector<float> columns[PRICE_FIELD_COUNT];
+        vector<const StockData*> rows;
+        auto gather = [&used, &columns, &rows](const StockData& stock) {
+            rows.push_back(&stock);
+            for (int f = 0; f < PRICE_FIELD_COUNT; ++f)
+                if (used[f]) columns[f].push_back(priceOf(stock, PriceField(f)));
+        };
+
+        // Rows from the price index come in price order, not ticker order
+        if (indexed >= 0 && indexedCount * SCREEN_INDEX_RATIO <= tree.size()) {
+            rows.reserve(indexedCount);
+            for (int f = 0; f < PRICE_FIELD_COUNT; ++f)
+                if (used[f]) columns[f].reserve(indexedCount);
+            if (indexedCount) tree.forEachInRange(field, minPrice, maxPrice, gather);
+        } else {
+            indexed = -1;
+            rows.reserve(tree.size());
+            for (int f = 0; f < PRICE_FIELD_COUNT; ++f)
+                if (used[f]) columns[f].reserve(tree.size());
+            tree.forEach(gather);
+        }
+        size_t rowCount = rows.size();
+        matches.clear();
+        if (!rowCount) return;
+
+        vector<uint64_t> bitmap((rowCount + 63) / 64, ~uint64_t(0));
+        if (rowCount % 64) bitmap.back() = (uint64_t(1) << (rowCount % 64)) - 1;
+        for (size_t i = 0; i < conditions.size(); ++i) {
+            if (int(i) != indexed) apply(conditions[i], columns, rowCount, bitmap);
+        }
+
+        vector<uint32_t> passed;
+        for (size_t word = 0; word < bitmap.size(); ++word) {
+            for (uint64_t bits = bitmap[word]; bits; bits &= bits - 1)
+                passed.push_back(uint32_t(word * 64 + __builtin_ctzll(bits)));
+        }
+        size_t kept = limit ? min(passed.size(), size_t(limit)) : passed.size();
+
+        bool tickerOrder = indexed < 0;
+        auto tickerBefore = [&rows, tickerOrder](uint32_t a, uint32_t b) {
+            return tickerOrder ? a < b : rows[a]->ticker < rows[b]->ticker;
+        };
+        if (!sortKey.empty()) {
+            Values key = evaluate(sortKey, columns, rowCount);
+            const float* keys = spread(key, rowCount);
+            bool down = descending;
+            auto before = [keys, down, &tickerBefore](uint32_t a, uint32_t b) {
+                bool missingA = isnan(keys[a]), missingB = isnan(keys[b]);
+                if (missingA != missingB) return missingB;
+                if (!missingA && keys[a] != keys[b]) return down ? keys[a] > keys[b] : keys[a] < keys[b];
+                return tickerBefore(a, b);
+            };
+            partial_sort(passed.begin(), passed.begin() + kept, passed.end(), before);
+        } else if (!tickerOrder) {
+            partial_sort(passed.begin(), passed.begin() + kept, passed.end(), tickerBefore);
+        }
+        matches.reserve(kept);
+        for (size_t i = 0; i < kept; ++i) matches.push_back(rows[passed[i]]);
+    }
+};
+
+// Function to print the stocks passing a screen, or a note if none do
+void fetchByScreen(StockTree& tree, const StockScreen& screen, StockWriter& writer) {
+    STOCK_STATS_ONLY(ScopedLatency timer(stockStats.screen);)
+    vector<const StockData*> matches;
+    screen.run(tree, matches);
+    for (const StockData* stock : matches) writer.write(*stock);
+    if (matches.empty()) writer.writeNote("No stocks match the screen.");
+}
+
+// Request language of the headless mode and the query server, one command per line:
+//   add <ticker> <open> <high> <low> <last>     insert; ignored if the ticker exists
+//   update <ticker> <open> <high> <low> <last>  replace the prices; ignored if missing
+//   delete <ticker>
+//   get <ticker> [ticker...]                    several tickers are looked up in one pass
+//   prefix <text> [count]                       first count tickers starting with text (10)
+//   range [last|open|high|low|change] <min> <max>
+//   high | low
+//   screen [condition (and condition)*] [sort <expression> [asc|desc]] [top <k>]
+//                                               see StockScreen
+//   predict <ticker>                            next-day close from the history store
+//   stats                                       operation counts and latencies so far
+// Blank lines and lines starting with '#' are skipped.
+struct StockCommand {
+    enum Kind { Add, Update, Delete, Get, Prefix, Range, Screen, High, Low, Predict, Stats };
+
+    Kind kind;
+    StockData stock;  // ticker, and the prices of Add and Update; the text of Prefix
+    vector<string> tickers;  // Get with more than one ticker
+    int count;  // Prefix
+    PriceField field;  // Range
+    float minPrice;
+    float maxPrice;
+    StockScreen screen;  // Screen
+
+    bool writes() const {
+        return kind == Add || kind == Update || kind == Delete;
+    }
+};
+
+// Function to split a line into words separated by spaces or tabs
+void splitWords(string_view line, vector<string_view>& words) {
+    words.clear();
+    while (true) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string_view::npos) return;
+        size_t end = line.find_first_of(" \t\r", start);
+        words.push_back(line.substr(start, end - start));
+        if (end == string_view::npos) return;
+        line.remove_prefix(end);
+    }
+}
+
+// Function to parse the words of a non-blank command; false with a message in error if malformed
+bool parseCommand(const vector<string_view>& words, StockCommand& command, string& error) {
+    string_view name = words[0];
+    size_t argumentCount = words.size() - 1;
+    command.stock = StockData();
+    command.tickers.clear();
+    if (argumentCount) command.stock.ticker = string(words[1]);
+
+    if (name == "add" || name == "update") {
+        command.kind = name == "add" ? StockCommand::Add : StockCommand::Update;
+        if (argumentCount == 5 && parsePrice(words[2], command.stock.open)
+            && parsePrice(words[3], command.stock.dayHigh) && parsePrice(words[4], command.stock.dayLow)
+            && parsePrice(words[5], command.stock.lastPrice))
+            return true;
+        error = "expected " + string(name) + " <ticker> <open> <high> <low> <last>";
+    } else if (name == "get" && argumentCount > 1) {
+        command.kind = StockCommand::Get;
+        for (size_t i = 1; i < words.size(); ++i) command.tickers.emplace_back(words[i]);
+        return true;
+    } else if (name == "prefix") {
+        command.kind = StockCommand::Prefix;
+        command.count = 10;
+        if (argumentCount == 1 || (argumentCount == 2 && parseNumber(words[2], command.count) && command.count > 0))
+            return true;
+        error = "expected prefix <text> [count]";
+    } else if (name == "delete" || name == "get" || name == "predict") {
+        command.kind = name == "delete" ? StockCommand::Delete : name == "get" ? StockCommand::Get : StockCommand::Predict;
+        if (argumentCount == 1) return true;
+        error = "expected " + string(name) + " <ticker>";
+    } else if (name == "range") {
+        command.kind = StockCommand::Range;
+        size_t first = argumentCount == 3 ? 2 : 1;
+        int field = 0;
+        if (first == 2) field = int(find(begin(PRICE_FIELD_NAMES), end(PRICE_FIELD_NAMES), words[1]) - begin(PRICE_FIELD_NAMES));
+        command.field = PriceField(field);
+        if ((argumentCount == 2 || argumentCount == 3) && field < PRICE_FIELD_COUNT
+            && parseNumber(words[first], command.minPrice) && parseNumber(words[first + 1], command.maxPrice))
+            return true;
+        error = "expected range [last|open|high|low|change] <min> <max>";
+    } else if (name == "screen") {
+        // The screen is the rest of the line, spaces and all
+        command.kind = StockCommand::Screen;
+        string_view text;
+        if (argumentCount) text = string_view(words[1].data(), words.back().data() + words.back().size() - words[1].data());
+        if (command.screen.parse(text, error)) return true;
+    } else if (name == "high" || name == "low" || name == "stats") {
+        command.kind = name == "high" ? StockCommand::High : name == "low" ? StockCommand::Low : StockCommand::Stats;
+        if (argumentCount == 0) return true;
+        error = "expected " + string(name);
+    } else {
+        error = "unknown command " + string(name);
+    }
+    return false;
+}
+
+// Function to answer a read command (get, prefix, range, screen, high, low) from tree
+void answerQuery(StockTree& tree, const StockCommand& command, StockWriter& writer) {
+    if (command.kind == StockCommand::Get && !command.tickers.empty()) {
+        fetchMany(tree, command.tickers, writer);
+    } else if (command.kind == StockCommand::Get) {
+        fetchByName(tree, command.stock.ticker, writer);
+    } else if (command.kind == StockCommand::Prefix) {
+        fetchByPrefix(tree, command.stock.ticker, command.count, writer);
+    } else if (command.kind == StockCommand::Range) {
+        fetchByRange(tree, command.field, command.minPrice, command.maxPrice, writer);
+    } else if (command.kind == StockCommand::Screen) {
+        fetchByScreen(tree, command.screen, writer);
+    } else {
+        const StockData* stock = command.kind == StockCommand::High ? tree.highest() : tree.lowest();
+        if (stock)
+            writer.write(*stock);
+        else
+            writer.writeNote("No stocks loaded.");
+    }
+}
+
+// Function to apply a write command (add, update, delete) to tree; an update
+// keeps the stock's chart links
+void applyCommand(StockTree& tree, const StockCommand& command) {
+    if (command.kind == StockCommand::Add) {
+        tree.insert(command.stock);
+    } else if (command.kind == StockCommand::Delete) {
+        tree.deleteStock(command.stock.ticker);
+    } else if (const StockData* current = tree.find(command.stock.ticker)) {
+        StockData stock = command.stock;
+        stock.chartTodayPath = current->chartTodayPath;
+        stock.chart30DaysPath = current->chart30DaysPath;
+        stock.chart365DaysPath = current->chart365DaysPath;
+        tree.update(stock);
+    }
+}
+
+// Function to apply upserts and deletions to tree. Fewer changes than
+// MIN_BATCH_CHANGES are applied one by one, since applyBatch's sorting and
+// bookkeeping only pays off for larger batches.
+const size_t MIN_BATCH_CHANGES = 32;
+
+void applyStockChanges(StockTree& tree, vector<StockChange> changes) {
+    if (changes.size() >= MIN_BATCH_CHANGES) {
+        tree.applyBatch(move(changes));
+        return;
+    }
+    for (const auto& change : changes) {
+        if (change.remove)
+            tree.deleteStock(change.stock.ticker);
+        else if (tree.find(change.stock.ticker))
+            tree.update(change.stock);
+        else
+            tree.insert(change.stock);
+    }
+}
+
+// Headless request loop over the command language above. Writes are queued
+// and applied with one applyBatch when a read needs them, so a run of updates
+// is merged into the tree in a single pass. Responses are buffered and
+// flushed only when the input has nothing more waiting, so a client that
+// pipelines requests gets its responses back in large writes.
+class CommandSession {
+private:
+    static const size_t MAX_PENDING_CHANGES = 1 << 16;
+
+    StockTree& tree;
+    StockWriter& writer;
+    const string historyFile;
+    HistoryStore history;
+    bool historyLoaded;
+    vector<StockCommand> pending;
+    unordered_map<string, size_t> pendingByTicker;  // position of a ticker's last queued write
+    unordered_map<string, pair<size_t, double>> predictions;  // ticker -> (days, price)
+
+    // Function to tell whether ticker exists once the queued writes are applied
+    bool exists(const string& ticker) {
+        auto it = pendingByTicker.find(ticker);
+        if (it != pendingByTicker.end()) return pending[it->second].kind != StockCommand::Delete;
+        return tree.find(ticker) != nullptr;
+    }
+
+    // Function to queue a write, dropping adds of existing and updates of
+    // missing tickers so that the queue can be applied as upserts
+    void queue(StockCommand& command) {
+        bool present = exists(command.stock.ticker);
+        if ((command.kind == StockCommand::Add && present) || (command.kind == StockCommand::Update && !present))
+            return;
+        if (command.kind == StockCommand::Update) {
+            auto it = pendingByTicker.find(command.stock.ticker);
+            const StockData* current = it != pendingByTicker.end() ? &pending[it->second].stock
+                                                                  : tree.find(command.stock.ticker);
+            command.stock.chartTodayPath = current->chartTodayPath;
+            command.stock.chart30DaysPath = current->chart30DaysPath;
+            command.stock.chart365DaysPath = current->chart365DaysPath;
+        }
+        pendingByTicker[command.stock.ticker] = pending.size();
+        pending.push_back(command);
+        if (pending.size() >= MAX_PENDING_CHANGES) applyPending();
+    }
+
+    void predict(const string& ticker) {
+        auto cached = predictions.find(ticker);
+        if (cached == predictions.end()) {
+            if (!historyLoaded) {
+                history.load(historyFile);
+                historyLoaded = true;
+            }
+            if (!history.contains(ticker)) {
+                writer.writeNote("No history for " + ticker + ".");
+                return;
+            }
+            PriceModel model(PREDICTION_WINDOW_DAYS);
+            history.scanColumn(ticker, OhlcvField::Close, INT32_MIN, INT32_MAX,
+                               [&model](int32_t, double price) { model.addPrice(price); });
+            double price;
+            if (!model.predictNext(price)) price = NAN;
+            cached = predictions.emplace(ticker, make_pair(model.dayCount(), price)).first;
+        }
+        writer.writePrediction(ticker, cached->second.first, cached->second.second);
+    }
+
+public:
+    CommandSession(StockTree& tree, StockWriter& writer, const string& historyFile)
+        : tree(tree), writer(writer), historyFile(historyFile), historyLoaded(false) {}
+
+    // Function to apply the queued writes to the tree
+    void applyPending() {
+        vector<StockChange> changes;
+        changes.reserve(pending.size());
+        for (auto& command : pending) {
+            changes.push_back(StockChange{move(command.stock), command.kind == StockCommand::Delete});
+        }
+        applyStockChanges(tree, move(changes));
+        pending.clear();
+        pendingByTicker.clear();
+    }
+
+    // Function to run every command in input; returns the number of malformed commands
+    size_t run(istream& input) {
+        string line, error;
+        vector<string_view> words;
+        StockCommand command;
+        size_t lineNumber = 0, errors = 0;
+        while (getline(input, line)) {
+            ++lineNumber;
+            splitWords(line, words);
+            if (!words.empty() && words[0][0] != '#') {
+                if (!parseCommand(words, command, error)) {
+                    cerr << "Error: Line " << lineNumber << ": " << error << endl;
+                    ++errors;
+                } else if (command.writes()) {
+                    queue(command);
+                } else {
+                    applyPending();
+                    if (command.kind == StockCommand::Predict)
+                        predict(command.stock.ticker);
+                    else if (command.kind == StockCommand::Stats)
+                        writeStats(writer);
+                    else
+                        answerQuery(tree, command, writer);
+                }
+            }
+
+            // Nothing more is waiting, so the client may be waiting on us
+            if (input.rdbuf()->in_avail() <= 0) {
+                applyPending();
+                writer.flush();
+            }
+        }
+        applyPending();
+        writer.flush();
+        return errors;
+    }
+};
+
+// Bounded lock-free queue between exactly one producer thread and one
+// consumer thread. Each side keeps a copy of the other's index and reloads
+// it only when the queue looks full or empty, so a push or pop in the
+// steady state shares no cache line with the other side but the slot.
+template <typename T>
+class SpscQueue {
+private:
+    vector<T> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head;  // next slot to pop; written by the consumer
+    size_t cachedTail;                // the consumer's copy of tail
+    alignas(64) atomic<size_t> tail;  // next slot to push; written by the producer
+    size_t cachedHead;                // the producer's copy of head
+    alignas(64) atomic<bool> closed;
+
+    // Spins briefly, then yields, then sleeps, so a waiting stage gives up the core
+    static void backOff(int& attempts) {
+        if (++attempts < 64) return;
+        if (attempts < 1024)
+            this_thread::yield();
+        else
+            this_thread::sleep_for(chrono::microseconds(100));
+    }
+
+public:
+    explicit SpscQueue(size_t capacity) : head(0), cachedTail(0), tail(0), cachedHead(0), closed(false) {
+        size_t size = 1;
+        while (size < capacity) size *= 2;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side; false if the queue is full
+    bool tryPush(T& item) {
+        size_t position = tail.load(memory_order_relaxed);
+        if (position - cachedHead == slots.size()) {
+            cachedHead = head.load(memory_order_acquire);
+            if (position - cachedHead == slots.size()) return false;
+        }
+        slots[position & mask] = move(item);
+        tail.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    // Producer side; waits while the queue is full
+    void push(T item) {
+        for (int attempts = 0; !tryPush(item);) backOff(attempts);
+    }
+
+    // Producer side; nothing is pushed after this
+    void close() {
+        closed.store(true, memory_order_release);
+    }
+
+    // Consumer side; false if nothing is waiting
+    bool tryPop(T& item) {
+        size_t position = head.load(memory_order_relaxed);
+        if (position == cachedTail) {
+            cachedTail = tail.load(memory_order_acquire);
+            if (position == cachedTail) return false;
+        }
+        item = move(slots[position & mask]);
+        head.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer side; waits for the next item, false once the queue is closed and drained
+    bool pop(T& item) {
+        for (int attempts = 0;; backOff(attempts)) {
+            if (tryPop(item)) return true;
+            if (closed.load(memory_order_acquire)) return tryPop(item);
+        }
+    }
+
+    // Consumer side
+    bool empty() {
+        return head.load(memory_order_relaxed) == tail.load(memory_order_acquire);
+    }
+};
+
+// Function to turn a packed ticker key back into the ticker
+string unpackTicker(const TickerKey& key) {
+    string ticker;
+    for (size_t i = 0; i < MAX_PACKED_TICKER; ++i) {
+        char c = char((i < 8 ? key.hi : key.lo) >> (56 - 8 * (i % 8)));
+        if (!c) break;
+        ticker += c;
+    }
+    return ticker;
+}
+
+struct TickerKeyHash {
+    size_t operator()(const TickerKey& key) const {
+        uint64_t h = (key.hi ^ (key.lo * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+        return size_t(h ^ (h >> 32));
+    }
+};
+
+// One trade of the tick stream
+struct Tick {
+    TickerKey ticker;
+    float price;
+    uint64_t volume;
+    int64_t timestamp;  // milliseconds since the epoch
+};
+
+// Open-high-low-close bar of one symbol over one interval
+struct OhlcBar {
+    TickerKey ticker;
+    int64_t start;     // milliseconds since the epoch
+    int64_t interval;  // milliseconds
+    float open;
+    float high;
+    float low;
+    float close;
+    uint64_t volume;
+};
+
+// Day prices of a symbol after its latest ticks
+struct TickUpdate {
+    TickerKey ticker;
+    float open;
+    float high;
+    float low;
+    float last;
+};
+
+// What the aggregator hands to the apply stage at once: the symbols that
+// ticked since the previous publication, and the bars closed since then
+struct TickPublication {
+    vector<TickUpdate> updates;
+    vector<OhlcBar> bars;
+};
+
+// Bars are rolled up over 1 and 5 minutes
+const int64_t BAR_INTERVALS[] = {60000, 300000};
+const int BAR_INTERVAL_COUNT = 2;
+const int64_t MILLISECONDS_PER_DAY = 86400000;
+
+// Function to round a timestamp down to a multiple of step, also before the epoch
+int64_t floorToMultiple(int64_t timestamp, int64_t step) {
+    int64_t remainder = timestamp % step;
+    return timestamp - (remainder < 0 ? remainder + step : remainder);
+}
+
+// Function to parse one tick line, <ticker>,<price>,<volume>,<timestamp ms>;
+// false if the line is malformed
+bool parseTickLine(string_view line, Tick& tick) {
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    string_view fields[4];
+    for (int i = 0; i < 4; ++i) {
+        size_t comma = i < 3 ? line.find(',') : string_view::npos;
+        if (i < 3 && comma == string_view::npos) return false;
+        fields[i] = line.substr(0, comma);
+        if (i < 3) line.remove_prefix(comma + 1);
+    }
+    if (fields[0].empty() || fields[0].size() > MAX_PACKED_TICKER) return false;
+    if (!parsePrice(fields[1], tick.price) || !(tick.price > 0.0f) || !parseNumber(fields[2], tick.volume)
+        || !parseNumber(fields[3], tick.timestamp))
+        return false;
+    tick.ticker = packTicker(fields[0]);
+    return true;
+}
+
+// Function to write closed bars as CSV rows: ticker,interval,start,open,high,low,close,volume.
+// Rows are formatted with to_chars into one buffer, prices in their shortest form.
+void writeBars(ostream& out, const vector<OhlcBar>& bars) {
+    const size_t MAX_ROW_CHARS = MAX_PACKED_TICKER + 7 * 32;
+    string text(bars.size() * MAX_ROW_CHARS, '\0');
+    char* p = text.data();
+    for (const auto& bar : bars) {
+        string ticker = unpackTicker(bar.ticker);
+        p = copy(ticker.begin(), ticker.end(), p);
+        *p++ = ',';
+        p = to_chars(p, p + 32, bar.interval / 60000).ptr;
+        p = copy_n("m,", 2, p);
+        p = to_chars(p, p + 32, bar.start).ptr;
+        for (float price : {bar.open, bar.high, bar.low, bar.close}) {
+            *p++ = ',';
+            p = to_chars(p, p + 32, price).ptr;
+        }
+        *p++ = ',';
+        p = to_chars(p, p + 32, bar.volume).ptr;
+        *p++ = '\n';
+    }
+    out.write(text.data(), p - text.data());
+}
+
+// Function to publish tick updates into tree in one batch; stocks already in
+// the tree keep their chart links
+void applyTickUpdates(StockTree& tree, const vector<TickUpdate>& updates) {
+    vector<string> tickers;
+    tickers.reserve(updates.size());
+    for (const auto& update : updates) tickers.push_back(unpackTicker(update.ticker));
+    vector<const StockData*> current;
+    tree.getMany(tickers, current);
+
+    vector<StockChange> changes(updates.size());
+    for (size_t i = 0; i < updates.size(); ++i) {
+        StockData& stock = changes[i].stock;
+        if (current[i]) stock = *current[i];
+        stock.ticker = move(tickers[i]);
+        stock.open = updates[i].open;
+        stock.dayHigh = updates[i].high;
+        stock.dayLow = updates[i].low;
+        stock.lastPrice = updates[i].last;
+        changes[i].remove = false;
+    }
+    applyStockChanges(tree, move(changes));
+}
+
+// Replays a stream of trades from a file, a pipe or stdin ("-"), one per line:
+//   <ticker>,<price>,<volume>,<timestamp in milliseconds since the epoch>
+// Three stages run on their own threads, joined by SPSC queues. The reader
+// parses lines into batches of ticks. The aggregator keeps each symbol's
+// day open, high, low and last price and its 1-minute and 5-minute bars.
+// The caller's thread applies what the aggregator publishes. A symbol
+// seeded from the tree keeps its day open until a tick on a later day;
+// a late tick is folded into the bar in progress. The aggregator publishes
+// whenever its input queue runs dry, or every PUBLISH_TICKS ticks under
+// load, so the tree sees one coalesced change per symbol per publication.
+class TickReplay {
+private:
+    static const size_t TICK_BATCH = 4096;
+    static const size_t QUEUE_BATCHES = 64;
+    static const size_t PUBLISH_TICKS = 1 << 16;
+    static const size_t READ_CHUNK = 1 << 20;
+    static const size_t MAX_LINE_BYTES = 256;
+    static constexpr int64_t NO_DAY = numeric_limits<int64_t>::min();
+
+    struct Symbol {
+        TickerKey ticker;
+        int64_t day;  // day of the latest tick; NO_DAY for a seeded symbol without ticks
+        float open;
+        float high;
+        float low;
+        float last;
+        OhlcBar bars[BAR_INTERVAL_COUNT];  // bars in progress; volume 0 and start NO_DAY when none
+        bool dirty;
+    };
+
+    string source;
+    vector<Symbol> symbols;
+    unordered_map<TickerKey, uint32_t, TickerKeyHash> symbolIndex;
+    vector<uint32_t> dirtySymbols;
+    ParseReport report;
+    size_t tickCount;
+    size_t barCount;
+    size_t publicationCount;
+#ifdef _WIN32
+    FILE* input;
+#else
+    int input;
+#endif
+
+    bool openInput() {
+#ifdef _WIN32
+        input = source == "-" ? stdin : fopen(source.c_str(), "rb");
+        return input != nullptr;
+#else
+        input = source == "-" ? STDIN_FILENO : ::open(source.c_str(), O_RDONLY);
+        return input >= 0;
+#endif
+    }
+
+    void closeInput() {
+#ifdef _WIN32
+        if (input != stdin) fclose(input);
+#else
+        if (input != STDIN_FILENO) ::close(input);
+#endif
+    }
+
+    // Reads up to capacity bytes; 0 at the end of the stream or once stop is set
+    size_t readInput(char* buffer, size_t capacity, const atomic<bool>& stop) {
+#ifdef _WIN32
+        return stop.load() ? 0 : fread(buffer, 1, capacity, input);
+#else
+        while (!stop.load()) {
+#ifdef __linux__
+            // A quiet pipe must not keep the replay from stopping
+            pollfd ready = {input, POLLIN, 0};
+            if (poll(&ready, 1, 250) == 0) continue;
+#endif
+            ssize_t count = ::read(input, buffer, capacity);
+            if (count >= 0) return size_t(count);
+            if (errno != EINTR) return 0;
+        }
+        return 0;
+#endif
+    }
+
+    Symbol& symbolFor(const TickerKey& ticker, float price) {
+        auto found = symbolIndex.try_emplace(ticker, uint32_t(symbols.size()));
+        if (found.second) {
+            Symbol symbol;
+            symbol.ticker = ticker;
+            symbol.day = NO_DAY;
+            symbol.open = symbol.high = symbol.low = symbol.last = price;
+            for (int i = 0; i < BAR_INTERVAL_COUNT; ++i) symbol.bars[i] = OhlcBar{ticker, NO_DAY, BAR_INTERVALS[i], 0, 0, 0, 0, 0};
+            symbol.dirty = false;
+            symbols.push_back(symbol);
+        }
+        return symbols[found.first->second];
+    }
+
+    // Reader stage: parses the stream into batches of ticks
+    void readTicks(SpscQueue<vector<Tick>>& ticks, const atomic<bool>& stop) {
+        vector<char> buffer(READ_CHUNK + MAX_LINE_BYTES);
+        vector<Tick> batch;
+        batch.reserve(TICK_BATCH);
+        size_t kept = 0;  // bytes of an unfinished line at the front of buffer
+        size_t lineNumber = 0;
+        bool skipping = false;  // inside a line too long to keep
+        Tick tick;
+
+        auto parseLine = [&](string_view line) {
+            ++lineNumber;
+            if (line.empty() || (line.size() == 1 && line[0] == '\r')) return;
+            if (parseTickLine(line, tick)) {
+                batch.push_back(tick);
+                if (batch.size() == TICK_BATCH) {
+                    ticks.push(move(batch));
+                    batch = vector<Tick>();
+                    batch.reserve(TICK_BATCH);
+                }
+            } else if (lineNumber > 1) {  // the first line may be a header
+                report.reject(lineNumber);
+            }
+        };
+
+        while (size_t count = readInput(buffer.data() + kept, READ_CHUNK, stop)) {
+            const char* p = buffer.data();
+            const char* end = p + kept + count;
+            if (skipping) {
+                const char* newline = static_cast<const char*>(memchr(p, '\n', size_t(end - p)));
+                p = newline ? newline + 1 : end;
+                skipping = !newline;
+            }
+            while (const char* newline = static_cast<const char*>(memchr(p, '\n', size_t(end - p)))) {
+                parseLine(string_view(p, size_t(newline - p)));
+                p = newline + 1;
+            }
+            kept = size_t(end - p);
+            if (kept > MAX_LINE_BYTES) {
+                report.reject(++lineNumber);
+                kept = 0;
+                skipping = true;
+            }
+            memmove(buffer.data(), p, kept);
+
+            // Hand over what this read produced, so a slow feed is not held back
+            if (!batch.empty()) {
+                ticks.push(move(batch));
+                batch = vector<Tick>();
+                batch.reserve(TICK_BATCH);
+            }
+        }
+        if (kept && !stop.load()) parseLine(string_view(buffer.data(), kept));
+        if (!batch.empty()) ticks.push(move(batch));
+        ticks.close();
+    }
+
+    void addTick(const Tick& tick, vector<OhlcBar>& closedBars) {
+        Symbol& symbol = symbolFor(tick.ticker, tick.price);
+        int64_t day = floorToMultiple(tick.timestamp, MILLISECONDS_PER_DAY);
+        if (symbol.day != NO_DAY && day > symbol.day) symbol.open = symbol.high = symbol.low = tick.price;
+        symbol.day = max(symbol.day, day);
+        symbol.high = max(symbol.high, tick.price);
+        symbol.low = min(symbol.low, tick.price);
+        symbol.last = tick.price;
+        if (!symbol.dirty) {
+            symbol.dirty = true;
+            dirtySymbols.push_back(uint32_t(&symbol - symbols.data()));
+        }
+
+        for (OhlcBar& bar : symbol.bars) {
+            int64_t start = floorToMultiple(tick.timestamp, bar.interval);
+            if (start > bar.start) {
+                if (bar.start != NO_DAY) {
+                    closedBars.push_back(bar);
+                    ++barCount;
+                }
+                bar.start = start;
+                bar.open = bar.high = bar.low = bar.close = tick.price;
+                bar.volume = tick.volume;
+                continue;
+            }
+            bar.high = max(bar.high, tick.price);
+            bar.low = min(bar.low, tick.price);
+            bar.close = tick.price;
+            bar.volume += tick.volume;
+        }
+    }
+
+    void collectUpdates(TickPublication& publication) {
+        publication.updates.reserve(dirtySymbols.size());
+        for (uint32_t index : dirtySymbols) {
+            Symbol& symbol = symbols[index];
+            publication.updates.push_back({symbol.ticker, symbol.open, symbol.high, symbol.low, symbol.last});
+            symbol.dirty = false;
+        }
+        dirtySymbols.clear();
+    }
+
+    // Aggregator stage: folds ticks into the symbols and publishes the changes
+    void aggregate(SpscQueue<vector<Tick>>& ticks, SpscQueue<TickPublication>& publications) {
+        vector<Tick> batch;
+        TickPublication pending;
+        size_t unpublished = 0;
+        while (ticks.pop(batch)) {
+            for (const Tick& tick : batch) addTick(tick, pending.bars);
+            tickCount += batch.size();
+            unpublished += batch.size();
+            if (unpublished >= PUBLISH_TICKS || ticks.empty()) {
+                collectUpdates(pending);
+                publications.push(move(pending));
+                pending = TickPublication();
+                unpublished = 0;
+            }
+        }
+
+        // The stream is over: close the bars in progress
+        for (Symbol& symbol : symbols) {
+            for (OhlcBar& bar : symbol.bars) {
+                if (bar.start == NO_DAY) continue;
+                pending.bars.push_back(bar);
+                ++barCount;
+                bar.start = NO_DAY;
+            }
+        }
+        collectUpdates(pending);
+        if (!pending.updates.empty() || !pending.bars.empty()) publications.push(move(pending));
+        publications.close();
+    }
+
+public:
+    explicit TickReplay(const string& source)
+        : source(source), tickCount(0), barCount(0), publicationCount(0) {}
+
+    // Starts a symbol from the tree's day prices before any of its ticks
+    void seed(const StockData& stock) {
+        if (stock.ticker.size() > MAX_PACKED_TICKER) return;
+        Symbol& symbol = symbolFor(packTicker(stock.ticker), stock.lastPrice);
+        symbol.open = stock.open;
+        symbol.high = stock.dayHigh;
+        symbol.low = stock.dayLow;
+        symbol.last = stock.lastPrice;
+    }
+
+    // Replays the whole stream, or until stop is set, calling
+    // apply(TickPublication&) on this thread for every publication. False if
+    // the stream could not be opened.
+    template <typename Apply>
+    bool run(Apply apply, const atomic<bool>& stop) {
+        if (!openInput()) {
+            cerr << "Error: Could not open the tick stream " << source << endl;
+            return false;
+        }
+        SpscQueue<vector<Tick>> ticks(QUEUE_BATCHES);
+        SpscQueue<TickPublication> publications(QUEUE_BATCHES);
+        thread reader([this, &ticks, &stop] { readTicks(ticks, stop); });
+        thread aggregator([this, &ticks, &publications] { aggregate(ticks, publications); });
+
+        TickPublication publication;
+        while (publications.pop(publication)) {
+            STOCK_STATS_ONLY(ScopedLatency timer(stockStats.tickPublish);)
+            apply(publication);
+            ++publicationCount;
+        }
+        reader.join();
+        aggregator.join();
+        closeInput();
+
+        report.print(source);
+        STOCK_STATS_ONLY(stockStats.ticks.add(tickCount); stockStats.ticksRejected.add(report.count());
+                         stockStats.tickBars.add(barCount);)
+        return true;
+    }
+
+    size_t ticks() const {
+        return tickCount;
+    }
+
+    size_t bars() const {
+        return barCount;
+    }
+
+    size_t publications() const {
+        return publicationCount;
+    }
+
+    size_t symbolCount() const {
+        return symbols.size();
+    }
+};
+
+#ifdef __linux__
+// What a reload changed in the tree
+struct ReloadCounts {
+    size_t added;
+    size_t updated;
+    size_t deleted;
 };
 
-// AVL Tree for managing stock data
-class AVLTree {
+// Keeps a tree in step with a livestock CSV file that upstream rewrites,
+// in place or by renaming a new file over it. inotify on the file's
+// directory reports the rewrite. scan() hashes every line and pairs the
+// hashes with the previous scan's, so only added and removed lines are
+// parsed and looked up by ticker: the work beyond hashing the file scales
+// with the number of changed rows, and unchanged stocks keep their nodes.
+// Tickers that disappeared from the file are deleted. A stock edited
+// through the menu or the server keeps the edit until the file changes
+// its row.
+class StockFileWatcher {
 private:
-    AVLTreeNode* root;
+    // How far ahead pairing looks for the line after a block of added or removed lines
+    static const size_t RESYNC_LINES = 8;
 
-    int height(AVLTreeNode* node) {
-        return node ? node->height : 0;
-    }
+    typedef unordered_map<string, uint32_t> LineCounts;  // lines per ticker, usually one
+    typedef LineCounts::value_type TickerLines;
 
-    int balanceFactor(AVLTreeNode* node) {
-        return node ? height(node->left) - height(node->right) : 0;
-    }
+    struct Line {
+        uint64_t hash;
+        size_t offset;
+        size_t length;
+        size_t lineNumber;
+        TickerLines* ticker;
+    };
 
-    AVLTreeNode* rotateRight(AVLTreeNode* y) {
-        AVLTreeNode* x = y->left;
-        AVLTreeNode* T2 = x->right;
-        x->right = y;
-        y->left = T2;
-        y->height = max(height(y->left), height(y->right)) + 1;
-        x->height = max(height(x->left), height(x->right)) + 1;
-        return x;
+    // Lines of a ticker added or removed by a rewrite
+    struct Touched {
+        const Line* added;  // the first added line
+        uint32_t addedCount;
+    };
+
+    string filePath;
+    string fileName;
+    int inotifyFd;
+    LineCounts lineCounts;
+    vector<Line> lines;  // lines of the last scan, in file order
+    vector<string> tracked;  // tickers in the tree before the first scan
+
+    static bool sameStock(const StockData& a, const StockData& b) {
+        return a.open == b.open && a.dayHigh == b.dayHigh && a.dayLow == b.dayLow && a.lastPrice == b.lastPrice
+               && a.chartTodayPath == b.chartTodayPath && a.chart30DaysPath == b.chart30DaysPath
+               && a.chart365DaysPath == b.chart365DaysPath;
     }
 
-    AVLTreeNode* rotateLeft(AVLTreeNode* x) {
-        AVLTreeNode* y = x->right;
-        AVLTreeNode* T2 = y->left;
-        y->left = x;
-        x->right = T2;
-        x->height = max(height(x->left), height(x->right)) + 1;
-        y->height = max(height(y->left), height(y->right)) + 1;
-        return y;
+    // The ticker is the second field; empty if the line has fewer fields
+    static string_view tickerOf(const char* line, size_t length) {
+        string_view text(line, length);
+        size_t begin = text.find(',');
+        size_t end = begin == string_view::npos ? begin : text.find(',', begin + 1);
+        return end == string_view::npos ? string_view() : text.substr(begin + 1, end - begin - 1);
     }
 
-   AVLTreeNode* insert(AVLTreeNode* node, const StockData& stockData) {
-        if (!node) return new AVLTreeNode(stockData);
+    static StockChange deletion(const string& ticker) {
+        StockChange change = {StockData(), true};
+        change.stock.ticker = ticker;
+        return change;
+    }
 
-        if (stockData.ticker < node->stock.ticker)
-            node->left = insert(node->left, stockData);
-        else if (stockData.ticker > node->stock.ticker)
-            node->right = insert(node->right, stockData);
+    static void parseLine(const MappedFile& file, const Line& line, vector<StockChange>& changes, ParseReport& report) {
+        CsvReader reader(file.begin() + line.offset, file.begin() + line.offset + line.length);
+        CsvRow row;
+        StockChange change = {StockData(), false};
+        if (reader.next(row) && parseStockRow(row, change.stock))
+            changes.push_back(move(change));
         else
-            return node;
+            report.reject(line.lineNumber);
+    }
 
-        node->height = 1 + max(height(node->left), height(node->right));
-        int balance = balanceFactor(node);
+public:
+    explicit StockFileWatcher(const string& filePath)
+        : filePath(filePath), fileName(filesystem::path(filePath).filename().string()), inotifyFd(-1) {}
 
-        if (balance > 1 && stockData.ticker < node->left->stock.ticker)
-            return rotateRight(node);
-        if (balance < -1 && stockData.ticker > node->right->stock.ticker)
-            return rotateLeft(node);
-        if (balance > 1 && stockData.ticker > node->left->stock.ticker) {
-            node->left = rotateLeft(node->left);
-            return rotateRight(node);
-        }
-        if (balance < -1 && stockData.ticker < node->right->stock.ticker) {
-            node->right = rotateRight(node->right);
-            return rotateLeft(node);
-        }
-        return node;
+    ~StockFileWatcher() {
+        if (inotifyFd >= 0) close(inotifyFd);
     }
 
-    AVLTreeNode* update(AVLTreeNode* node, const StockData& stockData) {
-        if (!node) return nullptr;
+    StockFileWatcher(const StockFileWatcher&) = delete;
+    StockFileWatcher& operator=(const StockFileWatcher&) = delete;
 
-        if (stockData.ticker < node->stock.ticker) {
-            node->left = update(node->left, stockData);
-        } else if (stockData.ticker > node->stock.ticker) {
-            node->right = update(node->right, stockData);
-        } else {
-            node->stock = stockData;
+    // Function to start watching; track(visit) must call visit(stock) for the
+    // stocks now in the tree, which the first scan deletes if the file no
+    // longer has them. False on error.
+    template <typename Track>
+    bool start(Track track) {
+        string directory = filesystem::path(filePath).parent_path().string();
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd < 0
+            || inotify_add_watch(inotifyFd, directory.empty() ? "." : directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            cerr << "Error: Could not watch " << filePath << ": " << strerror(errno) << endl;
+            return false;
         }
-
-        return node;
+        track([this](const StockData& stock) { tracked.push_back(stock.ticker); });
+        return true;
     }
 
+    // Function to wait up to timeoutMs (0 = just check) for the file to be
+    // rewritten; true if it was, with the pending events drained
+    bool wait(int timeoutMs) {
+        pollfd events = {inotifyFd, POLLIN, 0};
+        if (poll(&events, 1, timeoutMs) <= 0) return false;
 
-    AVLTreeNode* minNode(AVLTreeNode* node) {
-        AVLTreeNode* current = node;
-        while (current && current->left) {
-            current = current->left;
+        bool rewritten = false;
+        alignas(inotify_event) char buffer[4096];
+        ssize_t length;
+        while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + length;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+                if (event->len && fileName == event->name) rewritten = true;
+                p += sizeof(inotify_event) + event->len;
+            }
         }
-        return current;
+        return rewritten;
     }
 
-    AVLTreeNode* deleteNode(AVLTreeNode* node, const string& ticker) {
-        if (!node) return node;
+    // Function to read the file and list the rows added, changed or removed
+    // since the last scan; false if the file cannot be read
+    bool scan(vector<StockChange>& changes) {
+        MappedFile file;
+        if (!file.open(filePath)) {
+            cerr << "Error: Could not open the file " << filePath << endl;
+            return false;
+        }
 
-        if (ticker < node->stock.ticker)
-            node->left = deleteNode(node->left, ticker);
-        else if (ticker > node->stock.ticker)
-            node->right = deleteNode(node->right, ticker);
-        else {
-            if (!node->left) {
-                AVLTreeNode* temp = node->right;
-                delete node;
-                return temp;
-            } else if (!node->right) {
-                AVLTreeNode* temp = node->left;
-                delete node;
-                return temp;
+        vector<Line> current;
+        current.reserve(lines.size());
+        const char* body = static_cast<const char*>(memchr(file.begin(), '\n', file.size()));
+        size_t lineNumber = 2;  // the header is line 1
+        for (const char* line = body ? body + 1 : file.end(); line < file.end(); ++lineNumber) {
+            const char* newline = static_cast<const char*>(memchr(line, '\n', size_t(file.end() - line)));
+            const char* lineEnd = newline ? newline : file.end();
+            size_t length = size_t(lineEnd - line) - (lineEnd > line && lineEnd[-1] == '\r');
+            if (length) {
+                current.push_back(Line{snapshotChecksum(line, length), size_t(line - file.begin()), length,
+                                       lineNumber, nullptr});
             }
+            line = newline ? newline + 1 : file.end();
+        }
 
-            AVLTreeNode* temp = minNode(node->right);
-            node->stock = temp->stock;
-            node->right = deleteNode(node->right, temp->stock.ticker);
+        // Pair identical lines, first in file order while the two files run in
+        // step, skipping short blocks of added or removed lines, then through
+        // the sorted hashes of the rest so that lines that only moved pair too
+        vector<Line*> addedLines;
+        vector<const Line*> removedLines;
+        size_t old = 0, now = 0;
+        while (old < lines.size() && now < current.size()) {
+            if (lines[old].hash == current[now].hash) {
+                current[now++].ticker = lines[old++].ticker;
+                continue;
+            }
+            size_t removed = 1, added = 1;
+            for (size_t d = 1; d <= RESYNC_LINES; ++d) {
+                if (old + d < lines.size() && lines[old + d].hash == current[now].hash) {
+                    removed = d;
+                    added = 0;
+                    break;
+                }
+                if (now + d < current.size() && current[now + d].hash == lines[old].hash) {
+                    removed = 0;
+                    added = d;
+                    break;
+                }
+            }
+            for (; removed; --removed) removedLines.push_back(&lines[old++]);
+            for (; added; --added) addedLines.push_back(&current[now++]);
         }
+        for (; old < lines.size(); ++old) removedLines.push_back(&lines[old]);
+        for (; now < current.size(); ++now) addedLines.push_back(&current[now]);
 
-        node->height = 1 + max(height(node->left), height(node->right));
-        int balance = balanceFactor(node);
+        auto byHash = [](const Line* a, const Line* b) { return a->hash < b->hash; };
+        sort(removedLines.begin(), removedLines.end(), byHash);
+        sort(addedLines.begin(), addedLines.end(), byHash);
 
-        if (balance > 1 && balanceFactor(node->left) >= 0)
-            return rotateRight(node);
-        if (balance > 1 && balanceFactor(node->left) < 0) {
-            node->left = rotateLeft(node->left);
-            return rotateRight(node);
-        }
-        if (balance < -1 && balanceFactor(node->right) <= 0)
-            return rotateLeft(node);
-        if (balance < -1 && balanceFactor(node->right) > 0) {
-            node->right = rotateRight(node->right);
-            return rotateLeft(node);
+        // The tickers of lines left unpaired are the ones to look at
+        unordered_map<TickerLines*, Touched> touched;
+        size_t r = 0, a = 0;
+        while (r < removedLines.size() || a < addedLines.size()) {
+            if (a == addedLines.size() || (r < removedLines.size() && removedLines[r]->hash < addedLines[a]->hash)) {
+                TickerLines* ticker = removedLines[r++]->ticker;
+                --ticker->second;
+                touched.emplace(ticker, Touched{nullptr, 0});
+            } else if (r == removedLines.size() || addedLines[a]->hash < removedLines[r]->hash) {
+                Line& line = *addedLines[a++];
+                string_view ticker = tickerOf(file.begin() + line.offset, line.length);
+                line.ticker = &*lineCounts.emplace(string(ticker), 0).first;
+                ++line.ticker->second;
+                Touched& touch = touched.emplace(line.ticker, Touched{nullptr, 0}).first->second;
+                if (!touch.addedCount++ || line.lineNumber < touch.added->lineNumber) touch.added = &line;
+            } else {
+                addedLines[a++]->ticker = removedLines[r++]->ticker;
+            }
         }
 
-        return node;
-    }
+        // A ticker left with one line that was just added takes that row, one
+        // without lines is deleted, and one with several lines (or with only
+        // an old duplicate left) takes its first line in file order, like
+        // loadStockData
+        ParseReport report;
+        unordered_map<TickerLines*, const Line*> firstLines;
+        for (const auto& entry : touched) {
+            TickerLines* ticker = entry.first;
+            if (ticker->second == 0) {
+                changes.push_back(deletion(ticker->first));
+                lineCounts.erase(ticker->first);
+            } else if (ticker->second == 1 && entry.second.addedCount == 1) {
+                parseLine(file, *entry.second.added, changes, report);
+            } else {
+                firstLines.emplace(ticker, nullptr);
+            }
+        }
+        if (!firstLines.empty()) {
+            for (const auto& line : current) {
+                auto it = firstLines.find(line.ticker);
+                if (it != firstLines.end() && (!it->second || line.lineNumber < it->second->lineNumber))
+                    it->second = &line;
+            }
+            for (const auto& entry : firstLines) parseLine(file, *entry.second, changes, report);
+        }
+        report.print(filePath);
 
-    void printInOrder(AVLTreeNode* node) {
-        if (!node) return;
-        printInOrder(node->left);
-        cout << "Ticker: " << node->stock.ticker
-             << ", Open: " << node->stock.open
-             << ", Day High: " << node->stock.dayHigh
-             << ", Day Low: " << node->stock.dayLow
-             << ", Last Price: " << node->stock.lastPrice << endl;
-        printInOrder(node->right);
+        for (const auto& ticker : tracked) {
+            if (!lineCounts.count(ticker)) changes.push_back(deletion(ticker));
+        }
+        tracked.clear();
+        lines = move(current);
+        return true;
     }
 
-public:
-    AVLTree() : root(nullptr) {}
-
-    void insert(const StockData& stockData) {
-        root = insert(root, stockData);
+    // Function to drop the changes that would leave tree as it is and count
+    // the rest; call with the tree the changes are then applied to
+    static ReloadCounts filter(StockTree& tree, vector<StockChange>& changes) {
+        ReloadCounts counts = {0, 0, 0};
+        size_t kept = 0;
+        for (auto& change : changes) {
+            const StockData* current = tree.find(change.stock.ticker);
+            if (change.remove ? !current : current && sameStock(*current, change.stock)) continue;
+            if (change.remove)
+                ++counts.deleted;
+            else if (current)
+                ++counts.updated;
+            else
+                ++counts.added;
+            if (&changes[kept] != &change) changes[kept] = move(change);
+            ++kept;
+        }
+        changes.resize(kept);
+        return counts;
     }
 
-    void update(const StockData& stockData) {
-        root = update(root, stockData);
+    // Function to apply the file's changes since the last scan to tree;
+    // false if the file could not be read
+    bool reload(StockTree& tree, ReloadCounts& counts) {
+        vector<StockChange> changes;
+        if (!scan(changes)) return false;
+        counts = filter(tree, changes);
+        applyStockChanges(tree, move(changes));
+        return true;
     }
 
-    void deleteStock(const string& ticker) {
-        root = deleteNode(root, ticker);
+    // Same for a tree shared with readers; all changes are published at once
+    bool reload(ConcurrentStockTree& tree, ReloadCounts& counts) {
+        vector<StockChange> changes;
+        if (!scan(changes)) return false;
+        tree.read([&](StockTree& live) { counts = filter(live, changes); });
+        if (!changes.empty()) tree.write([&changes](StockTree& copy) { applyStockChanges(copy, changes); });
+        return true;
     }
+};
 
-    void printTree() {
-        printInOrder(root);
-    }
+// Function to print what a reload of filePath changed; silent if nothing did
+void printReload(const string& filePath, const ReloadCounts& counts) {
+    if (!counts.added && !counts.updated && !counts.deleted) return;
+    cout << "Reloaded " << filePath << ": " << counts.added << " added, " << counts.updated << " updated, "
+         << counts.deleted << " deleted." << endl;
+}
 
-    AVLTreeNode* getRoot() {
-        return root;
-    }
+// Where the query server listens: a TCP port on the loopback interface, or a Unix socket path
+struct ServerAddress {
+    bool unixSocket;
+    uint16_t port;
+    string path;
 };
 
-// Function to load stock data and chart links from a CSV file
-void loadStockData(const string& filePath, vector<StockData>& stockList) {
-    ifstream file(filePath);
-    if (!file.is_open()) {
-        cerr << "Error: Could not open the file " << filePath << endl;
-        return;
-    }
+// Function to read a port number or, for anything else, a Unix socket path
+ServerAddress parseServerAddress(const string& text) {
+    ServerAddress address{false, 0, ""};
+    int port;
+    if (parseNumber(text, port) && port > 0 && port < 65536)
+        address.port = uint16_t(port);
+    else
+        address = ServerAddress{true, 0, text};
+    return address;
+}
 
-    string line;
-    bool isHeader = true;
-    while (getline(file, line)) {
-        if (isHeader) {
-            isHeader = false;
-            continue;
+// Function to open a socket bound and listening on address (listening) or
+// connected to it; returns -1 and prints why on failure
+int openSocket(const ServerAddress& address, bool listening) {
+    sockaddr_storage storage = {};
+    socklen_t length;
+    if (address.unixSocket) {
+        sockaddr_un* local = reinterpret_cast<sockaddr_un*>(&storage);
+        if (address.path.size() >= sizeof(local->sun_path)) {
+            cerr << "Error: Socket path " << address.path << " is too long." << endl;
+            return -1;
         }
+        local->sun_family = AF_UNIX;
+        memcpy(local->sun_path, address.path.c_str(), address.path.size() + 1);
+        length = sizeof(sockaddr_un);
+    } else {
+        sockaddr_in* inet = reinterpret_cast<sockaddr_in*>(&storage);
+        inet->sin_family = AF_INET;
+        inet->sin_port = htons(address.port);
+        inet->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        length = sizeof(sockaddr_in);
+    }
 
-        stringstream ss(line);
-        string token;
-        string ticker, chartLinkToday, chartLink30Days, chartLink365Days;
-        float open = 0.0f, dayHigh = 0.0f, dayLow = 0.0f, lastPrice = 0.0f;
+    int fd = socket(address.unixSocket ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int on = 1;
+    bool opened;
+    if (listening) {
+        if (address.unixSocket)
+            unlink(address.path.c_str());
+        else
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        opened = bind(fd, reinterpret_cast<sockaddr*>(&storage), length) == 0 && listen(fd, SOMAXCONN) == 0;
+    } else {
+        opened = connect(fd, reinterpret_cast<sockaddr*>(&storage), length) == 0;
+        if (opened && !address.unixSocket) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    if (!opened) {
+        cerr << "Error: Could not " << (listening ? "listen on " : "connect to ")
+             << (address.unixSocket ? address.path : "port " + to_string(address.port)) << ": " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-        int column = 0;
-        while (getline(ss, token, ',')) {
-            switch (column) {
-                case 1:
-                    ticker = token;
-                    break;
-                case 3:
-                    open = stof(token);
-                    break;
-                case 4:
-                    dayHigh = stof(token);
-                    break;
-                case 5:
-                    dayLow = stof(token);
-                    break;
-                case 6:
-                    lastPrice = stof(token);
-                    break;
-                case 23:
-                    chartLink30Days = token; // 30-day chart link
-                    break;
-                case 24:
-                    chartLinkToday = token;  // Today's chart link
-                    break;
-                case 20:
-                    chartLink365Days = token; // 365-day chart link
-                    break;
-            }
-            column++;
-        }
+// Long-lived query service over the stock index. Clients send commands of
+// the request language (predict excepted), one per line, and may pipeline
+// as many as they like; every request is answered, in order, by its rows
+// followed by an empty line. Each I/O thread runs its own epoll loop and
+// accepts from the shared listening socket. Reads go to the live copy of a
+// ConcurrentStockTree without blocking; the writes found in one chunk of a
+// connection's input are published together. Responses are formatted
+// straight into the connection's output buffer and sent from it.
+class StockServer {
+private:
+    static const size_t READ_CHUNK = 1 << 16;
+    static const size_t MAX_LINE_BYTES = 1 << 16;
+    static const size_t MAX_BACKLOG = 1 << 20;  // unsent response bytes before reading pauses
 
-        if (!ticker.empty()) {
-            stockList.push_back({ticker, open, dayHigh, dayLow, lastPrice, chartLinkToday, chartLink30Days, chartLink365Days});
-        } else {
-            cerr << "Invalid data in line: " << line << endl;
-        }
-    }
+    struct Connection {
+        int fd;
+        string input;  // bytes after the last complete line
+        StockWriter output;
+        uint32_t interest;  // epoll events currently registered
+        bool inputClosed;
 
-    file.close();
-}
+        Connection(int fd, OutputFormat format) : fd(fd), output(format), interest(0), inputClosed(false) {}
+    };
 
-// Function to open URL in default browser
-void openURL(const string& url) {
-  system(("start " + url).c_str());
-}
+    ConcurrentStockTree& tree;
+    OutputFormat format;
+    int listenFd;
+    bool unixSocket;
+    int stopPipe[2];
+    vector<thread> workers;
+    atomic<long long> requests;
 
-// Function to visualize stock chart by ticker
-void visualize(const string& filePath, const string& ticker) {
-    ifstream file(filePath);
-    if (!file.is_open()) {
-        cerr << "Error: Could not open the file " << filePath << endl;
-        return;
+    void publish(vector<StockCommand>& writes) {
+        if (writes.empty()) return;
+        tree.write([&writes](StockTree& copy) {
+            for (const auto& command : writes) applyCommand(copy, command);
+        });
+        writes.clear();
     }
 
-    string line;
-    bool isHeader = true;
-    while (getline(file, line)) {
-        if (isHeader) {
-            isHeader = false;
-            continue;
-        }
+    // Function to answer every complete line read so far; false on EOF or a read error
+    bool readRequests(Connection& connection) {
+        size_t old = connection.input.size();
+        connection.input.resize(old + READ_CHUNK);
+        ssize_t received = read(connection.fd, &connection.input[old], READ_CHUNK);
+        connection.input.resize(old + size_t(max<ssize_t>(received, 0)));
+        if (received == 0) return false;
+        if (received < 0) return errno == EAGAIN || errno == EINTR;
 
-        stringstream ss(line);
-        string token;
-        string stockTicker, chartLinkToday, chartLink30Days, chartLink365Days;
-        int column = 0;
-
-        while (getline(ss, token, ',')) {
-            if (column == 1) stockTicker = token;
-            else if (column == 25) chartLinkToday = token;   // Column 24 - Today's Chart
-            else if (column == 24) chartLink30Days = token;  // Column 23 - 30 Days Chart
-            else if (column == 21) chartLink365Days = token; // Column 20 - 365 Days Chart
-            column++;
-        }
-
-        if (stockTicker == ticker) {
-            int chartChoice;
-            cout << "\nWhich chart do you want to visualize?\n";
-            cout << "1. Today's Chart\n";
-            cout << "2. 30-Day Chart\n";
-            cout << "3. 365-Day Chart\n";
-            cout << "Enter your choice: ";
-            cin >> chartChoice;
-
-            string chartLink;
-            switch (chartChoice) {
-                case 1:
-                    chartLink = chartLinkToday;
-                    break;
-                case 2:
-                    chartLink = chartLink30Days;
-                    break;
-                case 3:
-                    chartLink = chartLink365Days;
-                    break;
-                default:
-                    cout << "Invalid choice. No chart displayed.\n";
-                    file.close();
-                    return;
-            }
+        vector<string_view> words;
+        vector<StockCommand> writes;
+        StockCommand command;
+        string error;
+        size_t begin = 0, newline, answered = 0;
+        while ((newline = connection.input.find('\n', begin)) != string::npos) {
+            splitWords(string_view(connection.input).substr(begin, newline - begin), words);
+            begin = newline + 1;
+            if (words.empty() || words[0][0] == '#') continue;
 
-            if (!chartLink.empty()) {
-                cout << "Opening chart for " << ticker << " at " << chartLink << endl;
-                openURL(chartLink);
+            if (!parseCommand(words, command, error)) {
+                publish(writes);
+                connection.output.writeNote(error);
+            } else if (command.writes()) {
+                writes.push_back(move(command));  // answered once published, before anything is sent
+            } else if (command.kind == StockCommand::Predict) {
+                publish(writes);
+                connection.output.writeNote("predict is not served.");
+            } else if (command.kind == StockCommand::Stats) {
+                publish(writes);
+                writeStats(connection.output);
             } else {
-                cout << "No chart available for the selected period.\n";
+                publish(writes);
+                tree.read([&](StockTree& live) { answerQuery(live, command, connection.output); });
             }
-            file.close();
-            return;
+            connection.output.writeLine("");
+            ++answered;
         }
+        publish(writes);
+        connection.input.erase(0, begin);
+        requests.fetch_add(answered, memory_order_relaxed);
+        return connection.input.size() <= MAX_LINE_BYTES;
     }
 
-    cerr << "Error: Stock ticker " << ticker << " not found.\n";
-    file.close();
-}
-void findHighestPrice(AVLTreeNode* node, StockData& highest) {
-    if (!node) return;
+    // Function to send buffered responses; false if the client went away
+    bool sendResponses(Connection& connection) {
+        while (true) {
+            string_view pending = connection.output.buffered();
+            if (pending.empty()) return true;
+            ssize_t sent;
+            {
+                STOCK_STATS_ONLY(ScopedLatency timer(stockStats.outputWrite);)
+                sent = send(connection.fd, pending.data(), pending.size(), MSG_NOSIGNAL);
+            }
+            if (sent < 0) return errno == EAGAIN || errno == EINTR;
+            STOCK_STATS_ONLY(stockStats.outputBytes.add(uint64_t(sent));)
+            connection.output.consume(size_t(sent));
+        }
+    }
 
-    if (node->stock.lastPrice > highest.lastPrice) {
-        highest = node->stock;
+    // Function to register the events the connection now waits for
+    void watch(int epollFd, Connection& connection) {
+        size_t backlog = connection.output.buffered().size();
+        uint32_t interest = backlog ? uint32_t(EPOLLOUT) : 0;
+        if (!connection.inputClosed && backlog < MAX_BACKLOG) interest |= EPOLLIN | EPOLLRDHUP;
+        if (interest == connection.interest) return;
+        epoll_event event = {};
+        event.events = interest;
+        event.data.fd = connection.fd;
+        epoll_ctl(epollFd, connection.interest ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, connection.fd, &event);
+        connection.interest = interest;
     }
 
-    findHighestPrice(node->left, highest);
-    findHighestPrice(node->right, highest);
-}
+    void acceptClients(int epollFd, unordered_map<int, unique_ptr<Connection>>& connections) {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            if (!unixSocket) {
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            auto& connection = connections[fd] = make_unique<Connection>(fd, format);
+            watch(epollFd, *connection);
+        }
+    }
+
+    void workerLoop() {
+        int epollFd = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;  // wake one thread per new client
+        event.data.fd = listenFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+        event.events = EPOLLIN;
+        event.data.fd = stopPipe[0];
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, stopPipe[0], &event);
+
+        unordered_map<int, unique_ptr<Connection>> connections;
+        epoll_event events[64];
+        bool stopping = false;
+        while (!stopping) {
+            int ready = epoll_wait(epollFd, events, 64, -1);
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == stopPipe[0]) {
+                    stopping = true;
+                    continue;
+                }
+                if (fd == listenFd) {
+                    acceptClients(epollFd, connections);
+                    continue;
+                }
 
-void findLowestPrice(AVLTreeNode* node, StockData& lowest) {
-    if (!node) return;
+                auto it = connections.find(fd);
+                if (it == connections.end()) continue;
+                Connection& connection = *it->second;
+                bool open = !(events[i].events & EPOLLERR);
+                if (open && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !connection.inputClosed) {
+                    // Keep answering what arrived before the client shut its side
+                    if (!readRequests(connection)) connection.inputClosed = true;
+                }
+                open = open && sendResponses(connection);
+                if (!open || (connection.inputClosed && connection.output.buffered().empty())) {
+                    close(fd);
+                    connections.erase(it);
+                    continue;
+                }
+                watch(epollFd, connection);
+            }
+        }
 
-    if (node->stock.lastPrice < lowest.lastPrice) {
-        lowest = node->stock;
+        for (auto& entry : connections) close(entry.first);
+        close(epollFd);
     }
 
-    findLowestPrice(node->left, lowest);
-    findLowestPrice(node->right, lowest);
-}
+public:
+    StockServer(ConcurrentStockTree& tree, OutputFormat format)
+        : tree(tree), format(format), listenFd(-1), unixSocket(false), stopPipe{-1, -1}, requests(0) {}
 
-void fetchByRange(AVLTreeNode* node, float minPrice, float maxPrice) {
-    if (!node) return;
+    ~StockServer() {
+        stop();
+    }
 
-    if (node->stock.lastPrice >= minPrice) {
-        fetchByRange(node->left, minPrice, maxPrice);
+    // Function to listen on address and start `threads` I/O threads (0 = all cores)
+    bool start(const ServerAddress& address, int threads = 0) {
+        listenFd = openSocket(address, true);
+        if (listenFd < 0 || pipe2(stopPipe, O_CLOEXEC) != 0) return false;
+        fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+        unixSocket = address.unixSocket;
+        if (threads <= 0) threads = max(1, int(thread::hardware_concurrency()));
+        for (int i = 0; i < threads; ++i) workers.emplace_back(&StockServer::workerLoop, this);
+        return true;
     }
 
-    if (node->stock.lastPrice >= minPrice && node->stock.lastPrice <= maxPrice) {
-        cout << "Ticker: " << node->stock.ticker
-             << ", Open: " << node->stock.open
-             << ", Day High: " << node->stock.dayHigh
-             << ", Day Low: " << node->stock.dayLow
-             << ", Last Price: " << node->stock.lastPrice << endl;
+    // Function to close every connection and join the I/O threads
+    void stop() {
+        if (!workers.empty()) {
+            char wake = 1;
+            if (write(stopPipe[1], &wake, 1) != 1) cerr << "Error: Could not stop the server threads." << endl;
+            for (auto& worker : workers) worker.join();
+            workers.clear();
+        }
+        for (int fd : {listenFd, stopPipe[0], stopPipe[1]}) {
+            if (fd >= 0) close(fd);
+        }
+        listenFd = stopPipe[0] = stopPipe[1] = -1;
     }
 
-    if (node->stock.lastPrice <= maxPrice) {
-        fetchByRange(node->right, minPrice, maxPrice);
+    long long requestCount() const {
+        return requests.load();
     }
-}
+};
 
-void fetchByName(AVLTreeNode* node, const string& ticker) {
-    if (!node) {
-        cout << "Stock with ticker " << ticker << " not found." << endl;
+// Function to load a running server from `connections` client threads for
+// `seconds`. Each client sends `depth` requests at a time (80% get, 10%
+// narrow price range, 5% high/low, 5% update) and waits for their answers;
+// a request's latency runs from the send of its batch to the end of its
+// response. Prints throughput and latency percentiles.
+void runLoadTest(const ServerAddress& address, const vector<string>& tickers, int connections, double seconds,
+                 int depth) {
+    if (tickers.empty()) {
+        cerr << "Error: No stocks loaded for the load test." << endl;
         return;
     }
 
-    if (node->stock.ticker < ticker) {
-        fetchByName(node->right, ticker);
-    } else if (node->stock.ticker > ticker) {
-        fetchByName(node->left, ticker);
-    } else {
-        cout << "Ticker: " << node->stock.ticker
-             << ", Open: " << node->stock.open
-             << ", Day High: " << node->stock.dayHigh
-             << ", Day Low: " << node->stock.dayLow
-             << ", Last Price: " << node->stock.lastPrice << endl;
+    vector<vector<float>> latencies(static_cast<size_t>(connections));  // microseconds, per client
+    atomic<int> failed(0);
+    auto deadline = chrono::steady_clock::now() + chrono::duration<double>(seconds);
+    auto start = chrono::steady_clock::now();
+    vector<thread> clients;
+    for (int c = 0; c < connections; ++c) {
+        clients.emplace_back([&, c] {
+            int fd = openSocket(address, false);
+            if (fd < 0) {
+                ++failed;
+                return;
+            }
+            mt19937 random(7 + c);
+            uniform_int_distribution<size_t> pickTicker(0, tickers.size() - 1);
+            uniform_real_distribution<float> pickPrice(1.0f, 1000.0f);
+            vector<char> input(1 << 16);
+            string batch;
+            char number[32];
+
+            while (chrono::steady_clock::now() < deadline) {
+                batch.clear();
+                for (int r = 0; r < depth; ++r) {
+                    unsigned kind = random() % 100;
+                    const string& ticker = tickers[pickTicker(random)];
+                    if (kind < 80) {
+                        batch += "get " + ticker + "\n";
+                    } else if (kind < 90) {
+                        float low = pickPrice(random);
+                        batch += "range ";
+                        batch.append(number, to_chars(number, number + 32, low).ptr);
+                        batch += ' ';
+                        batch.append(number, to_chars(number, number + 32, low + 0.05f).ptr);
+                        batch += '\n';
+                    } else if (kind < 95) {
+                        batch += kind % 2 ? "high\n" : "low\n";
+                    } else {
+                        string price(number, to_chars(number, number + 32, pickPrice(random)).ptr);
+                        batch += "update " + ticker + " " + price + " " + price + " " + price + " " + price + "\n";
+                    }
+                }
+
+                auto sentAt = chrono::steady_clock::now();
+                for (size_t offset = 0; offset < batch.size();) {
+                    ssize_t sent = send(fd, batch.data() + offset, batch.size() - offset, MSG_NOSIGNAL);
+                    if (sent <= 0) {
+                        ++failed;
+                        close(fd);
+                        return;
+                    }
+                    offset += size_t(sent);
+                }
+
+                // A response ends with an empty line
+                int answered = 0;
+                bool lineStart = true;
+                while (answered < depth) {
+                    ssize_t received = recv(fd, input.data(), input.size(), 0);
+                    if (received <= 0) {
+                        ++failed;
+                        close(fd);
+                        return;
+                    }
+                    for (ssize_t i = 0; i < received; ++i) {
+                        if (input[size_t(i)] != '\n') {
+                            lineStart = false;
+                        } else if (!lineStart) {
+                            lineStart = true;
+                        } else {
+                            ++answered;
+                            latencies[size_t(c)].push_back(
+                                chrono::duration<float, micro>(chrono::steady_clock::now() - sentAt).count());
+                        }
+                    }
+                }
+            }
+            close(fd);
+        });
     }
-}
+    for (auto& client : clients) client.join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-double mean(const vector<double>& data) {
-    double sum = accumulate(data.begin(), data.end(), 0.0);
-    return sum / data.size();
+    vector<float> all;
+    for (const auto& client : latencies) all.insert(all.end(), client.begin(), client.end());
+    if (failed) cerr << "Error: " << failed << " of " << connections << " clients failed." << endl;
+    if (all.empty()) return;
+    sort(all.begin(), all.end());
+    auto percentile = [&all](double p) { return all[min(all.size() - 1, size_t(p * all.size()))]; };
+    cout << connections << " connections, " << depth << " requests in flight each: " << (long long)(all.size() / elapsed)
+         << " requests/s, latency p50 " << percentile(0.50) << " us, p99 " << percentile(0.99) << " us, max "
+         << all.back() << " us" << endl;
 }
+#endif
 
-// Function to calculate linear regression coefficients (slope and intercept)
-void linearRegression(const vector<double>& x, const vector<double>& y, double& slope, double& intercept) {
-    double x_mean = mean(x);
-    double y_mean = mean(y);
+// Compile with -DSTOCK_NO_MAIN to use this file as a library (the benchmarks do)
+#ifndef STOCK_NO_MAIN
+int main(int argc, char* argv[]) {
+    // Before the streams are first used: buffered stdin lets --run tell when
+    // no more input is waiting
+    ios::sync_with_stdio(false);
 
-    double numerator = 0.0;
-    double denominator = 0.0;
+    StockTree stockTree;
+    vector<StockData> stockList;
+    ChartTable charts;
+    string stockFile = "C:\\Users\\ASUS\\Desktop\\ads_sem5\\livestock.csv";
+    string historyFile = "C:\\Users\\ASUS\\Desktop\\ads_sem5\\history.stk";
+    string teslaFile = "C:\\Users\\ASUS\\Desktop\\ads_sem5\\Tesla.csv";
 
-    for (size_t i = 0; i < x.size(); ++i) {
-        numerator += (x[i] - x_mean) * (y[i] - y_mean);
-        denominator += (x[i] - x_mean) * (x[i] - x_mean);
+    // Options go before the mode and apply to all of them: --stocks <livestock
+    // csv>, --history <history store>, --tesla <Tesla csv>, --stats-every
+    // <seconds> to write the statistics to stderr periodically, --watch to
+    // apply rewrites of the stock file while the menu or server runs, and
+    // --ticks <tick file | -> to replay a tick stream into the server's tree
+    vector<string> args(argv + 1, argv + argc);
+    size_t optionEnd = 0;
+    double statsInterval = 0.0;
+    bool watchStockFile = false;
+    string tickSource;
+    while (optionEnd < args.size()) {
+        const string& option = args[optionEnd];
+        if (option == "--watch") {
+            watchStockFile = true;
+            ++optionEnd;
+            continue;
+        }
+        if (optionEnd + 1 == args.size())
+            break;
+        else if (option == "--stocks")
+            stockFile = args[optionEnd + 1];
+        else if (option == "--history")
+            historyFile = args[optionEnd + 1];
+        else if (option == "--tesla")
+            teslaFile = args[optionEnd + 1];
+        else if (option == "--stats-every")
+            statsInterval = atof(args[optionEnd + 1].c_str());
+        else if (option == "--ticks")
+            tickSource = args[optionEnd + 1];
+        else
+            break;
+        optionEnd += 2;
     }
+    args.erase(args.begin(), args.begin() + optionEnd);
+    string mode = args.empty() ? "" : args[0];
 
-    if (denominator == 0) {
-        cerr << "Error: Denominator for slope calculation is zero." << endl;
-        return;
+#ifndef STOCK_NO_STATS
+    unique_ptr<StatsReporter> statsReporter;
+    if (statsInterval > 0) statsReporter = make_unique<StatsReporter>(statsInterval);
+#else
+    if (statsInterval > 0) cerr << "Error: Statistics are compiled out (STOCK_NO_STATS)." << endl;
+#endif
+#ifndef __linux__
+    if (watchStockFile) cerr << "Error: --watch needs inotify and is only available on Linux." << endl;
+#endif
+
+    // History import: --import-history <history dir | list file> [store file]
+    if (args.size() >= 2 && mode == "--import-history") {
+        string storeFile = args.size() >= 3 ? args[2] : historyFile;
+        unordered_map<string, string> filesByTicker;
+        if (!collectHistoryFiles(args[1], filesByTicker)) return 1;
+
+        HistoryStore history;
+        history.load(storeFile);  // appends to an existing store
+        size_t rows = 0;
+        for (const auto& entry : filesByTicker) rows += history.importCSV(entry.first, entry.second);
+        if (!history.save(storeFile)) return 1;
+        cout << "Imported " << rows << " rows of " << filesByTicker.size() << " symbols into " << storeFile
+             << " (" << history.compressedBytes() << " bytes compressed)" << endl;
+        return 0;
     }
 
-    slope = numerator / denominator;
-    intercept = y_mean - slope * x_mean;
-}
+    // Restart from the binary snapshot when it matches the stock file;
+    // otherwise parse the file and write a fresh snapshot for next time
+    StockSnapshot snapshot;
+    const string snapshotFile = stockFile + ".snap";
+    if (!snapshot.open(snapshotFile, stockFile) || !snapshot.loadInto(stockTree)) {
+        snapshot.close();
+        loadStockData(stockFile, stockList);
+        stockTree.bulkLoad(stockList);
+        if (!stockList.empty()) StockSnapshot::write(snapshotFile, stockFile, stockList);
+    }
 
-// Function to predict a future stock price
-double predictPrice(int dayIndex, double slope, double intercept) {
-    return slope * dayIndex + intercept;
-}
+    // Nightly batch: --predict-batch <history store | dir | list file> <output.csv> [threads]
+    if (args.size() >= 3 && mode == "--predict-batch") {
+        int threads = args.size() >= 4 ? atoi(args[3].c_str()) : 0;
+        int priceColumnIndex = 4;  // same 'close' column as the Tesla prediction
+        predictBatch(stockTree, args[1], priceColumnIndex, args[2], threads);
+        return 0;
+    }
 
-// Function to read stock prices from a CSV file
-vector<double> readPricesFromCSV(const string& filename, int priceColumnIndex) {
-    vector<double> prices;
-    ifstream file(filename);
+    // Tick replay: --replay <tick file | -> [bars csv]
+    if (args.size() >= 2 && mode == "--replay") {
+        ofstream barsFile;
+        if (args.size() >= 3) {
+            barsFile.open(args[2], ios::trunc);
+            if (!barsFile.is_open()) {
+                cerr << "Error: Could not open the bar file " << args[2] << endl;
+                return 1;
+            }
+            barsFile << "ticker,interval,start,open,high,low,close,volume\n";
+        }
 
-    if (!file.is_open()) {
-        cerr << "Error: Could not open file " << filename << endl;
-        return prices;
+        TickReplay replay(args[1]);
+        stockTree.forEach([&replay](const StockData& stock) { replay.seed(stock); });
+        atomic<bool> stopping(false);
+        auto started = chrono::steady_clock::now();
+        bool replayed = replay.run([&](TickPublication& publication) {
+            applyTickUpdates(stockTree, publication.updates);
+            if (barsFile.is_open()) writeBars(barsFile, publication.bars);
+        }, stopping);
+        if (!replayed) return 1;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cout << "Replayed " << replay.ticks() << " ticks of " << replay.symbolCount() << " symbols in " << seconds
+             << " s (" << (long long)(seconds > 0 ? replay.ticks() / seconds : 0) << " ticks/s): " << replay.bars()
+             << " bars, " << replay.publications() << " publications." << endl;
+        return 0;
     }
 
-    string line;
-    bool isFirstLine = true;
+    // Full listing and headless requests share the output format argument:
+    //   --dump [table | csv | json]
+    //   --run [command file | -] [table | csv | json]   (- or nothing reads stdin)
+    if (mode == "--dump" || mode == "--run") {
+        size_t formatArg = mode == "--dump" ? 1 : 2;
+        OutputFormat format = OutputFormat::Table;
+        if (args.size() > formatArg && !parseOutputFormat(args[formatArg], format)) {
+            cerr << "Error: Unknown output format " << args[formatArg] << " (use table, csv or json)." << endl;
+            return 1;
+        }
+        StockWriter writer(cout, format);
+        if (mode == "--dump") {
+            stockTree.printTree(writer);
+            return 0;
+        }
 
-    while (getline(file, line)) {
-        if (isFirstLine) {
-            isFirstLine = false;
-            continue;
+        CommandSession session(stockTree, writer, historyFile);
+        if (args.size() < 2 || args[1] == "-") return session.run(cin) ? 1 : 0;
+        ifstream commands(args[1]);
+        if (!commands.is_open()) {
+            cerr << "Error: Could not open command file " << args[1] << endl;
+            return 1;
+        }
+        return session.run(commands) ? 1 : 0;
+    }
+
+#ifdef __linux__
+    // Query service: --serve <port | unix socket path> [io threads] [table | csv | json]
+    // Stops on SIGINT or SIGTERM.
+    if (args.size() >= 2 && mode == "--serve") {
+        int threads = args.size() >= 3 ? atoi(args[2].c_str()) : 0;
+        OutputFormat format = OutputFormat::JsonLines;
+        if (args.size() >= 4 && !parseOutputFormat(args[3], format)) {
+            cerr << "Error: Unknown output format " << args[3] << " (use table, csv or json)." << endl;
+            return 1;
         }
+        if (stockList.empty()) snapshot.readStocks(stockList);
+        ConcurrentStockTree sharedTree;
+        sharedTree.bulkLoad(stockList);
 
-        stringstream ss(line);
-        string value;
-        vector<string> row;
+        // Block the stop signals before the I/O threads start so only sigwait sees them
+        sigset_t stopSignals;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
 
-        while (getline(ss, value, ',')) {
-            row.push_back(value);
+        ServerAddress address = parseServerAddress(args[1]);
+        StockServer server(sharedTree, format);
+        if (!server.start(address, threads)) return 1;
+        cout << "Serving " << stockList.size() << " stocks on " << (address.unixSocket ? address.path : "127.0.0.1:" + args[1])
+             << endl;
+
+        // --watch: the first reload catches rewrites since the file was loaded
+        StockFileWatcher watcher(stockFile);
+        atomic<bool> stopping(false);
+        thread reloader;
+        auto track = [&stockList](auto visit) { for_each(stockList.begin(), stockList.end(), visit); };
+        if (watchStockFile && watcher.start(track)) {
+            reloader = thread([&] {
+                ReloadCounts counts;
+                bool changed = true;
+                while (!stopping.load()) {
+                    if (changed && watcher.reload(sharedTree, counts)) printReload(stockFile, counts);
+                    changed = watcher.wait(250);
+                }
+            });
         }
 
-        if (row.size() > priceColumnIndex) {
-            try {
-                prices.push_back(stod(row[priceColumnIndex])); // Convert the specific column to double
-            } catch (const invalid_argument& e) {
-                cerr << "Warning: Skipping non-numeric data: " << row[priceColumnIndex] << endl;
-                continue;
-            }
+        // --ticks: publish the tick stream into the served tree
+        thread tickFeed;
+        if (!tickSource.empty()) {
+            tickFeed = thread([&] {
+                TickReplay replay(tickSource);
+                for (const auto& stock : stockList) replay.seed(stock);
+                replay.run([&sharedTree](TickPublication& publication) {
+                    sharedTree.write([&publication](StockTree& tree) { applyTickUpdates(tree, publication.updates); });
+                }, stopping);
+            });
         }
-    }
 
-    file.close();
-    return prices;
-}
+        int signal;
+        sigwait(&stopSignals, &signal);
+        stopping.store(true);
+        if (tickFeed.joinable()) tickFeed.join();
+        if (reloader.joinable()) reloader.join();
+        server.stop();
+        if (address.unixSocket) unlink(address.path.c_str());
+        cout << "Answered " << server.requestCount() << " requests." << endl;
+        return 0;
+    }
 
-int main() {
-    AVLTree stockTree;
-    vector<StockData> stockList;
-    loadStockData("C:\\Users\\ASUS\\Desktop\\ads_sem5\\livestock.csv", stockList);
+    // Load generator: --load <port | unix socket path> [connections] [seconds] [requests in flight]
+    if (args.size() >= 2 && mode == "--load") {
+        int connections = args.size() >= 3 ? max(1, atoi(args[2].c_str())) : 4;
+        double seconds = args.size() >= 4 ? atof(args[3].c_str()) : 5.0;
+        int depth = args.size() >= 5 ? max(1, atoi(args[4].c_str())) : 16;
+        vector<string> tickers;
+        stockTree.forEach([&tickers](const StockData& stock) { tickers.push_back(stock.ticker); });
+        runLoadTest(parseServerAddress(args[1]), tickers, connections, seconds, depth);
+        return 0;
+    }
+#endif
 
-    for (const auto& stock : stockList) {
-        stockTree.insert(stock);
+    // Concurrency check: --stress [seconds per round] [writer threads] [max reader threads]
+    if (mode == "--stress") {
+        double seconds = args.size() >= 2 ? atof(args[1].c_str()) : 1.0;
+        int writers = args.size() >= 3 ? atoi(args[2].c_str()) : 1;
+        int maxReaders = args.size() >= 4 ? atoi(args[3].c_str()) : max(1, int(thread::hardware_concurrency()));
+        if (stockList.empty()) snapshot.readStocks(stockList);
+        runStressTest(stockList, seconds, max(writers, 0), max(maxReaders, 1));
+        return 0;
     }
 
+    if (snapshot.isOpen())
+        charts.attach(stockFile, snapshot);
+    else
+        charts.build(stockFile, stockList);
+
     int choice;
     string ticker;
     StockData stockData;
     float minPrice, maxPrice;
-    StockData highestStock, lowestStock;
+    HistoryStore history;
+    PriceModel teslaModel(PREDICTION_WINDOW_DAYS);
+    vector<double> teslaPrices;
+    const StockData* highestStock;
+    const StockData* lowestStock;
+
+#ifdef __linux__
+    // --watch: apply rewrites of the stock file before each command
+    StockFileWatcher watcher(stockFile);
+    ReloadCounts reloadCounts;
+    bool watching = watchStockFile && watcher.start([&stockTree](auto visit) { stockTree.forEach(visit); });
+    if (watching && watcher.reload(stockTree, reloadCounts)) printReload(stockFile, reloadCounts);
+#endif
 
     do {
         cout << "\nMenu:\n";
@@ -494,6 +7135,9 @@ int main() {
         cout << "10. Exit\n";
         cout << "Enter your choice: ";
         cin >> choice;
+#ifdef __linux__
+        if (watching && watcher.wait(0) && watcher.reload(stockTree, reloadCounts)) printReload(stockFile, reloadCounts);
+#endif
 
         switch (choice) {
             case 1:
@@ -518,27 +7162,33 @@ int main() {
                 stockTree.deleteStock(ticker);
                 break;
 
-            case 4:
+            case 4: {
                 cout << "Displaying all stocks:\n";
-                stockTree.printTree();
+                StockWriter writer;
+                stockTree.printTree(writer);
                 break;
+            }
 
             case 5:
                 cout << "Enter ticker to visualize chart: ";
                 cin >> ticker;
-                visualize("C:\\Users\\ASUS\\Desktop\\ads_sem5\\livestock.csv", ticker);
+                visualize(charts, ticker);
                 break;
 
             case 6:
-                highestStock = stockList[0];  // Initialize with the first stock as highest
-                findHighestPrice(stockTree.getRoot(), highestStock);
-                cout << "Highest Stock Price: " << highestStock.ticker << " - " << highestStock.lastPrice << endl;
+                highestStock = stockTree.highest();
+                if (highestStock)
+                    cout << "Highest Stock Price: " << highestStock->ticker << " - " << highestStock->lastPrice << endl;
+                else
+                    cout << "No stocks loaded.\n";
                 break;
 
             case 7:
-                lowestStock = stockList[0];  // Initialize with the first stock as lowest
-                findLowestPrice(stockTree.getRoot(), lowestStock);
-                cout << "Lowest Stock Price: " << lowestStock.ticker << " - " << lowestStock.lastPrice << endl;
+                lowestStock = stockTree.lowest();
+                if (lowestStock)
+                    cout << "Lowest Stock Price: " << lowestStock->ticker << " - " << lowestStock->lastPrice << endl;
+                else
+                    cout << "No stocks loaded.\n";
                 break;
 
             case 8:
@@ -546,57 +7196,118 @@ int main() {
                 cout << "Fetch Stocks By:\n";
                 cout << "1. By Price Range\n";
                 cout << "2. By Ticker Name\n";
+                cout << "3. Rank of Ticker by Last Price\n";
+                cout << "4. Top Movers\n";
+                cout << "5. By Ticker Prefix\n";
+                cout << "6. Custom Screen\n";
                 cout << "Enter your choice: ";
                 cin >> fetchChoice;
 
                 if (fetchChoice == 1) {
+                    int fieldChoice;
+                    cout << "Range over which price?\n";
+                    cout << "1. Last Price\n";
+                    cout << "2. Open\n";
+                    cout << "3. Day High\n";
+                    cout << "4. Day Low\n";
+                    cout << "5. Change % from Open\n";
+                    cout << "Enter your choice: ";
+                    cin >> fieldChoice;
+                    if (fieldChoice < 1 || fieldChoice > PRICE_FIELD_COUNT) {
+                        cout << "Invalid choice. Returning to the main menu.\n";
+                        break;
+                    }
                     cout << "Enter minimum price: ";
                     cin >> minPrice;
                     cout << "Enter maximum price: ";
                     cin >> maxPrice;
                     cout << "Stocks within the price range (" << minPrice << ", " << maxPrice << "):\n";
-                    fetchByRange(stockTree.getRoot(), minPrice, maxPrice);
+                    StockWriter writer;
+                    fetchByRange(stockTree, PriceField(fieldChoice - 1), minPrice, maxPrice, writer);
                 } else if (fetchChoice == 2) {
                     cout << "Enter ticker to fetch: ";
                     cin >> ticker;
-                    fetchByName(stockTree.getRoot(), ticker);
+                    StockWriter writer;
+                    fetchByName(stockTree, ticker, writer);
+                } else if (fetchChoice == 3) {
+                    cout << "Enter ticker to rank: ";
+                    cin >> ticker;
+                    int rank = stockTree.rankByPrice(ticker);
+                    if (rank)
+                        cout << ticker << " is ranked " << rank << " of " << stockTree.size() << " by last price.\n";
+                    else
+                        cout << "Stock with ticker " << ticker << " not found." << endl;
+                } else if (fetchChoice == 4) {
+                    int count;
+                    cout << "How many movers per side? ";
+                    cin >> count;
+                    StockWriter writer(cout, OutputFormat::Table, true);
+                    writer.writeLine("Top gainers:");
+                    fetchTopMovers(stockTree, count, true, writer);
+                    writer.writeLine("Top losers:");
+                    fetchTopMovers(stockTree, count, false, writer);
+                } else if (fetchChoice == 5) {
+                    int count;
+                    cout << "Enter ticker prefix: ";
+                    cin >> ticker;
+                    cout << "How many stocks at most? ";
+                    cin >> count;
+                    StockWriter writer;
+                    fetchByPrefix(stockTree, ticker, count, writer);
+                } else if (fetchChoice == 6) {
+                    string line, error;
+                    StockScreen screen;
+                    cout << "Enter screen (e.g. last between 10 and 50 and last > open sort change top 10): ";
+                    getline(cin >> ws, line);
+                    if (!screen.parse(line, error)) {
+                        cerr << "Error: " << error << endl;
+                        break;
+                    }
+                    StockWriter writer;
+                    fetchByScreen(stockTree, screen, writer);
                 } else {
                     cout << "Invalid choice. Returning to the main menu.\n";
                 }
                 break;
 
             case 9: {  // Predict stock price
-                string filename = "C:\\Users\\ASUS\\Desktop\\ads_sem5\\Tesla.csv";
-                int priceColumnIndex = 4;  // Assuming the 'close' price column index is 4
-
-                // Read stock prices from CSV
-                vector<double> stockPrices = readPricesFromCSV(filename, priceColumnIndex);
-                int n = stockPrices.size();
+                // The history is read once; later predictions reuse the fitted model.
+                // Closing prices come from the history store, which imports
+                // Tesla.csv the first time it is needed.
+                if (!teslaModel.dayCount()) {
+                    history.load(historyFile);
+                    if (!history.contains("TSLA")) {
+                        if (history.importCSV("TSLA", teslaFile)) history.save(historyFile);
+                    }
+                    history.column("TSLA", OhlcvField::Close, teslaPrices);
+                    for (double price : teslaPrices) teslaModel.addPrice(price);
+                }
 
-                if (n == 0) {
+                if (teslaModel.dayCount() == 0) {
                     cerr << "Error: No valid data found in CSV file." << endl;
                     break;
                 }
 
-                // Generate days vector for regression
-                vector<double> days(n);
-                for (int i = 0; i < n; ++i) {
-                    days[i] = i;
-                }
-
-                // Calculate regression coefficients
-                double slope = 0.0, intercept = 0.0;
-                linearRegression(days, stockPrices, slope, intercept);
-
-                // Check if slope calculation succeeded
-                if (slope == 0 && intercept == 0) {
+                // Predict the next day's price
+                double predictedPrice, recentPrediction;
+                if (!teslaModel.predictNext(predictedPrice)) {
                     cerr << "Error: Regression calculation failed." << endl;
                     break;
                 }
-
-                // Predict the next day's price
-                double predictedPrice = predictPrice(n, slope, intercept);
+                size_t n = teslaModel.dayCount();
                 cout << "Predicted price for the next day (day " << n << ") is: " << predictedPrice << endl;
+                if (teslaModel.predictNext(recentPrediction, true))
+                    cout << "Using only the last " << min(n, PREDICTION_WINDOW_DAYS) << " days: " << recentPrediction << endl;
+
+                // Indicators over the same history
+                if (n > INDICATOR_WINDOW_DAYS) {
+                    vector<double> sma = movingAverage(teslaPrices, INDICATOR_WINDOW_DAYS);
+                    vector<double> ema = exponentialMovingAverage(teslaPrices, 2.0 / (INDICATOR_WINDOW_DAYS + 1));
+                    vector<double> volatility = rollingStdDev(simpleReturns(teslaPrices), INDICATOR_WINDOW_DAYS);
+                    cout << INDICATOR_WINDOW_DAYS << "-day moving average: " << sma.back() << endl;
+                    cout << INDICATOR_WINDOW_DAYS << "-day exponential average: " << ema.back() << endl;
+                    cout << INDICATOR_WINDOW_DAYS << "-day volatility: " << volatility.back() * 100 << "%" << endl;
+                }
                 break;
             }
 
@@ -611,4 +7322,4 @@ int main() {
 
     return 0;
 }
-
+#endif